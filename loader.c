@@ -38,6 +38,11 @@
 #include <linux/capability.h>
 #include <linux/cpumask.h>
 #include "tls_common.h"
+#include "tls_daemon.h"
+#include "tls_select.h"
+#include "tls_admit.h"
+#include "tls_warm.h"
+#include "tls_session.h"
 #include "tls_inet.h"
 #include "tls_unix.h"
 #include "tls_upgrade.h"
@@ -53,8 +58,12 @@ MODULE_LICENSE("GPL");
 MODULE_AUTHOR(DRIVER_AUTHOR);
 MODULE_DESCRIPTION(DRIVER_DESC);
 
-/* The TLS protocol structures to be filled and registered */
+/* How sockets reach their daemons: loopback TCP or abstract unix sockets */
 static int internal_transport_mode = INET_MODE;
+module_param(internal_transport_mode, int, 0444);
+MODULE_PARM_DESC(internal_transport_mode, "0 = loopback TCP, 1 = unix domain sockets");
+
+/* The TLS protocol structures to be filled and registered */
 static struct proto tls_prot;
 static struct proto_ops tls_proto_ops;
 static struct net_protocol tls_protocol;
@@ -77,6 +86,29 @@ static int __init ssa_init(void) {
 
 	printk(KERN_INFO "Initializing Secure Socket API module\n");
 	printk(KERN_INFO "Found %u CPUs\n", nr_cpu_ids);
+
+	err = tls_daemon_setup();
+	if (err != 0) {
+		goto out;
+	}
+	err = tls_select_setup();
+	if (err != 0) {
+		goto out_daemon_cleanup;
+	}
+	err = tls_admit_setup();
+	if (err != 0) {
+		goto out_select_cleanup;
+	}
+	if (internal_transport_mode == INET_MODE) {
+		err = tls_warm_setup();
+		if (err != 0) {
+			goto out_admit_cleanup;
+		}
+	}
+	err = tls_session_setup();
+	if (err != 0) {
+		goto out_warm_cleanup;
+	}
 	
 	/* initialize our global data structures for TLS handling */
 	tls_setup();
@@ -89,7 +121,7 @@ static int __init ssa_init(void) {
 		err = set_tls_prot_unix_stream(&tls_prot, &tls_proto_ops);
 	}
 	if (err != 0) {
-		goto out;
+		goto out_tls_cleanup;
 	}
 
 	/* Initialize the TLS protocol */
@@ -99,7 +131,7 @@ static int __init ssa_init(void) {
 		printk(KERN_INFO "TLS protocol registration was successful\n");
 	} else {
 		printk(KERN_ALERT "TLS Protocol registration failed\n");
-		goto out;
+		goto out_prot_cleanup;
 	}
 
 	/*
@@ -110,6 +142,7 @@ static int __init ssa_init(void) {
 	kallsyms_err = kallsyms_lookup_name("tcp_protocol");
 	if (kallsyms_err == 0) {
 		printk(KERN_ALERT "kallsyms_lookup_name failed to retrieve tcp_protocol address\n");
+		err = -ENOENT;
 		goto out_proto_unregister;
 	}
 
@@ -137,8 +170,25 @@ static int __init ssa_init(void) {
 
 out:
 	return err;
+	/* Everything set up so far is torn down in the reverse order,
+	 * so no pernet ops or netlink family outlive the module */
 out_proto_unregister:
 	proto_unregister(&tls_prot);
+out_prot_cleanup:
+	if (internal_transport_mode == INET_MODE) {
+		inet_stream_cleanup();
+	}
+out_tls_cleanup:
+	tls_cleanup();
+	tls_session_cleanup();
+out_warm_cleanup:
+	tls_warm_cleanup();
+out_admit_cleanup:
+	tls_admit_cleanup();
+out_select_cleanup:
+	tls_select_cleanup();
+out_daemon_cleanup:
+	tls_daemon_cleanup();
 	goto out;
 }
 
@@ -166,6 +216,11 @@ static void __exit ssa_exit(void) {
 	printk(KERN_INFO "Secure Socket API module removed\n");
 	/* Free TLS socket handling data */
 	tls_cleanup();
+	tls_session_cleanup();
+	tls_warm_cleanup();
+	tls_admit_cleanup();
+	tls_select_cleanup();
+	tls_daemon_cleanup();
 }
 
 module_init(ssa_init);
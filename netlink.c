@@ -1,13 +1,85 @@
 #include <net/netlink.h>
 #include <net/genetlink.h>
+#include <linux/file.h>
+#include <linux/fcntl.h>
+#include <linux/notifier.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <net/net_namespace.h>
+#include <net/netns/generic.h>
 
 #include "netlink.h"
 #include "tls_common.h"
+#include "tls_fdref.h"
+#include "tls_daemon.h"
+#include "tls_select.h"
+#include "tls_warm.h"
+#include "tls_session.h"
 
 int nl_fail(struct sk_buff* skb, struct genl_info* info);
 int daemon_cb(struct sk_buff* skb, struct genl_info* info);
 int daemon_data_cb(struct sk_buff* skb, struct genl_info* info);
 int daemon_handshake_cb(struct sk_buff* skb, struct genl_info* info);
+int file_fetch_cb(struct sk_buff* skb, struct genl_info* info);
+
+static atomic_t notify_seq = ATOMIC_INIT(0);
+int daemon_register_cb(struct sk_buff* skb, struct genl_info* info);
+int daemon_unregister_cb(struct sk_buff* skb, struct genl_info* info);
+int selector_attach_cb(struct sk_buff* skb, struct genl_info* info);
+int session_store_cb(struct sk_buff* skb, struct genl_info* info);
+int session_fetch_cb(struct sk_buff* skb, struct genl_info* info);
+static int daemon_release_notify(struct notifier_block* nb, unsigned long event, void* ptr);
+
+static struct notifier_block daemon_release_nb = {
+	.notifier_call = daemon_release_notify,
+};
+
+/* Accepted sockets a daemon hasn't been told about yet. They're sent
+ * in batches from the daemon's work item, so accept never waits on a
+ * daemon. Anything else about a socket goes out only after its accept
+ * does, so a notification for a socket still queued sends the queue
+ * first. Daemons don't wait on each other's queues */
+#define ACCEPT_BATCH_MAX	64
+
+struct pending_accept {
+	struct list_head list;
+	struct net* net; /* holds a reference until sent */
+	struct ssa_accept_record rec;
+};
+
+struct accept_queue {
+	spinlock_t lock; /* guards accepts and count */
+	struct list_head accepts;
+	int count;
+	struct mutex flush_lock; /* keeps batches in order */
+	struct work_struct work;
+	struct net* net;
+	int port_id;
+};
+
+typedef struct accept_net {
+	struct accept_queue queues[MAX_DAEMONS];
+} accept_net_t;
+
+static unsigned int accept_net_id;
+
+static int accept_net_init(struct net* net);
+static void accept_net_exit(struct net* net);
+static struct accept_queue* get_accept_queue(struct net* net, int port_id);
+static void accept_flush_work(struct work_struct* work);
+static void flush_accept_queue(struct accept_queue* queue);
+static void flush_accepts_before(struct net* net, unsigned long id, int port_id);
+static int send_accept_batch(struct list_head* batch, struct net* net, int port_id, int count);
+
+static struct pernet_operations accept_net_ops = {
+	.init = accept_net_init,
+	.exit = accept_net_exit,
+	.id = &accept_net_id,
+	.size = sizeof(accept_net_t),
+};
 
 static const struct nla_policy ssa_nl_policy[SSA_NL_A_MAX + 1] = {
         [SSA_NL_A_UNSPEC] = { .type = NLA_UNSPEC },
@@ -21,6 +93,22 @@ static const struct nla_policy ssa_nl_policy[SSA_NL_A_MAX + 1] = {
 	[SSA_NL_A_OPTNAME] = { .type = NLA_UNSPEC },
 	[SSA_NL_A_OPTVAL] = { .type = NLA_UNSPEC },
 	[SSA_NL_A_RETURN] = { .type = NLA_UNSPEC },
+	[SSA_NL_A_OPTINDEX] = { .type = NLA_UNSPEC },
+	[SSA_NL_A_HANDSHAKE_OPTS] = { .type = NLA_UNSPEC },
+	[SSA_NL_A_FILE_ID] = { .type = NLA_U32 },
+	[SSA_NL_A_FILE_FD] = { .type = NLA_U32 },
+	[SSA_NL_A_DATA_TOTAL] = { .type = NLA_UNSPEC },
+	[SSA_NL_A_SEQ] = { .type = NLA_U32 },
+	[SSA_NL_A_CPU] = { .type = NLA_UNSPEC },
+	[SSA_NL_A_BPF_FD] = { .type = NLA_UNSPEC },
+	[SSA_NL_A_KTLS_FD] = { .type = NLA_UNSPEC },
+	[SSA_NL_A_KTLS_INFO] = { .len = sizeof(struct ssa_ktls_info) },
+	[SSA_NL_A_POOLED] = { .type = NLA_UNSPEC },
+	[SSA_NL_A_ACCEPT_BATCH] = { .type = NLA_UNSPEC },
+	[SSA_NL_A_EARLY_DATA] = { .type = NLA_UNSPEC },
+	[SSA_NL_A_SESSION_KEY] = { .len = sizeof(struct ssa_session_key) },
+	[SSA_NL_A_SESSION] = { .type = NLA_UNSPEC },
+	[SSA_NL_A_SESSION_LIFETIME] = { .type = NLA_U32 },
 };
 
 static struct genl_ops ssa_nl_ops[] = {
@@ -80,27 +168,72 @@ static struct genl_ops ssa_nl_ops[] = {
                 .doit = nl_fail,
                 .dumpit = NULL,
         },
+        /* Commands daemons send need CAP_NET_ADMIN only over the
+         * user namespace owning their network namespace, so a daemon
+         * can serve a container without being root on the host */
         {
                 .cmd = SSA_NL_C_RETURN,
-                .flags = GENL_ADMIN_PERM,
+                .flags = GENL_UNS_ADMIN_PERM,
                 .policy = ssa_nl_policy,
                 .doit = daemon_cb,
                 .dumpit = NULL,
         },
         {
                 .cmd = SSA_NL_C_DATA_RETURN,
-                .flags = GENL_ADMIN_PERM,
+                .flags = GENL_UNS_ADMIN_PERM,
                 .policy = ssa_nl_policy,
                 .doit = daemon_data_cb,
                 .dumpit = NULL,
         },
         {
                 .cmd = SSA_NL_C_HANDSHAKE_RETURN,
-                .flags = GENL_ADMIN_PERM,
+                .flags = GENL_UNS_ADMIN_PERM,
                 .policy = ssa_nl_policy,
                 .doit = daemon_handshake_cb,
                 .dumpit = NULL,
         },
+        {
+                .cmd = SSA_NL_C_FILE_FETCH,
+                .flags = GENL_UNS_ADMIN_PERM,
+                .policy = ssa_nl_policy,
+                .doit = file_fetch_cb,
+                .dumpit = NULL,
+        },
+        {
+                .cmd = SSA_NL_C_DAEMON_REGISTER,
+                .flags = GENL_UNS_ADMIN_PERM,
+                .policy = ssa_nl_policy,
+                .doit = daemon_register_cb,
+                .dumpit = NULL,
+        },
+        {
+                .cmd = SSA_NL_C_DAEMON_UNREGISTER,
+                .flags = GENL_UNS_ADMIN_PERM,
+                .policy = ssa_nl_policy,
+                .doit = daemon_unregister_cb,
+                .dumpit = NULL,
+        },
+        {
+                .cmd = SSA_NL_C_SELECTOR_ATTACH,
+                .flags = GENL_UNS_ADMIN_PERM,
+                .policy = ssa_nl_policy,
+                .doit = selector_attach_cb,
+                .dumpit = NULL,
+        },
+        {
+                .cmd = SSA_NL_C_SESSION_STORE,
+                .flags = GENL_UNS_ADMIN_PERM,
+                .policy = ssa_nl_policy,
+                .doit = session_store_cb,
+                .dumpit = NULL,
+        },
+        {
+                .cmd = SSA_NL_C_SESSION_FETCH,
+                .flags = GENL_UNS_ADMIN_PERM,
+                .policy = ssa_nl_policy,
+                .doit = session_fetch_cb,
+                .dumpit = NULL,
+        },
 };
 
 static const struct genl_multicast_group ssa_nl_grps[] = {
@@ -117,6 +250,7 @@ static struct genl_family ssa_nl_family = {
         .name = "SSA",
         .version = 1,
         .maxattr = SSA_NL_A_MAX,
+        .netnsok = true,
 };
 
 int nl_fail(struct sk_buff* skb, struct genl_info* info) {
@@ -128,6 +262,8 @@ int daemon_cb(struct sk_buff* skb, struct genl_info* info) {
 	struct nlattr* na;
 	unsigned long key;
 	int response;
+	int index = -1;
+	u32 seq = 0;
 	if (info == NULL) {
 		printk(KERN_ALERT "Netlink: Message info is null\n");
 		return -1;
@@ -141,7 +277,14 @@ int daemon_cb(struct sk_buff* skb, struct genl_info* info) {
 		printk(KERN_ALERT "Netlink: Unable to get return value\n");
 	}
 	response = nla_get_u32(na);
-	report_return(key, response);
+	/* Only present for TLS_OPTIONS_BATCH failures */
+	if ((na = info->attrs[SSA_NL_A_OPTINDEX]) != NULL) {
+		index = nla_get_u32(na);
+	}
+	if ((na = info->attrs[SSA_NL_A_SEQ]) != NULL) {
+		seq = nla_get_u32(na);
+	}
+	report_return(genl_info_net(info), info->snd_portid, key, response, index, seq);
         return 0;
 }
 
@@ -149,6 +292,8 @@ int daemon_data_cb(struct sk_buff* skb, struct genl_info* info) {
 	struct nlattr* na;
 	unsigned long key;
 	unsigned int len;
+	unsigned int total = 0;
+	u32 seq = 0;
 	char* data;
 	if (info == NULL) {
 		printk(KERN_ALERT "Netlink: Message info is null\n");
@@ -165,7 +310,15 @@ int daemon_data_cb(struct sk_buff* skb, struct genl_info* info) {
 	}
 	data = nla_data(na);
 	len = nla_len(na);
-	report_data_return(key, data, len);
+	/* Values too big for one message come in several, with
+	 * the full length given on the first */
+	if ((na = info->attrs[SSA_NL_A_DATA_TOTAL]) != NULL) {
+		total = nla_get_u32(na);
+	}
+	if ((na = info->attrs[SSA_NL_A_SEQ]) != NULL) {
+		seq = nla_get_u32(na);
+	}
+	report_data_return(genl_info_net(info), key, data, len, total, seq);
         return 0;
 }
 
@@ -173,6 +326,11 @@ int daemon_handshake_cb(struct sk_buff* skb, struct genl_info* info) {
 	struct nlattr* na;
 	unsigned long key;
 	int response;
+	char* facts = NULL;
+	unsigned int facts_len = 0;
+	struct ssa_ktls_info* ktls = NULL;
+	int ktls_fd = -1;
+	u32 seq = 0;
 	if (info == NULL) {
 		printk(KERN_ALERT "Netlink: Message info is null\n");
 		return -1;
@@ -186,25 +344,247 @@ int daemon_handshake_cb(struct sk_buff* skb, struct genl_info* info) {
 		printk(KERN_ALERT "Netlink: unable to get return value\n");
 	}
 	response = nla_get_u32(na);
-	report_handshake_finished(key, response);
-        return 0;
+	/* Negotiated values the daemon lets us answer locally from now on */
+	if ((na = info->attrs[SSA_NL_A_HANDSHAKE_OPTS]) != NULL) {
+		facts = nla_data(na);
+		facts_len = nla_len(na);
+	}
+	/* The daemon is handing the connection over to kernel TLS */
+	if (info->attrs[SSA_NL_A_KTLS_FD] != NULL && (na = info->attrs[SSA_NL_A_KTLS_INFO]) != NULL) {
+		ktls_fd = nla_get_u32(info->attrs[SSA_NL_A_KTLS_FD]);
+		ktls = nla_data(na);
+	}
+	if ((na = info->attrs[SSA_NL_A_SEQ]) != NULL) {
+		seq = nla_get_u32(na);
+	}
+	return report_handshake_finished(genl_info_net(info), info->snd_portid, key, response, facts, facts_len,
+			ktls_fd, ktls, seq);
+}
+
+/* Opens a file an option named for the daemon asking. Handlers run in
+ * the context of the process that sent the message, so the descriptor
+ * goes into the daemon's table. It's only installed once the reply is
+ * on its way, as nothing could take it back out after that */
+int file_fetch_cb(struct sk_buff* skb, struct genl_info* info) {
+	struct nlattr* na;
+	struct sk_buff* reply;
+	struct file* file;
+	void* msg_head;
+	int fd;
+	int ret;
+	if (info == NULL) {
+		printk(KERN_ALERT "Netlink: Message info is null\n");
+		return -1;
+	}
+	if ((na = info->attrs[SSA_NL_A_FILE_ID]) == NULL) {
+		printk(KERN_ALERT "Netlink: Unable to retrieve file id\n");
+		return -EINVAL;
+	}
+	file = open_ref_file(genl_info_net(info), nla_get_u32(na));
+	if (IS_ERR(file)) {
+		return PTR_ERR(file);
+	}
+	fd = get_unused_fd_flags(O_CLOEXEC);
+	if (fd < 0) {
+		fput(file);
+		return fd;
+	}
+	reply = genlmsg_new(nla_total_size(sizeof(u32)), GFP_KERNEL);
+	if (reply == NULL) {
+		printk(KERN_ALERT "Failed in genlmsg_new [file fetch]\n");
+		ret = -ENOMEM;
+		goto out;
+	}
+	msg_head = genlmsg_put_reply(reply, info, &ssa_nl_family, 0, SSA_NL_C_FILE_FETCH);
+	if (msg_head == NULL) {
+		printk(KERN_ALERT "Failed in genlmsg_put_reply [file fetch]\n");
+		nlmsg_free(reply);
+		ret = -ENOMEM;
+		goto out;
+	}
+	ret = nla_put_u32(reply, SSA_NL_A_FILE_FD, fd);
+	if (ret != 0) {
+		printk(KERN_ALERT "Failed in nla_put (fd) [file fetch]\n");
+		nlmsg_free(reply);
+		goto out;
+	}
+	genlmsg_end(reply, msg_head);
+	ret = genlmsg_reply(reply, info);
+	if (ret != 0) {
+		goto out;
+	}
+	fd_install(fd, file);
+	return 0;
+out:
+	put_unused_fd(fd);
+	fput(file);
+	return ret;
+}
+
+/* Daemons identify themselves by their netlink port, which
+ * is also the port they listen on, and join the pool of the
+ * network namespace they registered from */
+int daemon_register_cb(struct sk_buff* skb, struct genl_info* info) {
+	struct nlattr* na;
+	int cpu = -1;
+	int ret;
+	if (info == NULL) {
+		printk(KERN_ALERT "Netlink: Message info is null\n");
+		return -1;
+	}
+	if ((na = info->attrs[SSA_NL_A_CPU]) != NULL) {
+		cpu = nla_get_u32(na);
+	}
+	ret = register_daemon(genl_info_net(info), info->snd_portid, cpu);
+	if (ret == 0) {
+		refill_warm_pool(genl_info_net(info));
+	}
+	return ret;
+}
+
+int daemon_unregister_cb(struct sk_buff* skb, struct genl_info* info) {
+	int ret;
+	if (info == NULL) {
+		printk(KERN_ALERT "Netlink: Message info is null\n");
+		return -1;
+	}
+	/* Drained after, so the pool isn't refilled in between */
+	ret = unregister_daemon(genl_info_net(info), info->snd_portid);
+	drain_warm_pool(genl_info_net(info), info->snd_portid);
+	forget_daemon_acks(genl_info_net(info), info->snd_portid);
+	return ret;
+}
+
+/* The program fd is looked up in the sender's fd table, and the
+ * program only picks daemons for the sender's namespace. Leaving it
+ * out, or giving -1, detaches the current program */
+int selector_attach_cb(struct sk_buff* skb, struct genl_info* info) {
+	struct nlattr* na;
+	int prog_fd = -1;
+	if (info == NULL) {
+		printk(KERN_ALERT "Netlink: Message info is null\n");
+		return -1;
+	}
+	if ((na = info->attrs[SSA_NL_A_BPF_FD]) != NULL) {
+		prog_fd = (int)nla_get_u32(na);
+	}
+	return attach_daemon_selector(genl_info_net(info), prog_fd);
+}
+
+/* Sessions are shared by all daemons in the sender's namespace */
+int session_store_cb(struct sk_buff* skb, struct genl_info* info) {
+	struct nlattr* na;
+	struct ssa_session_key* key;
+	unsigned int lifetime = 0;
+	if (info == NULL) {
+		printk(KERN_ALERT "Netlink: Message info is null\n");
+		return -1;
+	}
+	if ((na = info->attrs[SSA_NL_A_SESSION_KEY]) == NULL) {
+		printk(KERN_ALERT "Netlink: Unable to retrieve session key\n");
+		return -EINVAL;
+	}
+	key = nla_data(na);
+	if ((na = info->attrs[SSA_NL_A_SESSION_LIFETIME]) != NULL) {
+		lifetime = nla_get_u32(na);
+	}
+	if ((na = info->attrs[SSA_NL_A_SESSION]) == NULL) {
+		printk(KERN_ALERT "Netlink: Unable to retrieve session\n");
+		return -EINVAL;
+	}
+	return store_session(genl_info_net(info), key, nla_data(na), nla_len(na), lifetime);
+}
+
+int session_fetch_cb(struct sk_buff* skb, struct genl_info* info) {
+	struct nlattr* na;
+	struct sk_buff* reply;
+	void* msg_head;
+	char* data = NULL;
+	int len;
+	int ret;
+	if (info == NULL) {
+		printk(KERN_ALERT "Netlink: Message info is null\n");
+		return -1;
+	}
+	if ((na = info->attrs[SSA_NL_A_SESSION_KEY]) == NULL) {
+		printk(KERN_ALERT "Netlink: Unable to retrieve session key\n");
+		return -EINVAL;
+	}
+	len = fetch_session(genl_info_net(info), nla_data(na), &data);
+	reply = genlmsg_new(len > 0 ? nla_total_size(len) : 0, GFP_KERNEL);
+	if (reply == NULL) {
+		printk(KERN_ALERT "Failed in genlmsg_new [session fetch]\n");
+		kfree(data);
+		return -ENOMEM;
+	}
+	msg_head = genlmsg_put_reply(reply, info, &ssa_nl_family, 0, SSA_NL_C_SESSION_FETCH);
+	if (msg_head == NULL) {
+		printk(KERN_ALERT "Failed in genlmsg_put_reply [session fetch]\n");
+		nlmsg_free(reply);
+		kfree(data);
+		return -ENOMEM;
+	}
+	if (len > 0) {
+		ret = nla_put(reply, SSA_NL_A_SESSION, len, data);
+		if (ret != 0) {
+			printk(KERN_ALERT "Failed in nla_put (session) [session fetch]\n");
+			nlmsg_free(reply);
+			kfree(data);
+			return ret;
+		}
+	}
+	kfree(data);
+	genlmsg_end(reply, msg_head);
+	return genlmsg_reply(reply, info);
+}
+
+/* A daemon that exits or crashes without unregistering is drained too */
+int daemon_release_notify(struct notifier_block* nb, unsigned long event, void* ptr) {
+	struct netlink_notify* n = ptr;
+	if (event != NETLINK_URELEASE || n->protocol != NETLINK_GENERIC) {
+		return NOTIFY_DONE;
+	}
+	if (release_daemon(n->net, n->portid)) {
+		drain_warm_pool(n->net, n->portid);
+		forget_daemon_acks(n->net, n->portid);
+	}
+	return NOTIFY_DONE;
 }
 
 int register_netlink() {
-	return genl_register_family(&ssa_nl_family);
+	int ret;
+	ret = genl_register_family(&ssa_nl_family);
+	if (ret != 0) {
+		return ret;
+	}
+	ret = register_pernet_subsys(&accept_net_ops);
+	if (ret != 0) {
+		genl_unregister_family(&ssa_nl_family);
+		return ret;
+	}
+	ret = netlink_register_notifier(&daemon_release_nb);
+	if (ret != 0) {
+		unregister_pernet_subsys(&accept_net_ops);
+		genl_unregister_family(&ssa_nl_family);
+	}
+	return ret;
 }
 
 void unregister_netlink() {
+	netlink_unregister_notifier(&daemon_release_nb);
+	/* Sends whatever accepts are still queued */
+	unregister_pernet_subsys(&accept_net_ops);
 	genl_unregister_family(&ssa_nl_family);
 	return;
 }
 
-int send_socket_notification(unsigned long id, char* comm, int port_id) {
+int send_socket_notification(struct net* net, unsigned long id, char* comm, u32 seq, int port_id) {
 	struct sk_buff* skb;
 	int ret;
 	void* msg_head;
 	int msg_size = nla_total_size(sizeof(unsigned long)) +
-			nla_total_size(strlen(comm)+1);
+			nla_total_size(strlen(comm)+1) +
+			nla_total_size(sizeof(u32));
 
 	skb = genlmsg_new(msg_size, GFP_KERNEL);
 	if (skb == NULL) {
@@ -229,25 +609,36 @@ int send_socket_notification(unsigned long id, char* comm, int port_id) {
 		nlmsg_free(skb);
 		return -1;
 	}
+	if (seq != 0) {
+		ret = nla_put_u32(skb, SSA_NL_A_SEQ, seq);
+		if (ret != 0) {
+			printk(KERN_ALERT "Failed in nla_put (seq) [socket notify]\n");
+			nlmsg_free(skb);
+			return -1;
+		}
+	}
 	genlmsg_end(skb, msg_head);
 	/*ret = genlmsg_multicast(&ssa_nl_family, skb, 0, SSA_NL_NOTIFY, GFP_KERNEL);
 	if (ret != 0) {
 		printk(KERN_ALERT "Failed in gemlmsg_multicast [socket notify] (%d)\n", ret);
 	}*/
-	ret = genlmsg_unicast(&init_net, skb, port_id);
+	ret = genlmsg_unicast(net, skb, port_id);
 	if (ret != 0) {
 		printk(KERN_ALERT "Failed in gemlmsg_unicast [socket notify]\n (%d)", ret);
 	}
 	return 0;
 }
 
-int send_setsockopt_notification(unsigned long id, int level, int optname, void* optval, int optlen, int port_id) {
+int send_setsockopt_notification(struct net* net, unsigned long id, int level, int optname, void* optval, int optlen, int blocking, u32 seq, int port_id) {
 	struct sk_buff* skb;
 	int ret;
 	void* msg_head;
 	int msg_size = nla_total_size(sizeof(unsigned long)) +
-			2 * nla_total_size(sizeof(int)) +
-			nla_total_size(optlen);
+			3 * nla_total_size(sizeof(int)) +
+			nla_total_size(optlen) +
+			nla_total_size(sizeof(u32));
+
+	flush_accepts_before(net, id, port_id);
 
 	skb = genlmsg_new(msg_size, GFP_KERNEL);
 	if (skb == NULL) {
@@ -284,24 +675,42 @@ int send_setsockopt_notification(unsigned long id, int level, int optname, void*
 		nlmsg_free(skb);
 		return -1;
 	}
+	/* Non-blocking notifications are mirrors the daemon must not answer */
+	ret = nla_put(skb, SSA_NL_A_BLOCKING, sizeof(blocking), &blocking);
+	if (ret != 0) {
+		printk(KERN_ALERT "Failed in nla_put (blocking) [setsockopt notify]\n");
+		nlmsg_free(skb);
+		return -1;
+	}
+	if (seq != 0) {
+		ret = nla_put_u32(skb, SSA_NL_A_SEQ, seq);
+		if (ret != 0) {
+			printk(KERN_ALERT "Failed in nla_put (seq) [setsockopt notify]\n");
+			nlmsg_free(skb);
+			return -1;
+		}
+	}
 	genlmsg_end(skb, msg_head);
 	/*ret = genlmsg_multicast(&ssa_nl_family, skb, 0, SSA_NL_NOTIFY, GFP_KERNEL);
 	if (ret != 0) {
 		printk(KERN_ALERT "Failed in gemlmsg_multicast [setsockopt notify] (%d)\n", ret);
 	}*/
-	ret = genlmsg_unicast(&init_net, skb, port_id);
+	ret = genlmsg_unicast(net, skb, port_id);
 	if (ret != 0) {
 		printk(KERN_ALERT "Failed in gemlmsg_unicast [setsockopt notify]\n (%d)", ret);
 	}
 	return 0;
 }
 
-int send_getsockopt_notification(unsigned long id, int level, int optname, int port_id) {
+int send_getsockopt_notification(struct net* net, unsigned long id, int level, int optname, u32 seq, int port_id) {
 	struct sk_buff* skb;
 	int ret;
 	void* msg_head;
 	int msg_size = nla_total_size(sizeof(unsigned long)) +
-			2 * nla_total_size(sizeof(int));
+			2 * nla_total_size(sizeof(int)) +
+			nla_total_size(sizeof(u32));
+
+	flush_accepts_before(net, id, port_id);
 
 	skb = genlmsg_new(msg_size, GFP_KERNEL);
 	if (skb == NULL) {
@@ -332,19 +741,25 @@ int send_getsockopt_notification(unsigned long id, int level, int optname, int p
 		nlmsg_free(skb);
 		return -1;
 	}
+	ret = nla_put_u32(skb, SSA_NL_A_SEQ, seq);
+	if (ret != 0) {
+		printk(KERN_ALERT "Failed in nla_put (seq) [getsockopt notify]\n");
+		nlmsg_free(skb);
+		return -1;
+	}
 	genlmsg_end(skb, msg_head);
 	/*ret = genlmsg_multicast(&ssa_nl_family, skb, 0, SSA_NL_NOTIFY, GFP_KERNEL);
 	if (ret != 0) {
 		printk(KERN_ALERT "Failed in gemlmsg_multicast [getsockopt notify] (%d)\n", ret);
 	}*/
-	ret = genlmsg_unicast(&init_net, skb, port_id);
+	ret = genlmsg_unicast(net, skb, port_id);
 	if (ret != 0) {
 		printk(KERN_ALERT "Failed in gemlmsg_unicast [getsockopt notify]\n (%d)", ret);
 	}
 	return 0;
 }
 
-int send_bind_notification(unsigned long id, struct sockaddr* int_addr, struct sockaddr* ext_addr, int port_id) {
+int send_bind_notification(struct net* net, unsigned long id, struct sockaddr* int_addr, struct sockaddr* ext_addr, int port_id) {
 	struct sk_buff* skb;
 	int ret;
 	void* msg_head;
@@ -385,20 +800,25 @@ int send_bind_notification(unsigned long id, struct sockaddr* int_addr, struct s
 	if (ret != 0) {
 		printk(KERN_ALERT "Failed in gemlmsg_multicast [bind notify] (%d)\n", ret);
 	}*/
-	ret = genlmsg_unicast(&init_net, skb, port_id);
+	ret = genlmsg_unicast(net, skb, port_id);
 	if (ret != 0) {
 		printk(KERN_ALERT "Failed in gemlmsg_unicast [bind notify]\n (%d)", ret);
 	}
 	return 0;
 }
 
-int send_connect_notification(unsigned long id, struct sockaddr* int_addr, struct sockaddr* rem_addr, int blocking, int port_id) {
+/* When pooled is set, int_addr is that of a connection the daemon has
+ * already accepted, which from now on belongs to this socket */
+int send_connect_notification(struct net* net, unsigned long id, struct sockaddr* int_addr, struct sockaddr* rem_addr, int blocking, int pooled,
+		char* early_data, int early_len, u32 seq, int port_id) {
 	struct sk_buff* skb;
 	int ret;
 	void* msg_head;
 	int msg_size = nla_total_size(sizeof(unsigned long)) +
-			nla_total_size(sizeof(int)) +
-			2 * nla_total_size(sizeof(struct sockaddr));
+			2 * nla_total_size(sizeof(int)) +
+			nla_total_size(sizeof(u32)) +
+			2 * nla_total_size(sizeof(struct sockaddr)) +
+			(early_len > 0 ? nla_total_size(early_len) : 0);
 
 	skb = genlmsg_new(msg_size, GFP_KERNEL);
 	if (skb == NULL) {
@@ -435,19 +855,45 @@ int send_connect_notification(unsigned long id, struct sockaddr* int_addr, struc
 		nlmsg_free(skb);
 		return -1;
 	}
+	if (pooled) {
+		ret = nla_put(skb, SSA_NL_A_POOLED, sizeof(pooled), &pooled);
+		if (ret != 0) {
+			printk(KERN_ALERT "Failed in nla_put (pooled) [connect notify]\n");
+			nlmsg_free(skb);
+			return -1;
+		}
+	}
+	if (early_len > 0) {
+		/* Sent with MSG_FASTOPEN, for the daemon to send as soon as
+		 * it can */
+		ret = nla_put(skb, SSA_NL_A_EARLY_DATA, early_len, early_data);
+		if (ret != 0) {
+			printk(KERN_ALERT "Failed in nla_put (early data) [connect notify]\n");
+			nlmsg_free(skb);
+			return -1;
+		}
+	}
+	if (seq != 0) {
+		ret = nla_put_u32(skb, SSA_NL_A_SEQ, seq);
+		if (ret != 0) {
+			printk(KERN_ALERT "Failed in nla_put (seq) [connect notify]\n");
+			nlmsg_free(skb);
+			return -1;
+		}
+	}
 	genlmsg_end(skb, msg_head);
 	/*ret = genlmsg_multicast(&ssa_nl_family, skb, 0, SSA_NL_NOTIFY, GFP_KERNEL);
 	if (ret != 0) {
 		printk(KERN_ALERT "Failed in gemlmsg_multicast [connect notify]\n (%d)", ret);
 	}*/
-	ret = genlmsg_unicast(&init_net, skb, port_id);
+	ret = genlmsg_unicast(net, skb, port_id);
 	if (ret != 0) {
 		printk(KERN_ALERT "Failed in gemlmsg_unicast [connect notify]\n (%d)", ret);
 	}
 	return 0;
 }
 
-int send_listen_notification(unsigned long id, struct sockaddr* int_addr, struct sockaddr* ext_addr, int port_id) {
+int send_listen_notification(struct net* net, unsigned long id, struct sockaddr* int_addr, struct sockaddr* ext_addr, int port_id) {
 	struct sk_buff* skb;
 	int ret;
 	void* msg_head;
@@ -488,20 +934,20 @@ int send_listen_notification(unsigned long id, struct sockaddr* int_addr, struct
 	if (ret != 0) {
 		printk(KERN_ALERT "Failed in gemlmsg_multicast [listen notify] (%d)\n", ret);
 	}*/
-	ret = genlmsg_unicast(&init_net, skb, port_id);
+	ret = genlmsg_unicast(net, skb, port_id);
 	if (ret != 0) {
 		printk(KERN_ALERT "Failed in gemlmsg_unicast [listen notify]\n (%d)", ret);
 	}
 	return 0;
 }
 
-int send_accept_notification(unsigned long id, struct sockaddr* int_addr, int port_id) {
+int send_accept_notification(struct net* net, unsigned long id, struct sockaddr* int_addr, u32 seq, int port_id) {
 	struct sk_buff* skb;
 	int ret;
 	void* msg_head;
 	int msg_size = nla_total_size(sizeof(unsigned long)) +
 			nla_total_size(sizeof(struct sockaddr)) +
-			nla_total_size(sizeof(int));
+			nla_total_size(sizeof(u32));
 
 	skb = genlmsg_new(msg_size, GFP_KERNEL);
 	if (skb == NULL) {
@@ -526,24 +972,34 @@ int send_accept_notification(unsigned long id, struct sockaddr* int_addr, int po
 		nlmsg_free(skb);
 		return -1;
 	}
+	if (seq != 0) {
+		ret = nla_put_u32(skb, SSA_NL_A_SEQ, seq);
+		if (ret != 0) {
+			printk(KERN_ALERT "Failed in nla_put (seq) [accept notify]\n");
+			nlmsg_free(skb);
+			return -1;
+		}
+	}
 	genlmsg_end(skb, msg_head);
 	/*ret = genlmsg_multicast(&ssa_nl_family, skb, 0, SSA_NL_NOTIFY, GFP_KERNEL);
 	if (ret != 0) {
 		printk(KERN_ALERT "Failed in gemlmsg_multicast [accept notify] (%d)\n", ret);
 	}*/
-	ret = genlmsg_unicast(&init_net, skb, port_id);
+	ret = genlmsg_unicast(net, skb, port_id);
 	if (ret != 0) {
 		printk(KERN_ALERT "Failed in gemlmsg_unicast [accept notify]\n (%d)", ret);
 	}
 	return 0;
 }
 
-int send_close_notification(unsigned long id, int port_id) {
+int send_close_notification(struct net* net, unsigned long id, int port_id) {
 	struct sk_buff* skb;
 	int ret;
 	void* msg_head;
 	int msg_size = nla_total_size(sizeof(unsigned long));
 
+	flush_accepts_before(net, id, port_id);
+
 	skb = genlmsg_new(msg_size, GFP_KERNEL);
 	if (skb == NULL) {
 		printk(KERN_ALERT "Failed in genlmsg_new [close notify]\n");
@@ -567,10 +1023,200 @@ int send_close_notification(unsigned long id, int port_id) {
 		printk(KERN_ALERT "Failed in gemlmsg_multicast [close notify] (%d)\n", ret);
 		
 	}*/
-	ret = genlmsg_unicast(&init_net, skb, port_id);
+	ret = genlmsg_unicast(net, skb, port_id);
 	if (ret != 0) {
 		printk(KERN_ALERT "Failed in gemlmsg_unicast [close notify]\n (%d)", ret);
 	}
 	return 0;
 }
 
+/**
+ * Hands out the SSA_NL_A_SEQ for a notification whose replies need
+ * matching up. Never 0, which replies without one read as
+ * @return	The sequence number
+ */
+u32 next_notify_seq(void) {
+	u32 seq;
+	do {
+		seq = (u32)atomic_inc_return(&notify_seq);
+	} while (seq == 0);
+	return seq;
+}
+
+int accept_net_init(struct net* net) {
+	accept_net_t* an = net_generic(net, accept_net_id);
+	struct accept_queue* queue;
+	int n;
+	for (n = 0; n < MAX_DAEMONS; n++) {
+		queue = &an->queues[n];
+		spin_lock_init(&queue->lock);
+		INIT_LIST_HEAD(&queue->accepts);
+		queue->count = 0;
+		mutex_init(&queue->flush_lock);
+		INIT_WORK(&queue->work, accept_flush_work);
+		queue->net = net;
+		queue->port_id = DAEMON_START_PORT + n;
+	}
+	return 0;
+}
+
+/* Queued accepts hold the namespace, so there are only any left when
+ * the module is unloading */
+void accept_net_exit(struct net* net) {
+	accept_net_t* an = net_generic(net, accept_net_id);
+	int n;
+	for (n = 0; n < MAX_DAEMONS; n++) {
+		cancel_work_sync(&an->queues[n].work);
+		flush_accept_queue(&an->queues[n]);
+	}
+	return;
+}
+
+struct accept_queue* get_accept_queue(struct net* net, int port_id) {
+	accept_net_t* an;
+	int n = port_id - DAEMON_START_PORT;
+	if (n < 0 || n >= MAX_DAEMONS) {
+		return NULL;
+	}
+	an = net_generic(net, accept_net_id);
+	return &an->queues[n];
+}
+
+/**
+ * Queues an accept notification to go to the daemon in its next batch
+ * @param	net - The daemon's network namespace
+ * @param	id - ID of the accepted socket
+ * @param	int_addr - The daemon's end of the internal connection
+ * @param	port_id - The daemon's netlink port
+ * @return	0 on success, otherwise an error
+ */
+int queue_accept_notification(struct net* net, unsigned long id, struct sockaddr* int_addr, int port_id) {
+	struct accept_queue* queue;
+	struct pending_accept* pa;
+	queue = get_accept_queue(net, port_id);
+	if (queue == NULL) {
+		return -EINVAL;
+	}
+	pa = kmalloc(sizeof(struct pending_accept), GFP_KERNEL);
+	if (pa == NULL) {
+		return -ENOMEM;
+	}
+	pa->net = get_net(net);
+	pa->rec.id = id;
+	pa->rec.int_addr = *int_addr;
+	spin_lock(&queue->lock);
+	list_add_tail(&pa->list, &queue->accepts);
+	queue->count++;
+	spin_unlock(&queue->lock);
+	schedule_work(&queue->work);
+	return 0;
+}
+
+void accept_flush_work(struct work_struct* work) {
+	flush_accept_queue(container_of(work, struct accept_queue, work));
+	return;
+}
+
+/**
+ * Sends a daemon's queued accepts first if one of them is for the given
+ * socket, so that a notification about it can't overtake its accept
+ * @param	net - The daemon's network namespace
+ * @param	id - ID of the socket about to be notified about
+ * @param	port_id - The daemon's netlink port
+ */
+void flush_accepts_before(struct net* net, unsigned long id, int port_id) {
+	struct accept_queue* queue;
+	struct pending_accept* pa;
+	int queued = 0;
+	queue = get_accept_queue(net, port_id);
+	if (queue == NULL || READ_ONCE(queue->count) == 0) {
+		return;
+	}
+	spin_lock(&queue->lock);
+	list_for_each_entry(pa, &queue->accepts, list) {
+		if (pa->rec.id == id) {
+			queued = 1;
+			break;
+		}
+	}
+	spin_unlock(&queue->lock);
+	if (queued == 1) {
+		flush_accept_queue(queue);
+	}
+	return;
+}
+
+/* Sends every accept queued for a daemon, in batches. Returns only once
+ * accepts queued before the call, including any a concurrent flush had
+ * already taken, have gone out */
+void flush_accept_queue(struct accept_queue* queue) {
+	LIST_HEAD(todo);
+	LIST_HEAD(batch);
+	struct pending_accept* pa;
+	struct pending_accept* tmp;
+	int count;
+
+	mutex_lock(&queue->flush_lock);
+	spin_lock(&queue->lock);
+	list_splice_init(&queue->accepts, &todo);
+	queue->count = 0;
+	spin_unlock(&queue->lock);
+	while (!list_empty(&todo)) {
+		count = 0;
+		list_for_each_entry_safe(pa, tmp, &todo, list) {
+			list_move_tail(&pa->list, &batch);
+			if (++count == ACCEPT_BATCH_MAX) {
+				break;
+			}
+		}
+		send_accept_batch(&batch, queue->net, queue->port_id, count);
+	}
+	mutex_unlock(&queue->flush_lock);
+	return;
+}
+
+/* Frees the batch's entries whether or not it could be sent */
+int send_accept_batch(struct list_head* batch, struct net* net, int port_id, int count) {
+	struct sk_buff* skb = NULL;
+	struct ssa_accept_record* recs;
+	struct pending_accept* pa;
+	struct pending_accept* tmp;
+	struct nlattr* na;
+	int ret = -1;
+	void* msg_head;
+	int msg_size = nla_total_size(count * sizeof(struct ssa_accept_record));
+
+	skb = genlmsg_new(msg_size, GFP_KERNEL);
+	if (skb == NULL) {
+		printk(KERN_ALERT "Failed in genlmsg_new [accept batch notify]\n");
+		goto out;
+	}
+	msg_head = genlmsg_put(skb, 0, 0, &ssa_nl_family, 0, SSA_NL_C_ACCEPT_BATCH_NOTIFY);
+	if (msg_head == NULL) {
+		printk(KERN_ALERT "Failed in genlmsg_put [accept batch notify]\n");
+		nlmsg_free(skb);
+		goto out;
+	}
+	na = nla_reserve(skb, SSA_NL_A_ACCEPT_BATCH, count * sizeof(struct ssa_accept_record));
+	if (na == NULL) {
+		printk(KERN_ALERT "Failed in nla_reserve (batch) [accept batch notify]\n");
+		nlmsg_free(skb);
+		goto out;
+	}
+	recs = nla_data(na);
+	list_for_each_entry(pa, batch, list) {
+		*recs++ = pa->rec;
+	}
+	genlmsg_end(skb, msg_head);
+	ret = genlmsg_unicast(net, skb, port_id);
+	if (ret != 0) {
+		printk(KERN_ALERT "Failed in gemlmsg_unicast [accept batch notify]\n (%d)", ret);
+	}
+out:
+	list_for_each_entry_safe(pa, tmp, batch, list) {
+		list_del(&pa->list);
+		put_net(pa->net);
+		kfree(pa);
+	}
+	return ret;
+}
@@ -1,7 +1,10 @@
 #ifndef NETLINK_H
 #define NETLINK_H
 
+#include <linux/types.h>
 #include <linux/socket.h>
+#include <net/net_namespace.h>
+#include <linux/tls.h>
 
 // Attributes
 enum {
@@ -17,6 +20,22 @@ enum {
 	SSA_NL_A_OPTVAL,
 	SSA_NL_A_RETURN,
         SSA_NL_A_PAD,
+	SSA_NL_A_OPTINDEX,
+	SSA_NL_A_HANDSHAKE_OPTS,
+	SSA_NL_A_FILE_ID,
+	SSA_NL_A_FILE_FD,
+	SSA_NL_A_DATA_TOTAL,
+	SSA_NL_A_SEQ,
+	SSA_NL_A_CPU,
+	SSA_NL_A_BPF_FD,
+	SSA_NL_A_KTLS_FD,
+	SSA_NL_A_KTLS_INFO,
+	SSA_NL_A_POOLED,
+	SSA_NL_A_ACCEPT_BATCH,
+	SSA_NL_A_EARLY_DATA,
+	SSA_NL_A_SESSION_KEY,
+	SSA_NL_A_SESSION,
+	SSA_NL_A_SESSION_LIFETIME,
         __SSA_NL_A_MAX,
 };
 
@@ -36,11 +55,68 @@ enum {
 	SSA_NL_C_RETURN,
 	SSA_NL_C_DATA_RETURN,
 	SSA_NL_C_HANDSHAKE_RETURN,
+	SSA_NL_C_FILE_FETCH,
+	SSA_NL_C_DAEMON_REGISTER,
+	SSA_NL_C_DAEMON_UNREGISTER,
+	SSA_NL_C_SELECTOR_ATTACH,
+	SSA_NL_C_ACCEPT_BATCH_NOTIFY,
+	SSA_NL_C_SESSION_STORE,
+	SSA_NL_C_SESSION_FETCH,
         __SSA_NL_C_MAX,
 };
 
 #define SSA_NL_C_MAX (__SSA_NL_C_MAX - 1)
 
+/* TLS_FD_REF_PREFIX option values reach the daemon as the prefix and a
+ * decimal SSA_NL_A_FILE_ID (a u32) naming the file the application
+ * passed. A file fetch with the id is answered with a fetch carrying
+ * SSA_NL_A_FILE_FD (a u32), a descriptor for the file opened read only
+ * and close-on-exec in the daemon's own table. A file keeps its id for
+ * as long as any socket holds it, so what the daemon parsed from it can
+ * be kept by id */
+
+/* Notifications whose replies have to be told apart from stale ones
+ * carry a nonzero SSA_NL_A_SEQ (a u32). Every reply to such a
+ * notification, including each chunk of a data return, carries the
+ * same SSA_NL_A_SEQ back. Replies that don't match what the socket
+ * is waiting for are dropped. Connect notifications always carry one,
+ * and only replies echoing it are taken as the handshake's result.
+ * Socket notifications carry one when nothing waits for the ack,
+ * accept notifications when nothing waits for the handover, and
+ * setsockopt notifications when a nonblocking socket will pick the
+ * reply up later */
+
+/* SSA_NL_A_KTLS_INFO of a handshake return, which comes with the
+ * daemon's descriptor for its connection to the peer in
+ * SSA_NL_A_KTLS_FD. The record sequence numbers are those of the next
+ * record each way. A handshake return may also answer an accept
+ * notification, to hand over a connection the daemon accepted */
+struct ssa_ktls_info {
+	struct tls12_crypto_info_aes_gcm_128 tx;
+	struct tls12_crypto_info_aes_gcm_128 rx;
+};
+
+/* SSA_NL_A_ACCEPT_BATCH of an accept batch notification is an array of
+ * these, in the order the sockets were accepted. Unlike a single accept
+ * notification, a batch gets no reply */
+struct ssa_accept_record {
+	__u64 id;
+	struct sockaddr int_addr;
+};
+
+/* SSA_NL_A_SESSION_KEY of a session store or fetch. config_id is
+ * whatever the daemon derives from the socket's TLS options, so that a
+ * session is only resumed under the configuration it was made with.
+ * The port is in network byte order. A store saves the client session
+ * in SSA_NL_A_SESSION, usable for SSA_NL_A_SESSION_LIFETIME seconds if
+ * given. A fetch is answered with a fetch carrying the session, or
+ * carrying none if there isn't one */
+struct ssa_session_key {
+	__u64 config_id;
+	__be16 port;
+	char hostname[256];
+};
+
 // Multicast group
 enum ssa_nl_groups {
         SSA_NL_NOTIFY,
@@ -48,14 +124,17 @@ enum ssa_nl_groups {
 
 
 int register_netlink(void);
-int send_socket_notification(unsigned long id, char* comm, int port_id);
-int send_setsockopt_notification(unsigned long id, int level, int optname, void* optval, int optlen, int port_id);
-int send_getsockopt_notification(unsigned long id, int level, int optname, int port_id);
-int send_bind_notification(unsigned long id, struct sockaddr* int_addr, struct sockaddr* ext_addr, int port_id);
-int send_connect_notification(unsigned long id, struct sockaddr* int_addr, struct sockaddr* rem_addr, int blocking, int port_id);
-int send_listen_notification(unsigned long id, struct sockaddr* int_addr, struct sockaddr* ext_addr, int port_id);
-int send_accept_notification(unsigned long id, struct sockaddr* int_addr, int port_id);
-int send_close_notification(unsigned long id, int port_id);
+int send_socket_notification(struct net* net, unsigned long id, char* comm, u32 seq, int port_id);
+int send_setsockopt_notification(struct net* net, unsigned long id, int level, int optname, void* optval, int optlen, int blocking, u32 seq, int port_id);
+int send_getsockopt_notification(struct net* net, unsigned long id, int level, int optname, u32 seq, int port_id);
+int send_bind_notification(struct net* net, unsigned long id, struct sockaddr* int_addr, struct sockaddr* ext_addr, int port_id);
+int send_connect_notification(struct net* net, unsigned long id, struct sockaddr* int_addr, struct sockaddr* rem_addr, int blocking, int pooled,
+		char* early_data, int early_len, u32 seq, int port_id);
+int send_listen_notification(struct net* net, unsigned long id, struct sockaddr* int_addr, struct sockaddr* ext_addr, int port_id);
+int send_accept_notification(struct net* net, unsigned long id, struct sockaddr* int_addr, u32 seq, int port_id);
+int send_close_notification(struct net* net, unsigned long id, int port_id);
+u32 next_notify_seq(void);
+int queue_accept_notification(struct net* net, unsigned long id, struct sockaddr* int_addr, int port_id);
 void unregister_netlink(void);
 
 #endif
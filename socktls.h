@@ -20,9 +20,82 @@
 #define TLS_PEER_CERTIFICATE_CHAIN        95
 #define TLS_ID                            96
 
+/* Batched options */
+#define TLS_OPTIONS_BATCH                 97
+
+/* Sets the offset (an unsigned int) the next getsockopt of an option
+ * value starts reading at, for values larger than the caller's buffer.
+ * Reads past the end return a length of 0 */
+#define TLS_OPTVAL_OFFSET                 98
+
+/* An int. If 1, the daemon hands a client connection over to kernel TLS
+ * once its handshake is done, so data no longer passes through it. Set
+ * on a listening socket, accepted connections are handed over too. A
+ * nonblocking accept returns before the daemon has answered, and the
+ * new socket reports no events, and holds back sends and receives,
+ * until it has */
+#define TLS_KTLS                          99
+
+/* An int. If 1, data sent with MSG_FASTOPEN may go to the peer as TLS
+ * 1.3 early data when the daemon has a session to resume. Early data
+ * can be replayed, so only set this for requests that are safe to
+ * repeat. Otherwise the daemon holds the data until its handshake is
+ * done */
+#define TLS_EARLY_DATA                    100
+
+/* TLS_TRUSTED_PEER_CERTIFICATES, TLS_CERTIFICATE_CHAIN and
+ * TLS_PRIVATE_KEY values starting with this are a decimal file
+ * descriptor (e.g., "&5") for a regular file holding the PEM data,
+ * such as a sealed memfd. The socket holds the file itself until it's
+ * closed, so the descriptor may be closed straight after. The daemon
+ * reads the file directly, and once for all sockets that pass it. A
+ * socket may name up to 8 files this way */
+#define TLS_FD_REF_PREFIX                 '&'
+
 /* TCP options */
 #define TCP_UPGRADE_TLS         33
 
+/* TLS_OPTIONS_BATCH values are a tls_opt_batch header followed by
+ * count records. Each record is a tls_opt_record header followed by
+ * optlen bytes of value, padded out to TLS_OPT_ALIGNTO. All records
+ * are applied atomically at the IPPROTO_TLS level. On failure the
+ * index of the first rejected record is written to error_index */
+struct tls_opt_batch {
+        unsigned int count;
+        int error_index;
+};
+
+struct tls_opt_record {
+        int optname;
+        unsigned int optlen;
+};
+
+#define TLS_OPT_ALIGNTO         4
+#define TLS_OPT_ALIGN(len)      (((len) + TLS_OPT_ALIGNTO - 1) & ~(TLS_OPT_ALIGNTO - 1))
+#define TLS_OPT_HDRLEN          ((int)TLS_OPT_ALIGN(sizeof(struct tls_opt_record)))
+#define TLS_OPT_SPACE(len)      (TLS_OPT_HDRLEN + TLS_OPT_ALIGN(len))
+#define TLS_OPT_DATA(rec)       ((void*)(((char*)(rec)) + TLS_OPT_HDRLEN))
+#define TLS_OPT_NEXT(rec)       ((struct tls_opt_record*)(((char*)(rec)) + TLS_OPT_SPACE((rec)->optlen)))
+
+/* Points at which a daemon selection program is run. It's given a
+ * tls_select_ctx as its packet data and returns the index of the daemon
+ * to use, or anything out of range to leave it to the daemon policy */
+#define TLS_SELECT_CREATE       0
+#define TLS_SELECT_CONNECT      1
+#define TLS_SELECT_BIND         2
+
+struct tls_select_ctx {
+        unsigned int hook;
+        unsigned int pid;
+        unsigned int uid;
+        unsigned int family;
+        unsigned long long cgroup_id;
+        unsigned short port;
+        unsigned char addr[16];
+        char hostname[256];
+        unsigned int netns; /* inode number of the network namespace */
+};
+
 /* Address types */
 #define AF_HOSTNAME     43
 
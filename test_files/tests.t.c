@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,6 +10,15 @@
 #include <errno.h>
 #include <netdb.h>
 #include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/sendfile.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+#include <linux/bpf.h>
 #include "../socktls.h"
 
 /* OpenSSL includes */
@@ -20,6 +30,36 @@
 
 #define MAX_HOSTNAME	255
 #define BUFFER_MAX	1024
+#define TRANSFER_SIZE	(16 * 1024 * 1024)
+
+#define DAEMON_START_PORT	8443
+#define NL_BUFFER_MAX	8192
+#define STALLED_MAX	64
+#define SOURCES_MAX	64
+#define ACCEPT_CLIENTS	8
+
+/* From the module's netlink.h, which only builds in the kernel */
+#define SSA_NL_FAMILY_NAME	"SSA"
+#define SSA_NL_A_BPF_FD		19
+#define SSA_NL_A_SESSION_KEY	25
+#define SSA_NL_A_SESSION	26
+#define SSA_NL_A_SESSION_LIFETIME	27
+#define SSA_NL_C_SELECTOR_ATTACH	15
+#define SSA_NL_C_SESSION_STORE	17
+#define SSA_NL_C_SESSION_FETCH	18
+
+struct ssa_session_key {
+	__u64 config_id;
+	__be16 port;
+	char hostname[256];
+};
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY	60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY	0x4000000
+#endif
 
 void run_sockops_tests(void);
 void run_connect_tests(void);
@@ -43,6 +83,50 @@ void run_bind_benchmark(void);
 
 /* Independent tests */
 void run_get_cert_test(void);
+void run_options_batch_test(void);
+
+/* Run once with the module loaded with internal_transport_mode=0 and
+ * once with it set to 1 to compare the two internal transports */
+void run_transfer_benchmark(void);
+/* Time to the first request sent with MSG_FASTOPEN and TLS_EARLY_DATA,
+ * for comparison against run_remote_connect_benchmark */
+void run_fastopen_benchmark(void);
+
+/* Behavioral tests of the module as loaded. They talk to a server that
+ * sends back each line it's sent reversed, and exit on the first
+ * thing that isn't as expected */
+void run_selector_test(void);
+void run_admission_test(void);
+void run_unix_transport_test(void);
+void run_loopback_sources_test(void);
+void run_warm_pool_test(void);
+void run_sendfile_test(void);
+void run_zerocopy_test(void);
+void run_accept_batch_test(void);
+void run_accept_batch_clients(int ready_fd);
+void run_nonblocking_connect_test(void);
+int wait_for_connect(int sock_fd);
+void run_nonblocking_setsockopt_test(void);
+void run_fastopen_test(void);
+void run_session_store_test(void);
+
+void run_rev_server(void);
+int connect_to_local_server(void);
+void expect_reversed(int sock_fd, char* line);
+void receive_reversed(int sock_fd, char* line);
+void check_reversed(char* line, char* response);
+int read_module_param(char* name);
+void write_module_param(char* name, int value);
+int nonblocking_tls_socket(void);
+int open_ssa_netlink(int* family_id);
+struct nlmsghdr* genetlink_message(char* buffer, int family_id, int cmd);
+void netlink_put_attr(struct nlmsghdr* nlh, int type, void* data, int len);
+struct nlattr* netlink_find_attr(struct nlmsghdr* nlh, int type);
+int netlink_transact(int nl_fd, struct nlmsghdr* request, char* reply, int reply_len);
+int load_constant_selector(int index);
+void attach_selector(int nl_fd, int family_id, int prog_fd);
+int netlink_store_session(int nl_fd, int family_id, struct ssa_session_key* key, char* session, int len, int lifetime);
+int netlink_fetch_session(int nl_fd, int family_id, struct ssa_session_key* key, char* session, int len);
 
 void run_remote_connect_baseline(void);
 void run_remote_connect_benchmark(void);
@@ -95,6 +179,39 @@ void run_s_server(){
 	}
 }
 
+void run_sink_server(){
+	if (!pid) {
+		printf("starting s_server\n");
+		pid = fork();
+		if (pid == 0) {
+			char *args[] = {"/bin/openssl", "s_server", "-cert", "tls_server/pem_files/certificate.pem", "-key", "tls_server/pem_files/key.pem", "-accept", "8888", "-quiet", NULL};
+			/* It prints what it receives, which we don't want to see */
+			freopen("/dev/null", "w", stdout);
+			execv("/bin/openssl", args);
+			fprintf(stderr, "Failed to execute s_server\n");
+		} else {
+			sleep(1);
+		}
+	}
+}
+
+void run_rev_server(){
+	if (!pid) {
+		printf("starting s_server\n");
+		pid = fork();
+		if (pid == 0) {
+			char *args[] = {"/bin/openssl", "s_server", "-cert", "tls_server/pem_files/certificate.pem", "-key", "tls_server/pem_files/key.pem", "-accept", "8888", "-quiet", "-rev", NULL};
+			/* It describes every connection it gets */
+			freopen("/dev/null", "w", stdout);
+			freopen("/dev/null", "w", stderr);
+			execv("/bin/openssl", args);
+			_exit(EXIT_FAILURE);
+		} else {
+			sleep(1);
+		}
+	}
+}
+
 void sig_int_handler(int sig){
 	if (sig == SIGINT){
 		if (pid) {
@@ -152,6 +269,36 @@ int main(int argc, char* argv[]) {
 			break;
 			case 9: run_get_cert_test();
 			break;
+			case 10: run_options_batch_test();
+			break;
+			case 11: run_selector_test();
+			break;
+			case 12: run_admission_test();
+			break;
+			case 13: run_transfer_benchmark();
+			break;
+			case 14: run_unix_transport_test();
+			break;
+			case 15: run_loopback_sources_test();
+			break;
+			case 16: run_warm_pool_test();
+			break;
+			case 17: run_sendfile_test();
+			break;
+			case 18: run_zerocopy_test();
+			break;
+			case 19: run_accept_batch_test();
+			break;
+			case 20: run_nonblocking_connect_test();
+			break;
+			case 21: run_nonblocking_setsockopt_test();
+			break;
+			case 22: run_fastopen_benchmark();
+			break;
+			case 23: run_fastopen_test();
+			break;
+			case 24: run_session_store_test();
+			break;
 			default:
 			break;
 		}
@@ -920,3 +1067,1433 @@ void run_get_cert_test(void) {
 	//printf("%s", http_response);
 	close(sock_fd);
 }
+
+void run_options_batch_test(void) {
+	struct timeval tv;
+	struct timeval tv_after;
+	char batch[BUFFER_MAX];
+	struct tls_opt_batch* hdr = (struct tls_opt_batch*)batch;
+	struct tls_opt_record* rec;
+	const char hostname[] = "www.google.com";
+	const char alpn[] = "http/1.1";
+	int ttl = 300;
+
+	int sock_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TLS);
+	if (sock_fd == -1) {
+		perror("socket");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(batch, 0, sizeof(batch));
+	hdr->count = 3;
+	hdr->error_index = -1;
+	rec = (struct tls_opt_record*)(batch + sizeof(struct tls_opt_batch));
+	rec->optname = TLS_REMOTE_HOSTNAME;
+	rec->optlen = sizeof(hostname);
+	memcpy(TLS_OPT_DATA(rec), hostname, sizeof(hostname));
+	rec = TLS_OPT_NEXT(rec);
+	rec->optname = TLS_ALPN;
+	rec->optlen = sizeof(alpn);
+	memcpy(TLS_OPT_DATA(rec), alpn, sizeof(alpn));
+	rec = TLS_OPT_NEXT(rec);
+	rec->optname = TLS_SESSION_TTL;
+	rec->optlen = sizeof(ttl);
+	memcpy(TLS_OPT_DATA(rec), &ttl, sizeof(ttl));
+	rec = TLS_OPT_NEXT(rec);
+
+	gettimeofday(&tv, NULL);
+	if (setsockopt(sock_fd, IPPROTO_TLS, TLS_OPTIONS_BATCH, batch, (char*)rec - batch) == -1) {
+		fprintf(stderr, "Batch failed at record %d\n", hdr->error_index);
+		perror("setsockopt: TLS_OPTIONS_BATCH");
+		exit(EXIT_FAILURE);
+	}
+	gettimeofday(&tv_after, NULL);
+	printf("%i Before batch: %ld.%06ld\n", counter, tv.tv_sec, tv.tv_usec);
+	printf("%i After batch: %ld.%06ld\n", counter, tv_after.tv_sec, tv_after.tv_usec);
+
+	char hostname_retrieved[MAX_HOSTNAME];
+	int hostname_length = MAX_HOSTNAME;
+	if (getsockopt(sock_fd, IPPROTO_TLS, TLS_REMOTE_HOSTNAME, hostname_retrieved, &hostname_length) == -1) {
+		perror("getsockopt: TLS_REMOTE_HOSTNAME");
+		exit(EXIT_FAILURE);
+	}
+	if (strncmp(hostname, hostname_retrieved, strlen(hostname)) != 0) {
+		fprintf(stderr, "Hostname mismatch: expected %s but got %s\n", hostname, hostname_retrieved);
+		exit(EXIT_FAILURE);
+	}
+	close(sock_fd);
+}
+
+void run_transfer_benchmark(void) {
+	struct timeval tv;
+	struct timeval tv_after;
+	char buffer[BUFFER_MAX * 16];
+	ssize_t sent;
+	size_t total = 0;
+
+	run_sink_server();
+
+	int sock_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TLS);
+	if (sock_fd == -1) {
+		perror("socket");
+		exit(EXIT_FAILURE);
+	}
+
+	const char hostname[] = "www.google.com";
+        if (setsockopt(sock_fd, IPPROTO_TLS, TLS_REMOTE_HOSTNAME, hostname, sizeof(hostname)) == -1) {
+		perror("setsockopt: TLS_REMOTE_HOSTNAME");
+		exit(EXIT_FAILURE);
+	}
+        struct sockaddr_in dst_addr = {
+                .sin_family = AF_INET,
+                .sin_port = htons(8888),
+                .sin_addr.s_addr = htonl(INADDR_LOOPBACK), // 127.0.0.1
+        };
+	if (connect(sock_fd, (struct sockaddr*)&dst_addr, sizeof(dst_addr)) == -1) {
+		perror("connect");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(buffer, 'a', sizeof(buffer));
+	gettimeofday(&tv, NULL);
+	while (total < TRANSFER_SIZE) {
+		sent = send(sock_fd, buffer, sizeof(buffer), 0);
+		if (sent == -1) {
+			perror("send");
+			exit(EXIT_FAILURE);
+		}
+		total += sent;
+	}
+	gettimeofday(&tv_after, NULL);
+	printf("%i Before transfer: %ld.%06ld\n", counter, tv.tv_sec, tv.tv_usec);
+	printf("%i After transfer: %ld.%06ld\n", counter, tv_after.tv_sec, tv_after.tv_usec);
+
+	close(sock_fd);
+	return;
+}
+
+void run_fastopen_benchmark(void) {
+	struct timeval tv;
+	struct timeval tv_after;
+	const char request[] = "GET / HTTP/1.1\r\nHost: www.google.com\r\n";
+	const char trailer[] = "\r\n";
+	int one = 1;
+
+	run_sink_server();
+
+	int sock_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TLS);
+	if (sock_fd == -1) {
+		perror("socket");
+		exit(EXIT_FAILURE);
+	}
+
+	const char hostname[] = "www.google.com";
+        if (setsockopt(sock_fd, IPPROTO_TLS, TLS_REMOTE_HOSTNAME, hostname, sizeof(hostname)) == -1) {
+		perror("setsockopt: TLS_REMOTE_HOSTNAME");
+		exit(EXIT_FAILURE);
+	}
+	if (setsockopt(sock_fd, IPPROTO_TLS, TLS_EARLY_DATA, &one, sizeof(one)) == -1) {
+		perror("setsockopt: TLS_EARLY_DATA");
+		exit(EXIT_FAILURE);
+	}
+        struct sockaddr_in dst_addr = {
+                .sin_family = AF_INET,
+                .sin_port = htons(8888),
+                .sin_addr.s_addr = htonl(INADDR_LOOPBACK), // 127.0.0.1
+        };
+	gettimeofday(&tv, NULL);
+	if (sendto(sock_fd, request, sizeof(request) - 1, MSG_FASTOPEN, (struct sockaddr*)&dst_addr, sizeof(dst_addr)) == -1) {
+		perror("sendto: MSG_FASTOPEN");
+		exit(EXIT_FAILURE);
+	}
+	/* Held back until the connection is through */
+	if (send(sock_fd, trailer, sizeof(trailer) - 1, 0) == -1) {
+		perror("send");
+		exit(EXIT_FAILURE);
+	}
+	gettimeofday(&tv_after, NULL);
+	printf("%i Before request: %ld.%06ld\n", counter, tv.tv_sec, tv.tv_usec);
+	printf("%i After request: %ld.%06ld\n", counter, tv_after.tv_sec, tv_after.tv_usec);
+
+	close(sock_fd);
+	return;
+}
+
+/* Connects a TLS socket to the test server on 8888 */
+int connect_to_local_server(void) {
+	int sock_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TLS);
+	if (sock_fd == -1) {
+		perror("socket");
+		exit(EXIT_FAILURE);
+	}
+
+	const char hostname[] = "www.google.com";
+        if (setsockopt(sock_fd, IPPROTO_TLS, TLS_REMOTE_HOSTNAME, hostname, sizeof(hostname)) == -1) {
+		perror("setsockopt: TLS_REMOTE_HOSTNAME");
+		exit(EXIT_FAILURE);
+	}
+        struct sockaddr_in dst_addr = {
+                .sin_family = AF_INET,
+                .sin_port = htons(8888),
+                .sin_addr.s_addr = htonl(INADDR_LOOPBACK), // 127.0.0.1
+        };
+	if (connect(sock_fd, (struct sockaddr*)&dst_addr, sizeof(dst_addr)) == -1) {
+		perror("connect");
+		exit(EXIT_FAILURE);
+	}
+	return sock_fd;
+}
+
+/* Sends a newline-terminated line to the server started by
+ * run_rev_server and checks it comes back reversed */
+void expect_reversed(int sock_fd, char* line) {
+	int len = strlen(line);
+	if (send(sock_fd, line, len, 0) != len) {
+		perror("send");
+		exit(EXIT_FAILURE);
+	}
+	receive_reversed(sock_fd, line);
+	return;
+}
+
+/* Reads the reply to a line that went to the server some other way */
+void receive_reversed(int sock_fd, char* line) {
+	char response[BUFFER_MAX];
+	int len = strlen(line);
+	int received = 0;
+	int ret;
+
+	while (received < len) {
+		ret = recv(sock_fd, response + received, len - received, 0);
+		if (ret == 0) {
+			fprintf(stderr, "Connection closed before the reply to %s", line);
+			exit(EXIT_FAILURE);
+		}
+		if (ret == -1) {
+			perror("recv");
+			exit(EXIT_FAILURE);
+		}
+		received += ret;
+	}
+	check_reversed(line, response);
+	return;
+}
+
+/* The response has to be as long as the line */
+void check_reversed(char* line, char* response) {
+	int len = strlen(line);
+	int i;
+	for (i = 0; i < len - 1; i++) {
+		if (response[i] != line[len - 2 - i]) {
+			break;
+		}
+	}
+	if (i < len - 1 || response[len - 1] != '\n') {
+		fprintf(stderr, "Reply mismatch: sent %s but got %.*s\n", line, len, response);
+		exit(EXIT_FAILURE);
+	}
+	return;
+}
+
+/* Reads one of the module's integer parameters, or gives -1 if the
+ * module isn't loaded */
+int read_module_param(char* name) {
+	char path[BUFFER_MAX];
+	FILE* file;
+	int value = -1;
+
+	snprintf(path, sizeof(path), "/sys/module/ssa/parameters/%s", name);
+	if ((file = fopen(path, "r")) == NULL) {
+		return -1;
+	}
+	if (fscanf(file, "%d", &value) != 1) {
+		value = -1;
+	}
+	fclose(file);
+	return value;
+}
+
+void write_module_param(char* name, int value) {
+	char path[BUFFER_MAX];
+	FILE* file;
+
+	snprintf(path, sizeof(path), "/sys/module/ssa/parameters/%s", name);
+	if ((file = fopen(path, "w")) == NULL) {
+		perror("fopen: module parameter");
+		exit(EXIT_FAILURE);
+	}
+	fprintf(file, "%d\n", value);
+	if (fclose(file) != 0) {
+		perror("fclose: module parameter");
+		exit(EXIT_FAILURE);
+	}
+	return;
+}
+
+/* A TLS socket, not yet connected, whose connects don't block */
+int nonblocking_tls_socket(void) {
+	int sock_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TLS);
+	if (sock_fd == -1) {
+		perror("socket");
+		exit(EXIT_FAILURE);
+	}
+
+	const char hostname[] = "www.google.com";
+        if (setsockopt(sock_fd, IPPROTO_TLS, TLS_REMOTE_HOSTNAME, hostname, sizeof(hostname)) == -1) {
+		perror("setsockopt: TLS_REMOTE_HOSTNAME");
+		exit(EXIT_FAILURE);
+	}
+	if (fcntl(sock_fd, F_SETFL, fcntl(sock_fd, F_GETFL) | O_NONBLOCK) == -1) {
+		perror("fcntl: O_NONBLOCK");
+		exit(EXIT_FAILURE);
+	}
+	return sock_fd;
+}
+
+/* Opens a generic netlink socket and looks up the module's family on it */
+int open_ssa_netlink(int* family_id) {
+	char request[NL_BUFFER_MAX];
+	char reply[NL_BUFFER_MAX];
+	struct sockaddr_nl addr;
+	struct nlmsghdr* nlh;
+	struct nlattr* na;
+
+	int nl_fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_GENERIC);
+	if (nl_fd == -1) {
+		perror("socket: NETLINK_GENERIC");
+		exit(EXIT_FAILURE);
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	if (bind(nl_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+		perror("bind: netlink");
+		exit(EXIT_FAILURE);
+	}
+
+	nlh = genetlink_message(request, GENL_ID_CTRL, CTRL_CMD_GETFAMILY);
+	netlink_put_attr(nlh, CTRL_ATTR_FAMILY_NAME, SSA_NL_FAMILY_NAME, sizeof(SSA_NL_FAMILY_NAME));
+	if (netlink_transact(nl_fd, nlh, reply, sizeof(reply)) != 0 ||
+			(na = netlink_find_attr((struct nlmsghdr*)reply, CTRL_ATTR_FAMILY_ID)) == NULL) {
+		fprintf(stderr, "No %s netlink family, is the module loaded?\n", SSA_NL_FAMILY_NAME);
+		exit(EXIT_FAILURE);
+	}
+	*family_id = *(unsigned short*)((char*)na + NLA_HDRLEN);
+	return nl_fd;
+}
+
+/* Starts a request in buffer, which must have room for its attributes */
+struct nlmsghdr* genetlink_message(char* buffer, int family_id, int cmd) {
+	struct nlmsghdr* nlh = (struct nlmsghdr*)buffer;
+	struct genlmsghdr* genlh = NLMSG_DATA(nlh);
+	memset(buffer, 0, NLMSG_SPACE(GENL_HDRLEN));
+	nlh->nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+	nlh->nlmsg_type = family_id;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	genlh->cmd = cmd;
+	genlh->version = 1;
+	return nlh;
+}
+
+void netlink_put_attr(struct nlmsghdr* nlh, int type, void* data, int len) {
+	struct nlattr* na = (struct nlattr*)((char*)nlh + NLMSG_ALIGN(nlh->nlmsg_len));
+	na->nla_type = type;
+	na->nla_len = NLA_HDRLEN + len;
+	memcpy((char*)na + NLA_HDRLEN, data, len);
+	nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + NLA_ALIGN(na->nla_len);
+	return;
+}
+
+/* Gives NULL if the message has no such attribute, or isn't there at
+ * all (a length of 0) */
+struct nlattr* netlink_find_attr(struct nlmsghdr* nlh, int type) {
+	struct nlattr* na = (struct nlattr*)((char*)NLMSG_DATA(nlh) + GENL_HDRLEN);
+	int len = (int)nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+	while (len >= NLA_HDRLEN && na->nla_len >= NLA_HDRLEN && na->nla_len <= len) {
+		if ((na->nla_type & NLA_TYPE_MASK) == type) {
+			return na;
+		}
+		len -= NLA_ALIGN(na->nla_len);
+		na = (struct nlattr*)((char*)na + NLA_ALIGN(na->nla_len));
+	}
+	return NULL;
+}
+
+/**
+ * Sends a request and waits for the kernel's ack
+ * @param	nl_fd - Netlink socket from open_ssa_netlink
+ * @param	request - As built by genetlink_message
+ * @param	reply - Set to the reply that came before the ack, which has
+ * 		a length of 0 if none did. May be NULL
+ * @param	reply_len - Size of reply
+ * @return	0 on success, otherwise the negated error the kernel gave
+ */
+int netlink_transact(int nl_fd, struct nlmsghdr* request, char* reply, int reply_len) {
+	static unsigned int seq = 0;
+	char buffer[NL_BUFFER_MAX];
+	struct sockaddr_nl kernel;
+	struct nlmsghdr* nlh;
+	int len;
+
+	memset(&kernel, 0, sizeof(kernel));
+	kernel.nl_family = AF_NETLINK;
+	request->nlmsg_seq = ++seq;
+	if (reply != NULL) {
+		((struct nlmsghdr*)reply)->nlmsg_len = 0;
+	}
+	if (sendto(nl_fd, request, request->nlmsg_len, 0, (struct sockaddr*)&kernel, sizeof(kernel)) == -1) {
+		perror("sendto: netlink");
+		exit(EXIT_FAILURE);
+	}
+	while (1) {
+		len = recv(nl_fd, buffer, sizeof(buffer), 0);
+		if (len == -1) {
+			perror("recv: netlink");
+			exit(EXIT_FAILURE);
+		}
+		for (nlh = (struct nlmsghdr*)buffer; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_seq != request->nlmsg_seq) {
+				continue;
+			}
+			if (nlh->nlmsg_type == NLMSG_ERROR) {
+				return ((struct nlmsgerr*)NLMSG_DATA(nlh))->error;
+			}
+			if (reply != NULL && nlh->nlmsg_len <= reply_len) {
+				memcpy(reply, nlh, nlh->nlmsg_len);
+			}
+		}
+	}
+}
+
+/* Loads a daemon selection program that always picks the given index */
+int load_constant_selector(int index) {
+	struct bpf_insn insns[] = {
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_0, .imm = index },
+		{ .code = BPF_JMP | BPF_EXIT },
+	};
+	char license[] = "GPL";
+	union bpf_attr attr;
+	int prog_fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
+	attr.insns = (unsigned long)insns;
+	attr.insn_cnt = sizeof(insns) / sizeof(struct bpf_insn);
+	attr.license = (unsigned long)license;
+	prog_fd = syscall(__NR_bpf, BPF_PROG_LOAD, &attr, sizeof(attr));
+	if (prog_fd == -1) {
+		perror("bpf: BPF_PROG_LOAD");
+		exit(EXIT_FAILURE);
+	}
+	return prog_fd;
+}
+
+/* A prog_fd of -1 detaches the current program */
+void attach_selector(int nl_fd, int family_id, int prog_fd) {
+	char request[NL_BUFFER_MAX];
+	struct nlmsghdr* nlh;
+	int ret;
+
+	nlh = genetlink_message(request, family_id, SSA_NL_C_SELECTOR_ATTACH);
+	if (prog_fd != -1) {
+		netlink_put_attr(nlh, SSA_NL_A_BPF_FD, &prog_fd, sizeof(prog_fd));
+	}
+	ret = netlink_transact(nl_fd, nlh, NULL, 0);
+	if (ret != 0) {
+		fprintf(stderr, "Selector attach failed: %s\n", strerror(-ret));
+		exit(EXIT_FAILURE);
+	}
+	return;
+}
+
+/* Run as root, with the module loaded with internal_transport_mode=0.
+ * Each daemon in turn is picked by an attached program, and the socket
+ * has to end up connected to its port */
+void run_selector_test(void) {
+	struct sockaddr_in peer;
+	socklen_t peer_len;
+	int daemons = read_module_param("num_daemons");
+	int family_id;
+	int nl_fd;
+	int prog_fd;
+	int sock_fd;
+	int i;
+
+	if (read_module_param("internal_transport_mode") != 0) {
+		fprintf(stderr, "The selector test needs the module loaded with internal_transport_mode=0\n");
+		exit(EXIT_FAILURE);
+	}
+	run_rev_server();
+	nl_fd = open_ssa_netlink(&family_id);
+
+	for (i = 0; i < daemons; i++) {
+		prog_fd = load_constant_selector(i);
+		attach_selector(nl_fd, family_id, prog_fd);
+		/* The module holds its own reference */
+		close(prog_fd);
+
+		sock_fd = connect_to_local_server();
+		peer_len = sizeof(peer);
+		if (getpeername(sock_fd, (struct sockaddr*)&peer, &peer_len) == -1) {
+			perror("getpeername");
+			exit(EXIT_FAILURE);
+		}
+		if (ntohs(peer.sin_port) != DAEMON_START_PORT + i) {
+			fprintf(stderr, "Selector picked daemon %d but the socket went to port %d\n",
+				DAEMON_START_PORT + i, ntohs(peer.sin_port));
+			exit(EXIT_FAILURE);
+		}
+		expect_reversed(sock_fd, "hello\n");
+		close(sock_fd);
+	}
+
+	attach_selector(nl_fd, family_id, -1);
+	close(nl_fd);
+	printf("%i Selector routed to each of %d daemons\n", counter, daemons);
+	return;
+}
+
+/* Run as root. Each daemon is allowed one handshake at a time, and
+ * handshakes are stalled against a server that accepts but never
+ * answers. Once every daemon has one, nonblocking connects have to be
+ * turned away, until closing the stalled ones gives their slots back.
+ * Assumes only the daemons started at load are registered */
+void run_admission_test(void) {
+	int stalled[STALLED_MAX];
+	int old_limit = read_module_param("daemon_max_handshakes");
+	int daemons = read_module_param("num_daemons");
+	int optval = 1;
+	int admitted;
+	int sock_fd;
+	int ret;
+	int i;
+
+	if (daemons < 1 || daemons >= STALLED_MAX) {
+		fprintf(stderr, "The admission test needs between 1 and %d daemons\n", STALLED_MAX - 1);
+		exit(EXIT_FAILURE);
+	}
+	int listen_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (listen_fd == -1) {
+		perror("socket");
+		exit(EXIT_FAILURE);
+	}
+	if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) == -1) {
+		perror("setsockopt");
+		exit(EXIT_FAILURE);
+	}
+        struct sockaddr_in stall_addr = {
+                .sin_family = AF_INET,
+                .sin_port = htons(8889),
+                .sin_addr.s_addr = htonl(INADDR_LOOPBACK), // 127.0.0.1
+        };
+	if (bind(listen_fd, (struct sockaddr*)&stall_addr, sizeof(stall_addr)) == -1) {
+		perror("bind");
+		exit(EXIT_FAILURE);
+	}
+	if (listen(listen_fd, SOMAXCONN) == -1) {
+		perror("listen");
+		exit(EXIT_FAILURE);
+	}
+
+	write_module_param("daemon_max_handshakes", 1);
+	for (admitted = 0; admitted <= daemons; admitted++) {
+		stalled[admitted] = nonblocking_tls_socket();
+		ret = connect(stalled[admitted], (struct sockaddr*)&stall_addr, sizeof(stall_addr));
+		if (ret == -1 && errno == EAGAIN) {
+			break;
+		}
+		if (ret != -1 || errno != EINPROGRESS) {
+			perror("connect: expected EINPROGRESS");
+			exit(EXIT_FAILURE);
+		}
+	}
+	/* Two handshakes may have gone to the same daemon, so the turning
+	 * away can start early, but not before the first */
+	if (admitted == 0 || admitted > daemons) {
+		fprintf(stderr, "%d of %d stalled connects were let through with %d daemons\n",
+			admitted, daemons + 1, daemons);
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i <= admitted; i++) {
+		close(stalled[i]);
+	}
+
+	sock_fd = nonblocking_tls_socket();
+	if (connect(sock_fd, (struct sockaddr*)&stall_addr, sizeof(stall_addr)) != -1 || errno != EINPROGRESS) {
+		perror("connect: expected EINPROGRESS once the slots were given back");
+		exit(EXIT_FAILURE);
+	}
+	close(sock_fd);
+
+	write_module_param("daemon_max_handshakes", old_limit);
+	close(listen_fd);
+	printf("%i Admitted %d stalled handshakes with %d daemons\n", counter, admitted, daemons);
+	return;
+}
+
+/* Run with the module loaded with internal_transport_mode=1. Data has
+ * to make it through the daemon both ways, and each socket has to
+ * report the address the application connected to, not anything about
+ * the internal unix socket behind it */
+void run_unix_transport_test(void) {
+	struct sockaddr_in peer;
+	struct sockaddr_in local;
+	socklen_t addr_len;
+	int sock_fd;
+	int i;
+
+	if (read_module_param("internal_transport_mode") != 1) {
+		fprintf(stderr, "The unix transport test needs the module loaded with internal_transport_mode=1\n");
+		exit(EXIT_FAILURE);
+	}
+	run_rev_server();
+
+	/* More than one, so that each has to get its own daemon connection */
+	for (i = 0; i < 3; i++) {
+		sock_fd = connect_to_local_server();
+		addr_len = sizeof(peer);
+		if (getpeername(sock_fd, (struct sockaddr*)&peer, &addr_len) == -1) {
+			perror("getpeername");
+			exit(EXIT_FAILURE);
+		}
+		if (peer.sin_family != AF_INET || ntohs(peer.sin_port) != 8888 ||
+				peer.sin_addr.s_addr != htonl(INADDR_LOOPBACK)) {
+			fprintf(stderr, "Peer is %s:%d, not the address connected to\n",
+				inet_ntoa(peer.sin_addr), ntohs(peer.sin_port));
+			exit(EXIT_FAILURE);
+		}
+		addr_len = sizeof(local);
+		if (getsockname(sock_fd, (struct sockaddr*)&local, &addr_len) == -1) {
+			perror("getsockname");
+			exit(EXIT_FAILURE);
+		}
+		if (local.sin_family != AF_INET) {
+			fprintf(stderr, "Local address has family %d, not AF_INET\n", local.sin_family);
+			exit(EXIT_FAILURE);
+		}
+		expect_reversed(sock_fd, "hello\n");
+		expect_reversed(sock_fd, "over the unix transport\n");
+		close(sock_fd);
+	}
+	printf("%i Round trips over the unix transport succeeded\n", counter);
+	return;
+}
+
+/* Run with the module loaded with internal_transport_mode=0, ideally
+ * with loopback_sources and loopback_daemon_addrs above 1. Sockets have
+ * to be connected from and to addresses in the configured ranges. As
+ * the source is picked round robin on each CPU, sockets made one after
+ * another on the same CPU have to use as many sources as there are, up
+ * to SOURCES_MAX. Warm connections are made elsewhere, so that's only
+ * checked with warm_pool_size=0 */
+void run_loopback_sources_test(void) {
+	struct sockaddr_in addr;
+	socklen_t addr_len;
+	cpu_set_t cpus;
+	in_addr_t sources_seen[SOURCES_MAX];
+	int sock_fds[SOURCES_MAX];
+	int sources = read_module_param("loopback_sources");
+	int daemon_addrs = read_module_param("loopback_daemon_addrs");
+	int sockets = sources > 1 ? sources : 2;
+	int expected;
+	int distinct = 0;
+	unsigned int offset;
+	int i;
+	int j;
+
+	if (read_module_param("internal_transport_mode") != 0) {
+		fprintf(stderr, "The loopback sources test needs the module loaded with internal_transport_mode=0\n");
+		exit(EXIT_FAILURE);
+	}
+	if (sockets > SOURCES_MAX) {
+		sockets = SOURCES_MAX;
+	}
+	expected = sources > 1 ? sockets : 1;
+	CPU_ZERO(&cpus);
+	CPU_SET(sched_getcpu(), &cpus);
+	if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1) {
+		perror("sched_setaffinity");
+		exit(EXIT_FAILURE);
+	}
+	run_rev_server();
+
+	for (i = 0; i < sockets; i++) {
+		sock_fds[i] = connect_to_local_server();
+		addr_len = sizeof(addr);
+		if (getsockname(sock_fds[i], (struct sockaddr*)&addr, &addr_len) == -1) {
+			perror("getsockname");
+			exit(EXIT_FAILURE);
+		}
+		offset = ntohl(addr.sin_addr.s_addr) - INADDR_LOOPBACK;
+		if (offset >= (sources > 1 ? sources : 1)) {
+			fprintf(stderr, "Internal connection came from %s, outside the %d sources\n",
+				inet_ntoa(addr.sin_addr), sources);
+			exit(EXIT_FAILURE);
+		}
+		for (j = 0; j < distinct; j++) {
+			if (sources_seen[j] == addr.sin_addr.s_addr) {
+				break;
+			}
+		}
+		if (j == distinct) {
+			sources_seen[distinct++] = addr.sin_addr.s_addr;
+		}
+
+		addr_len = sizeof(addr);
+		if (getpeername(sock_fds[i], (struct sockaddr*)&addr, &addr_len) == -1) {
+			perror("getpeername");
+			exit(EXIT_FAILURE);
+		}
+		offset = ntohl(addr.sin_addr.s_addr) - INADDR_LOOPBACK;
+		if (offset >= (daemon_addrs > 1 ? daemon_addrs : 1)) {
+			fprintf(stderr, "Daemon was reached on %s, outside the %d daemon addresses\n",
+				inet_ntoa(addr.sin_addr), daemon_addrs);
+			exit(EXIT_FAILURE);
+		}
+	}
+	/* All of them at once, so none could have reused another's port */
+	for (i = 0; i < sockets; i++) {
+		expect_reversed(sock_fds[i], "hello\n");
+	}
+	for (i = 0; i < sockets; i++) {
+		close(sock_fds[i]);
+	}
+
+	if (read_module_param("warm_pool_size") == 0 && distinct != expected) {
+		fprintf(stderr, "%d sockets used %d sources, expected %d\n", sockets, distinct, expected);
+		exit(EXIT_FAILURE);
+	}
+	printf("%i %d sockets used %d of %d sources\n", counter, sockets, distinct, sources);
+	return;
+}
+
+/* Run with the module loaded with internal_transport_mode=0. A socket
+ * connected through one of the pooled connections is still a TLS
+ * socket, keeps the options it was given before connecting, and talks
+ * to the peer as any other would */
+void run_warm_pool_test(void) {
+	struct sockaddr_in dst_addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(8888),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+	const char hostname[] = "www.google.com";
+	int old_size = read_module_param("warm_pool_size");
+	int rcvbuf = 1 << 18;
+	int val;
+	socklen_t len;
+	int sock_fd;
+
+	if (read_module_param("internal_transport_mode") != 0) {
+		fprintf(stderr, "The warm pool test needs the module loaded with internal_transport_mode=0\n");
+		exit(EXIT_FAILURE);
+	}
+	write_module_param("warm_pool_size", 4);
+	run_rev_server();
+	/* The pool is refilled as connections are taken from it, so the
+	 * first connect may have found it empty */
+	sock_fd = connect_to_local_server();
+	expect_reversed(sock_fd, "hello\n");
+	close(sock_fd);
+	sleep(1);
+
+	sock_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TLS);
+	if (sock_fd == -1) {
+		perror("socket");
+		exit(EXIT_FAILURE);
+	}
+	if (setsockopt(sock_fd, IPPROTO_TLS, TLS_REMOTE_HOSTNAME, hostname, sizeof(hostname)) == -1) {
+		perror("setsockopt: TLS_REMOTE_HOSTNAME");
+		exit(EXIT_FAILURE);
+	}
+	if (setsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) == -1) {
+		perror("setsockopt: SO_RCVBUF");
+		exit(EXIT_FAILURE);
+	}
+	if (connect(sock_fd, (struct sockaddr*)&dst_addr, sizeof(dst_addr)) == -1) {
+		perror("connect");
+		exit(EXIT_FAILURE);
+	}
+
+	len = sizeof(val);
+	if (getsockopt(sock_fd, SOL_SOCKET, SO_PROTOCOL, &val, &len) == -1) {
+		perror("getsockopt: SO_PROTOCOL");
+		exit(EXIT_FAILURE);
+	}
+	if (val != IPPROTO_TLS) {
+		fprintf(stderr, "Connected socket reports protocol %d, not IPPROTO_TLS\n", val);
+		exit(EXIT_FAILURE);
+	}
+	len = sizeof(val);
+	if (getsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, &val, &len) == -1) {
+		perror("getsockopt: SO_RCVBUF");
+		exit(EXIT_FAILURE);
+	}
+	if (val < rcvbuf) {
+		fprintf(stderr, "SO_RCVBUF set before connecting was lost, %d now\n", val);
+		exit(EXIT_FAILURE);
+	}
+	if (getpeername(sock_fd, (struct sockaddr*)&addr, &addr_len) == -1) {
+		perror("getpeername");
+		exit(EXIT_FAILURE);
+	}
+	expect_reversed(sock_fd, "hello\n");
+	expect_reversed(sock_fd, "and again\n");
+	close(sock_fd);
+
+	write_module_param("warm_pool_size", old_size);
+	printf("%i Connection through the warm pool succeeded\n", counter);
+	return;
+}
+
+/* Data has to go out through sendfile and splice from a pipe, and come
+ * in through splice to a pipe, as it would through send and recv */
+void run_sendfile_test(void) {
+	char file_name[] = "/tmp/ssa_sendfile_XXXXXX";
+	char file_line[] = "sent from a file\n";
+	char pipe_line[] = "sent from a pipe\n";
+	char splice_line[] = "spliced into a pipe\n";
+	char response[BUFFER_MAX];
+	int len = strlen(file_line);
+	off_t offset = 0;
+	ssize_t ret;
+	int pipe_fds[2];
+	int received;
+
+	run_rev_server();
+	int sock_fd = connect_to_local_server();
+
+	int file_fd = mkstemp(file_name);
+	if (file_fd == -1) {
+		perror("mkstemp");
+		exit(EXIT_FAILURE);
+	}
+	unlink(file_name);
+	if (write(file_fd, file_line, len) != len) {
+		perror("write");
+		exit(EXIT_FAILURE);
+	}
+	while (offset < len) {
+		ret = sendfile(sock_fd, file_fd, &offset, len - offset);
+		if (ret <= 0) {
+			perror("sendfile");
+			exit(EXIT_FAILURE);
+		}
+	}
+	receive_reversed(sock_fd, file_line);
+	close(file_fd);
+
+	if (pipe(pipe_fds) == -1) {
+		perror("pipe");
+		exit(EXIT_FAILURE);
+	}
+	len = strlen(pipe_line);
+	if (write(pipe_fds[1], pipe_line, len) != len) {
+		perror("write");
+		exit(EXIT_FAILURE);
+	}
+	for (received = 0; received < len; received += ret) {
+		ret = splice(pipe_fds[0], NULL, sock_fd, NULL, len - received, 0);
+		if (ret <= 0) {
+			perror("splice: to the socket");
+			exit(EXIT_FAILURE);
+		}
+	}
+	receive_reversed(sock_fd, pipe_line);
+
+	len = strlen(splice_line);
+	if (send(sock_fd, splice_line, len, 0) != len) {
+		perror("send");
+		exit(EXIT_FAILURE);
+	}
+	for (received = 0; received < len; received += ret) {
+		ret = splice(sock_fd, NULL, pipe_fds[1], NULL, len - received, 0);
+		if (ret <= 0) {
+			perror("splice: from the socket");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (read(pipe_fds[0], response, len) != len) {
+		perror("read");
+		exit(EXIT_FAILURE);
+	}
+	check_reversed(splice_line, response);
+
+	close(pipe_fds[0]);
+	close(pipe_fds[1]);
+	close(sock_fd);
+	printf("%i Sendfile and splice round trips succeeded\n", counter);
+	return;
+}
+
+/* Zerocopy sends can't be honoured, so they have to be refused rather
+ * than quietly copied, and leave the socket usable */
+void run_zerocopy_test(void) {
+	char line[] = "not sent with MSG_ZEROCOPY\n";
+	int one = 1;
+
+	run_rev_server();
+	int sock_fd = connect_to_local_server();
+
+	if (setsockopt(sock_fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != -1 || errno != EOPNOTSUPP) {
+		fprintf(stderr, "SO_ZEROCOPY was not refused with EOPNOTSUPP\n");
+		exit(EXIT_FAILURE);
+	}
+	if (send(sock_fd, line, strlen(line), MSG_ZEROCOPY) != -1 || errno != EOPNOTSUPP) {
+		fprintf(stderr, "MSG_ZEROCOPY send was not refused with EOPNOTSUPP\n");
+		exit(EXIT_FAILURE);
+	}
+	expect_reversed(sock_fd, line);
+
+	close(sock_fd);
+	printf("%i Zerocopy sends were refused\n", counter);
+	return;
+}
+
+/* A TLS listener with nonblocking accepts. A child process completes
+ * every client handshake before the listener accepts anything, so
+ * that accepts come in a burst and the daemon hears of them in a batch.
+ * Every accepted socket then has to carry its client's data both ways */
+void run_accept_batch_test(void) {
+	char ref[BUFFER_MAX];
+	char line[BUFFER_MAX];
+	char reply[BUFFER_MAX];
+	int accepted_fds[ACCEPT_CLIENTS];
+	int accepted = 0;
+	int largest_burst = 0;
+	int burst;
+	int ready_fds[2];
+	char ready;
+	int optval = 1;
+	int status;
+	int len;
+	int ret;
+	int i;
+	struct pollfd pfd;
+	pid_t client_pid;
+
+	int listen_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TLS);
+	if (listen_fd == -1) {
+		perror("socket");
+		exit(EXIT_FAILURE);
+	}
+	if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) == -1) {
+		perror("setsockopt");
+		exit(EXIT_FAILURE);
+	}
+	int cert_fd = open("tls_server/pem_files/certificate.pem", O_RDONLY);
+	int key_fd = open("tls_server/pem_files/key.pem", O_RDONLY);
+	if (cert_fd == -1 || key_fd == -1) {
+		perror("open: pem_files");
+		exit(EXIT_FAILURE);
+	}
+	snprintf(ref, sizeof(ref), "%c%d", TLS_FD_REF_PREFIX, cert_fd);
+	if (setsockopt(listen_fd, IPPROTO_TLS, TLS_CERTIFICATE_CHAIN, ref, strlen(ref) + 1) == -1) {
+		perror("setsockopt: TLS_CERTIFICATE_CHAIN");
+		exit(EXIT_FAILURE);
+	}
+	snprintf(ref, sizeof(ref), "%c%d", TLS_FD_REF_PREFIX, key_fd);
+	if (setsockopt(listen_fd, IPPROTO_TLS, TLS_PRIVATE_KEY, ref, strlen(ref) + 1) == -1) {
+		perror("setsockopt: TLS_PRIVATE_KEY");
+		exit(EXIT_FAILURE);
+	}
+	close(cert_fd);
+	close(key_fd);
+        struct sockaddr_in addr = {
+                .sin_family = AF_INET,
+                .sin_port = htons(8890),
+                .sin_addr.s_addr = htonl(INADDR_LOOPBACK), // 127.0.0.1
+        };
+	if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+		perror("bind");
+		exit(EXIT_FAILURE);
+	}
+	if (listen(listen_fd, SOMAXCONN) == -1) {
+		perror("listen");
+		exit(EXIT_FAILURE);
+	}
+	if (fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK) == -1) {
+		perror("fcntl: O_NONBLOCK");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pipe(ready_fds) == -1) {
+		perror("pipe");
+		exit(EXIT_FAILURE);
+	}
+	client_pid = fork();
+	if (client_pid == -1) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+	if (client_pid == 0) {
+		close(ready_fds[0]);
+		run_accept_batch_clients(ready_fds[1]);
+		_exit(EXIT_SUCCESS);
+	}
+	close(ready_fds[1]);
+	/* The child says when all of its handshakes are done */
+	if (read(ready_fds[0], &ready, 1) != 1) {
+		fprintf(stderr, "Accept batch clients failed to connect\n");
+		exit(EXIT_FAILURE);
+	}
+	close(ready_fds[0]);
+
+	while (accepted < ACCEPT_CLIENTS) {
+		pfd.fd = listen_fd;
+		pfd.events = POLLIN;
+		ret = poll(&pfd, 1, 10000);
+		if (ret == -1) {
+			perror("poll");
+			exit(EXIT_FAILURE);
+		}
+		if (ret == 0) {
+			fprintf(stderr, "Only %d of %d connections were accepted\n", accepted, ACCEPT_CLIENTS);
+			exit(EXIT_FAILURE);
+		}
+		for (burst = 0; accepted < ACCEPT_CLIENTS; burst++) {
+			ret = accept(listen_fd, NULL, NULL);
+			if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				break;
+			}
+			if (ret == -1) {
+				perror("accept");
+				exit(EXIT_FAILURE);
+			}
+			accepted_fds[accepted++] = ret;
+		}
+		if (burst > largest_burst) {
+			largest_burst = burst;
+		}
+	}
+	if (accept(listen_fd, NULL, NULL) != -1 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+		fprintf(stderr, "Accept didn't report EAGAIN with nothing left to accept\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Play the reversing server for each client */
+	for (i = 0; i < ACCEPT_CLIENTS; i++) {
+		for (len = 0; len == 0 || line[len - 1] != '\n'; len += ret) {
+			ret = recv(accepted_fds[i], line + len, sizeof(line) - 1 - len, 0);
+			if (ret <= 0) {
+				perror("recv: accepted socket");
+				exit(EXIT_FAILURE);
+			}
+		}
+		for (ret = 0; ret < len - 1; ret++) {
+			reply[ret] = line[len - 2 - ret];
+		}
+		reply[len - 1] = '\n';
+		if (send(accepted_fds[i], reply, len, 0) != len) {
+			perror("send: accepted socket");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (waitpid(client_pid, &status, 0) == -1) {
+		perror("waitpid");
+		exit(EXIT_FAILURE);
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+		fprintf(stderr, "Accept batch clients didn't get their replies\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < ACCEPT_CLIENTS; i++) {
+		close(accepted_fds[i]);
+	}
+	close(listen_fd);
+	printf("%i Accepted %d connections, at most %d at a time\n", counter, accepted, largest_burst);
+	return;
+}
+
+/* Runs in the child of run_accept_batch_test, with plain OpenSSL */
+void run_accept_batch_clients(int ready_fd) {
+	SSL* tls[ACCEPT_CLIENTS];
+	char line[BUFFER_MAX];
+	char response[BUFFER_MAX];
+	int received;
+	int ret;
+	int i;
+
+        struct sockaddr_in addr = {
+                .sin_family = AF_INET,
+                .sin_port = htons(8890),
+                .sin_addr.s_addr = htonl(INADDR_LOOPBACK), // 127.0.0.1
+        };
+	for (i = 0; i < ACCEPT_CLIENTS; i++) {
+		int sock_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (sock_fd == -1) {
+			perror("socket");
+			_exit(EXIT_FAILURE);
+		}
+		if (connect(sock_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+			perror("connect");
+			_exit(EXIT_FAILURE);
+		}
+		tls[i] = openssl_connect_to_host(sock_fd, "localhost");
+	}
+	if (write(ready_fd, "", 1) != 1) {
+		_exit(EXIT_FAILURE);
+	}
+	close(ready_fd);
+
+	for (i = 0; i < ACCEPT_CLIENTS; i++) {
+		snprintf(line, sizeof(line), "client %d\n", i);
+		if (SSL_write(tls[i], line, strlen(line)) <= 0) {
+			fprintf(stderr, "Failed in SSL_write\n");
+			_exit(EXIT_FAILURE);
+		}
+	}
+	for (i = 0; i < ACCEPT_CLIENTS; i++) {
+		snprintf(line, sizeof(line), "client %d\n", i);
+		for (received = 0; received < strlen(line); received += ret) {
+			ret = SSL_read(tls[i], response + received, strlen(line) - received);
+			if (ret <= 0) {
+				fprintf(stderr, "Failed in SSL_read\n");
+				_exit(EXIT_FAILURE);
+			}
+		}
+		check_reversed(line, response);
+		SSL_shutdown(tls[i]);
+		SSL_free(tls[i]);
+	}
+	return;
+}
+
+/* Nonblocking connects have to behave as they do on TCP. One that works
+ * reports EINPROGRESS, then EALREADY while the handshake runs, then
+ * becomes writable with no error. One to a closed port becomes ready
+ * with the error in SO_ERROR */
+void run_nonblocking_connect_test(void) {
+	int sock_fd;
+	int ret;
+
+	run_rev_server();
+        struct sockaddr_in dst_addr = {
+                .sin_family = AF_INET,
+                .sin_port = htons(8888),
+                .sin_addr.s_addr = htonl(INADDR_LOOPBACK), // 127.0.0.1
+        };
+
+	sock_fd = nonblocking_tls_socket();
+	if (connect(sock_fd, (struct sockaddr*)&dst_addr, sizeof(dst_addr)) != -1 || errno != EINPROGRESS) {
+		perror("connect: expected EINPROGRESS");
+		exit(EXIT_FAILURE);
+	}
+	ret = connect(sock_fd, (struct sockaddr*)&dst_addr, sizeof(dst_addr));
+	/* Unless the handshake was quicker than us */
+	if (ret == -1 && errno != EALREADY && errno != EISCONN) {
+		perror("connect: expected EALREADY");
+		exit(EXIT_FAILURE);
+	}
+	ret = wait_for_connect(sock_fd);
+	if (ret != 0) {
+		fprintf(stderr, "Nonblocking connect failed: %s\n", strerror(ret));
+		exit(EXIT_FAILURE);
+	}
+	ret = connect(sock_fd, (struct sockaddr*)&dst_addr, sizeof(dst_addr));
+	if (ret == -1 && errno != EISCONN) {
+		perror("connect: after the handshake");
+		exit(EXIT_FAILURE);
+	}
+	if (connect(sock_fd, (struct sockaddr*)&dst_addr, sizeof(dst_addr)) != -1 || errno != EISCONN) {
+		perror("connect: expected EISCONN");
+		exit(EXIT_FAILURE);
+	}
+	if (fcntl(sock_fd, F_SETFL, fcntl(sock_fd, F_GETFL) & ~O_NONBLOCK) == -1) {
+		perror("fcntl: O_NONBLOCK");
+		exit(EXIT_FAILURE);
+	}
+	expect_reversed(sock_fd, "hello\n");
+	close(sock_fd);
+
+	/* Nothing listens on port 1 */
+	dst_addr.sin_port = htons(1);
+	sock_fd = nonblocking_tls_socket();
+	if (connect(sock_fd, (struct sockaddr*)&dst_addr, sizeof(dst_addr)) != -1 || errno != EINPROGRESS) {
+		perror("connect: expected EINPROGRESS");
+		exit(EXIT_FAILURE);
+	}
+	if (wait_for_connect(sock_fd) == 0) {
+		fprintf(stderr, "Nonblocking connect to a closed port succeeded\n");
+		exit(EXIT_FAILURE);
+	}
+	if (connect(sock_fd, (struct sockaddr*)&dst_addr, sizeof(dst_addr)) != -1 || errno == EALREADY || errno == EISCONN) {
+		fprintf(stderr, "Failed connect didn't stay failed\n");
+		exit(EXIT_FAILURE);
+	}
+	close(sock_fd);
+	printf("%i Nonblocking connects behaved as on TCP\n", counter);
+	return;
+}
+
+/* Polls a socket with a nonblocking connect in progress until it's
+ * writable, and gives what SO_ERROR has then */
+int wait_for_connect(int sock_fd) {
+	struct pollfd pfd;
+	socklen_t len = sizeof(int);
+	int error;
+	int ret;
+
+	pfd.fd = sock_fd;
+	pfd.events = POLLOUT;
+	ret = poll(&pfd, 1, 10000);
+	if (ret == -1) {
+		perror("poll");
+		exit(EXIT_FAILURE);
+	}
+	if (ret == 0) {
+		fprintf(stderr, "Nonblocking connect never finished\n");
+		exit(EXIT_FAILURE);
+	}
+	if (getsockopt(sock_fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1) {
+		perror("getsockopt: SO_ERROR");
+		exit(EXIT_FAILURE);
+	}
+	if (error == 0 && (pfd.revents & (POLLERR | POLLHUP))) {
+		fprintf(stderr, "Connected socket polled with errors\n");
+		exit(EXIT_FAILURE);
+	}
+	return error;
+}
+
+/* A setsockopt the daemon has to answer fails with EAGAIN on a
+ * nonblocking socket. The socket polls writable once the answer is in,
+ * and repeating the call then gives it */
+void run_nonblocking_setsockopt_test(void) {
+	const char hostname[] = "www.google.com";
+	char hostname_retrieved[MAX_HOSTNAME + 1];
+	socklen_t len = sizeof(hostname_retrieved);
+	struct pollfd pfd;
+	int sock_fd;
+	int ret;
+
+	run_rev_server();
+        struct sockaddr_in dst_addr = {
+                .sin_family = AF_INET,
+                .sin_port = htons(8888),
+                .sin_addr.s_addr = htonl(INADDR_LOOPBACK), // 127.0.0.1
+        };
+
+	sock_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TLS);
+	if (sock_fd == -1) {
+		perror("socket");
+		exit(EXIT_FAILURE);
+	}
+	if (fcntl(sock_fd, F_SETFL, fcntl(sock_fd, F_GETFL) | O_NONBLOCK) == -1) {
+		perror("fcntl: O_NONBLOCK");
+		exit(EXIT_FAILURE);
+	}
+	if (setsockopt(sock_fd, IPPROTO_TLS, TLS_REMOTE_HOSTNAME, hostname, sizeof(hostname)) != -1 || errno != EAGAIN) {
+		perror("setsockopt: expected EAGAIN");
+		exit(EXIT_FAILURE);
+	}
+	do {
+		pfd.fd = sock_fd;
+		pfd.events = POLLOUT;
+		ret = poll(&pfd, 1, 10000);
+		if (ret == -1) {
+			perror("poll");
+			exit(EXIT_FAILURE);
+		}
+		if (ret == 0) {
+			fprintf(stderr, "Daemon's answer never arrived\n");
+			exit(EXIT_FAILURE);
+		}
+		ret = setsockopt(sock_fd, IPPROTO_TLS, TLS_REMOTE_HOSTNAME, hostname, sizeof(hostname));
+	} while (ret == -1 && errno == EAGAIN);
+	if (ret == -1) {
+		perror("setsockopt: TLS_REMOTE_HOSTNAME repeated");
+		exit(EXIT_FAILURE);
+	}
+	if (getsockopt(sock_fd, IPPROTO_TLS, TLS_REMOTE_HOSTNAME, hostname_retrieved, &len) == -1) {
+		perror("getsockopt: TLS_REMOTE_HOSTNAME");
+		exit(EXIT_FAILURE);
+	}
+	if (strcmp(hostname, hostname_retrieved) != 0) {
+		fprintf(stderr, "Hostname mismatch: expected %s but got %s\n", hostname, hostname_retrieved);
+		exit(EXIT_FAILURE);
+	}
+
+	if (connect(sock_fd, (struct sockaddr*)&dst_addr, sizeof(dst_addr)) != -1 || errno != EINPROGRESS) {
+		perror("connect: expected EINPROGRESS");
+		exit(EXIT_FAILURE);
+	}
+	ret = wait_for_connect(sock_fd);
+	if (ret != 0) {
+		fprintf(stderr, "Nonblocking connect failed: %s\n", strerror(ret));
+		exit(EXIT_FAILURE);
+	}
+	if (fcntl(sock_fd, F_SETFL, fcntl(sock_fd, F_GETFL) & ~O_NONBLOCK) == -1) {
+		perror("fcntl: O_NONBLOCK");
+		exit(EXIT_FAILURE);
+	}
+	expect_reversed(sock_fd, "hello\n");
+	close(sock_fd);
+	printf("%i Nonblocking setsockopt was answered on retry\n", counter);
+	return;
+}
+
+/* Data given to sendto with MSG_FASTOPEN has to connect the socket and
+ * reach the server exactly once, whether or not it may go as early
+ * data. The first connection has no session to resume, so its data
+ * waits for the handshake. Later ones may resume one */
+void run_fastopen_test(void) {
+	char line[] = "sent with the connect\n";
+	int len = strlen(line);
+	int early_data;
+	int i;
+
+	run_rev_server();
+        struct sockaddr_in dst_addr = {
+                .sin_family = AF_INET,
+                .sin_port = htons(8888),
+                .sin_addr.s_addr = htonl(INADDR_LOOPBACK), // 127.0.0.1
+        };
+
+	for (i = 0; i < 4; i++) {
+		early_data = i % 2;
+		int sock_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TLS);
+		if (sock_fd == -1) {
+			perror("socket");
+			exit(EXIT_FAILURE);
+		}
+
+		const char hostname[] = "www.google.com";
+		if (setsockopt(sock_fd, IPPROTO_TLS, TLS_REMOTE_HOSTNAME, hostname, sizeof(hostname)) == -1) {
+			perror("setsockopt: TLS_REMOTE_HOSTNAME");
+			exit(EXIT_FAILURE);
+		}
+		if (setsockopt(sock_fd, IPPROTO_TLS, TLS_EARLY_DATA, &early_data, sizeof(early_data)) == -1) {
+			perror("setsockopt: TLS_EARLY_DATA");
+			exit(EXIT_FAILURE);
+		}
+		if (sendto(sock_fd, line, len, MSG_FASTOPEN, (struct sockaddr*)&dst_addr, sizeof(dst_addr)) != len) {
+			perror("sendto: MSG_FASTOPEN");
+			exit(EXIT_FAILURE);
+		}
+		receive_reversed(sock_fd, line);
+		/* Connected like any other socket from here */
+		expect_reversed(sock_fd, "hello\n");
+		close(sock_fd);
+	}
+	printf("%i Fast open round trips succeeded\n", counter);
+	return;
+}
+
+/* Run as root, with session_cache_size above 0. Stands in for daemons
+ * storing and fetching sessions. A fetch has to give back the latest
+ * session stored under the same key, ignoring whatever follows the
+ * hostname, and nothing for another key or once the session's lifetime
+ * is up */
+void run_session_store_test(void) {
+	struct ssa_session_key key;
+	struct ssa_session_key other_key;
+	char first[] = "first session";
+	char second[] = "second session";
+	char session[BUFFER_MAX];
+	int family_id;
+	int nl_fd;
+	int ret;
+
+	if (read_module_param("session_cache_size") <= 0) {
+		fprintf(stderr, "The session store test needs session_cache_size above 0\n");
+		exit(EXIT_FAILURE);
+	}
+	nl_fd = open_ssa_netlink(&family_id);
+
+	memset(&key, 0, sizeof(key));
+	key.config_id = 1;
+	key.port = htons(443);
+	strcpy(key.hostname, "session-store-test.invalid");
+	if ((ret = netlink_store_session(nl_fd, family_id, &key, first, sizeof(first), 0)) != 0 ||
+			(ret = netlink_store_session(nl_fd, family_id, &key, second, sizeof(second), 0)) != 0) {
+		fprintf(stderr, "Session store failed: %s\n", strerror(-ret));
+		exit(EXIT_FAILURE);
+	}
+	ret = netlink_fetch_session(nl_fd, family_id, &key, session, sizeof(session));
+	if (ret != sizeof(second) || memcmp(session, second, sizeof(second)) != 0) {
+		fprintf(stderr, "Fetch didn't give back the last session stored\n");
+		exit(EXIT_FAILURE);
+	}
+
+	other_key = key;
+	memset(other_key.hostname + strlen(key.hostname) + 1, 'x', 16);
+	if (netlink_fetch_session(nl_fd, family_id, &other_key, session, sizeof(session)) != sizeof(second)) {
+		fprintf(stderr, "Fetch saw past the end of the hostname\n");
+		exit(EXIT_FAILURE);
+	}
+	other_key = key;
+	other_key.config_id = 2;
+	if (netlink_fetch_session(nl_fd, family_id, &other_key, session, sizeof(session)) != -1) {
+		fprintf(stderr, "Fetch gave a session stored under another configuration\n");
+		exit(EXIT_FAILURE);
+	}
+	other_key = key;
+	other_key.port = htons(8443);
+	if (netlink_fetch_session(nl_fd, family_id, &other_key, session, sizeof(session)) != -1) {
+		fprintf(stderr, "Fetch gave a session stored for another port\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (netlink_store_session(nl_fd, family_id, &key, first, 0, 0) != -EINVAL) {
+		fprintf(stderr, "An empty session was stored\n");
+		exit(EXIT_FAILURE);
+	}
+	if ((ret = netlink_store_session(nl_fd, family_id, &key, first, sizeof(first), 1)) != 0) {
+		fprintf(stderr, "Session store failed: %s\n", strerror(-ret));
+		exit(EXIT_FAILURE);
+	}
+	sleep(2);
+	if (netlink_fetch_session(nl_fd, family_id, &key, session, sizeof(session)) != -1) {
+		fprintf(stderr, "Fetch gave a session past its lifetime\n");
+		exit(EXIT_FAILURE);
+	}
+
+	close(nl_fd);
+	printf("%i Session store and fetch behaved\n", counter);
+	return;
+}
+
+/* A lifetime of 0 leaves it to the module. Gives 0 on success,
+ * otherwise the negated error */
+int netlink_store_session(int nl_fd, int family_id, struct ssa_session_key* key, char* session, int len, int lifetime) {
+	char request[NL_BUFFER_MAX];
+	struct nlmsghdr* nlh;
+
+	nlh = genetlink_message(request, family_id, SSA_NL_C_SESSION_STORE);
+	netlink_put_attr(nlh, SSA_NL_A_SESSION_KEY, key, sizeof(struct ssa_session_key));
+	netlink_put_attr(nlh, SSA_NL_A_SESSION, session, len);
+	if (lifetime != 0) {
+		netlink_put_attr(nlh, SSA_NL_A_SESSION_LIFETIME, &lifetime, sizeof(lifetime));
+	}
+	return netlink_transact(nl_fd, nlh, NULL, 0);
+}
+
+/* Gives the length of the session copied into session, or -1 if there
+ * was none */
+int netlink_fetch_session(int nl_fd, int family_id, struct ssa_session_key* key, char* session, int len) {
+	char request[NL_BUFFER_MAX];
+	char reply[NL_BUFFER_MAX];
+	struct nlmsghdr* nlh;
+	struct nlattr* na;
+	int ret;
+
+	nlh = genetlink_message(request, family_id, SSA_NL_C_SESSION_FETCH);
+	netlink_put_attr(nlh, SSA_NL_A_SESSION_KEY, key, sizeof(struct ssa_session_key));
+	ret = netlink_transact(nl_fd, nlh, reply, sizeof(reply));
+	if (ret != 0) {
+		fprintf(stderr, "Session fetch failed: %s\n", strerror(-ret));
+		exit(EXIT_FAILURE);
+	}
+	if ((na = netlink_find_attr((struct nlmsghdr*)reply, SSA_NL_A_SESSION)) == NULL) {
+		return -1;
+	}
+	if (na->nla_len - NLA_HDRLEN > len) {
+		fprintf(stderr, "Fetched session is too long\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(session, (char*)na + NLA_HDRLEN, na->nla_len - NLA_HDRLEN);
+	return na->nla_len - NLA_HDRLEN;
+}
@@ -0,0 +1,301 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/hashtable.h>
+#include <linux/bitmap.h>
+#include <linux/rcupdate.h>
+#include <linux/sched.h>
+#include <linux/cred.h>
+#include <linux/cgroup.h>
+#include <net/net_namespace.h>
+#include <net/netns/generic.h>
+#include "tls_admit.h"
+#include "tls_daemon.h"
+#include "tls_common.h"
+
+/* Handshakes each daemon may have in flight at once. Past that, and
+ * past an owner's fair share of the pool, nonblocking connects fail
+ * straight away with -EAGAIN and blocking ones queue */
+static int daemon_max_handshakes = 0;
+module_param(daemon_max_handshakes, int, 0644);
+MODULE_PARM_DESC(daemon_max_handshakes, "Handshakes a daemon may have in flight at once, 0 for no limit");
+
+#define FAIR_SHARE_BY_UID	0
+#define FAIR_SHARE_BY_CGROUP	1
+
+static int fair_share_by = FAIR_SHARE_BY_UID;
+module_param(fair_share_by, int, 0644);
+MODULE_PARM_DESC(fair_share_by, "Share daemon capacity evenly between 0 = users, 1 = cgroups");
+
+/* A user or cgroup with handshakes in flight or queued in a network
+ * namespace. The same user in two namespaces is two owners, each
+ * sharing its own namespace's pool */
+struct admission_owner {
+	struct hlist_node hash;
+	u64 key;
+	int inflight;
+	int waiting;
+	DECLARE_BITMAP(waiting_on, MAX_DAEMONS); /* daemons its waiters queue on */
+};
+
+/* Each namespace's daemons have their own slots and wait queues, and
+ * the namespace its own pool to share between its owners. Everything
+ * but the wait queues is under the namespace's lock, so handshakes in
+ * one namespace never wait on another's, and a slot coming free only
+ * wakes those queued on that daemon */
+typedef struct admission_net {
+	spinlock_t lock;
+	DECLARE_HASHTABLE(owners, 6);
+	int nr_owners;
+	int handshakes[MAX_DAEMONS];
+	wait_queue_head_t wait[MAX_DAEMONS];
+} admission_net_t;
+
+static unsigned int admission_net_id;
+
+static int admission_net_init(struct net* net);
+static u64 current_owner_key(void);
+static struct admission_owner* get_owner(admission_net_t* an, u64 key, struct admission_owner* spare);
+static int put_owner(admission_net_t* an, struct admission_owner* owner);
+static int try_admit(struct net* net, struct admission_owner* owner, int n);
+static void wake_owner_waiters(admission_net_t* an, struct admission_owner* owner, int n, int owners_changed);
+
+static struct pernet_operations admission_net_ops = {
+	.init = admission_net_init,
+	.id = &admission_net_id,
+	.size = sizeof(admission_net_t),
+};
+
+int tls_admit_setup(void) {
+	return register_pernet_subsys(&admission_net_ops);
+}
+
+void tls_admit_cleanup(void) {
+	unregister_pernet_subsys(&admission_net_ops);
+	return;
+}
+
+int admission_net_init(struct net* net) {
+	admission_net_t* an = net_generic(net, admission_net_id);
+	int n;
+	spin_lock_init(&an->lock);
+	hash_init(an->owners);
+	an->nr_owners = 0;
+	for (n = 0; n < MAX_DAEMONS; n++) {
+		an->handshakes[n] = 0;
+		init_waitqueue_head(&an->wait[n]);
+	}
+	return 0;
+}
+
+/**
+ * Reserves one of a daemon's handshake slots for the current task before
+ * a connect is sent to it. When the pool is busy each owner is held to
+ * an even share of it, so a flood from one tenant only queues behind
+ * itself
+ * @param	net - The daemon's network namespace
+ * @param	daemon_id - The daemon the handshake will go to
+ * @param	blocking - Whether the caller may wait for a slot
+ * @param	owner - Set to what finish_handshake needs to give the slot back
+ * @return	0 if admitted, -EAGAIN if over the limit and not blocking,
+ * 		-ETIMEDOUT if no slot came free in time, or -ERESTARTSYS
+ */
+int admit_handshake(struct net* net, int daemon_id, int blocking, struct admission_owner** owner) {
+	admission_net_t* an;
+	struct admission_owner* spare;
+	struct admission_owner* o;
+	int owners_changed = 0;
+	long ret;
+	u64 key;
+	int n = daemon_id - DAEMON_START_PORT;
+
+	*owner = NULL;
+	if (READ_ONCE(daemon_max_handshakes) <= 0 || n < 0 || n >= MAX_DAEMONS) {
+		return 0;
+	}
+	spare = kmalloc(sizeof(struct admission_owner), GFP_KERNEL);
+	if (spare == NULL) {
+		return -ENOMEM;
+	}
+	key = current_owner_key();
+	an = net_generic(net, admission_net_id);
+	spin_lock(&an->lock);
+	o = get_owner(an, key, spare);
+	if (o != spare) {
+		kfree(spare);
+	}
+	o->waiting++;
+	spin_unlock(&an->lock);
+
+	if (blocking == 0) {
+		ret = try_admit(net, o, n) ? 1 : -EAGAIN;
+	}
+	else {
+		spin_lock(&an->lock);
+		set_bit(n, o->waiting_on);
+		spin_unlock(&an->lock);
+		ret = wait_event_interruptible_timeout(an->wait[n], try_admit(net, o, n), HANDSHAKE_TIMEOUT);
+		if (ret == 0) {
+			ret = -ETIMEDOUT;
+		}
+	}
+
+	spin_lock(&an->lock);
+	o->waiting--;
+	if (o->waiting == 0) {
+		bitmap_zero(o->waiting_on, MAX_DAEMONS);
+	}
+	if (ret < 0) {
+		owners_changed = put_owner(an, o);
+	}
+	spin_unlock(&an->lock);
+	if (owners_changed) {
+		/* Everyone else's share just grew */
+		wake_owner_waiters(an, NULL, -1, 1);
+	}
+	if (ret < 0) {
+		return ret;
+	}
+	*owner = o;
+	return 0;
+}
+
+/**
+ * Gives back a slot taken by admit_handshake once the daemon has replied
+ * or been given up on
+ * @param	net - The daemon's network namespace
+ * @param	daemon_id - The daemon the handshake went to
+ * @param	owner - As set by admit_handshake
+ */
+void finish_handshake(struct net* net, int daemon_id, struct admission_owner* owner) {
+	admission_net_t* an;
+	int owners_changed;
+	int n = daemon_id - DAEMON_START_PORT;
+	if (owner == NULL) {
+		return;
+	}
+	an = net_generic(net, admission_net_id);
+	spin_lock(&an->lock);
+	an->handshakes[n]--;
+	owner->inflight--;
+	/* The owner's other waiters may have been held to its share.
+	 * Once it's gone its bitmap can't be read, so this is done now */
+	wake_owner_waiters(an, owner, n, 0);
+	owners_changed = put_owner(an, owner);
+	spin_unlock(&an->lock);
+	if (owners_changed) {
+		wake_owner_waiters(an, NULL, -1, 1);
+	}
+	return;
+}
+
+/**
+ * Wakes the queues a slot or share coming free may let through
+ * @param	an - The namespace's admission state
+ * @param	owner - Owner whose handshake finished, or NULL
+ * @param	n - Index of the daemon with a slot free, or -1
+ * @param	owners_changed - Whether an owner went away, raising everyone's share
+ */
+void wake_owner_waiters(admission_net_t* an, struct admission_owner* owner, int n, int owners_changed) {
+	int i;
+	if (n >= 0) {
+		wake_up_all(&an->wait[n]);
+	}
+	if (owner != NULL && owner->waiting > 0) {
+		for_each_set_bit(i, owner->waiting_on, MAX_DAEMONS) {
+			if (i != n) {
+				wake_up_all(&an->wait[i]);
+			}
+		}
+	}
+	if (owners_changed) {
+		for (i = 0; i < MAX_DAEMONS; i++) {
+			if (waitqueue_active(&an->wait[i])) {
+				wake_up_all(&an->wait[i]);
+			}
+		}
+	}
+	return;
+}
+
+/* Looks at the task's cgroup, so it must be called without spinlocks
+ * held */
+u64 current_owner_key(void) {
+	u64 key;
+#ifdef CONFIG_CGROUPS
+	if (READ_ONCE(fair_share_by) == FAIR_SHARE_BY_CGROUP) {
+		rcu_read_lock();
+		key = cgroup_id(task_dfl_cgroup(current));
+		rcu_read_unlock();
+		return key;
+	}
+#endif
+	key = from_kuid(&init_user_ns, current_uid());
+	return key;
+}
+
+/**
+ * Finds the owner with the given key in a namespace, adding it if it's
+ * new. Must be called with the namespace's lock held
+ * @param	an - The namespace's admission state
+ * @param	key - UID or cgroup ID
+ * @param	spare - Freshly allocated owner to use if it's new
+ * @return	The owner
+ */
+struct admission_owner* get_owner(admission_net_t* an, u64 key, struct admission_owner* spare) {
+	struct admission_owner* owner;
+	hash_for_each_possible(an->owners, owner, hash, key) {
+		if (owner->key == key) {
+			return owner;
+		}
+	}
+	spare->key = key;
+	spare->inflight = 0;
+	spare->waiting = 0;
+	bitmap_zero(spare->waiting_on, MAX_DAEMONS);
+	hash_add(an->owners, &spare->hash, key);
+	an->nr_owners++;
+	return spare;
+}
+
+/* Must be called with the namespace's lock held. Returns 1 if the
+ * owner was freed */
+int put_owner(admission_net_t* an, struct admission_owner* owner) {
+	if (owner->inflight > 0 || owner->waiting > 0) {
+		return 0;
+	}
+	hash_del(&owner->hash);
+	an->nr_owners--;
+	kfree(owner);
+	return 1;
+}
+
+/**
+ * Takes a slot on a daemon if it has one free and the owner is within
+ * its share of the pool
+ * @param	net - The daemon's network namespace
+ * @param	owner - Who the handshake is for
+ * @param	n - Index of the daemon
+ * @return	1 if a slot was taken and 0 otherwise
+ */
+int try_admit(struct net* net, struct admission_owner* owner, int n) {
+	admission_net_t* an = net_generic(net, admission_net_id);
+	int limit = READ_ONCE(daemon_max_handshakes);
+	int active = active_daemon_count(net);
+	int share;
+	int ret = 0;
+	spin_lock(&an->lock);
+	share = limit * active / an->nr_owners;
+	if (share < 1) {
+		share = 1;
+	}
+	if (limit <= 0 || (an->handshakes[n] < limit && owner->inflight < share)) {
+		an->handshakes[n]++;
+		owner->inflight++;
+		ret = 1;
+	}
+	spin_unlock(&an->lock);
+	return ret;
+}
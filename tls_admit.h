@@ -0,0 +1,12 @@
+#ifndef TLS_ADMIT_H
+#define TLS_ADMIT_H
+
+struct net;
+struct admission_owner;
+
+int tls_admit_setup(void);
+void tls_admit_cleanup(void);
+int admit_handshake(struct net* net, int daemon_id, int blocking, struct admission_owner** owner);
+void finish_handshake(struct net* net, int daemon_id, struct admission_owner* owner);
+
+#endif /* TLS_ADMIT_H */
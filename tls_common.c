@@ -8,21 +8,146 @@
 #include <linux/uaccess.h>
 #include <linux/sched/mm.h>
 #include <linux/fs_struct.h>
+#include <linux/in.h>
+#include <linux/tcp.h>
+#include <linux/ktime.h>
+#include <net/sock.h>
 #include "socktls.h"
 #include "tls_common.h"
 #include "tls_inet.h"
 #include "tls_unix.h"
+#include "tls_daemon.h"
+#include "tls_select.h"
+#include "tls_ktls.h"
+#include "tls_admit.h"
+#include "tls_warm.h"
+#include "tls_fdref.h"
 #include "netlink.h"
 
 #define HASH_TABLE_BITSIZE	9
 #define MAX_HOST_LEN		255
+#define MAX_BATCH_OPTS		64
+#define RDATA_MAX_LEN		(4 << 20) /* largest getsockopt value a daemon may return */
+
+/* Where a non-TLS socket option takes effect */
+#define OPT_CLASS_SYNC		0 /* daemon first, then locally (the default) */
+#define OPT_CLASS_LOCAL		1 /* only the internal loopback leg */
+#define OPT_CLASS_DAEMON	2 /* only the daemon's external socket */
+#define OPT_CLASS_MIRROR	3 /* locally, mirrored to the daemon without a reply */
+#define OPT_CLASS_DEFER		4 /* locally, mirrored once the daemon is about to use it */
+
+/* Deferred options, as bits of deferred_opts */
+#define DEFER_REUSEADDR		0x1
+#define DEFER_REUSEPORT		0x2
+
+typedef struct opt_class {
+	int level;
+	int optname;
+	int class;
+} opt_class_t;
+
+/* An option on its way to the daemon, with whatever the socket keeps of
+ * it allocated up front, so that saving it once the daemon accepts it
+ * can't fail */
+typedef struct staged_opt {
+	int optname;
+	char* val; /* as sent to the daemon, not owned */
+	unsigned int len;
+	char* copy; /* kept by the socket, if it keeps anything */
+} staged_opt_t;
+
+/* A setsockopt waiting on the daemon. On a nonblocking socket it's sent
+ * without waiting, and the application repeats the call once the socket
+ * polls writable again to collect the result */
+typedef struct pending_opt {
+	u32 seq;
+	int level;
+	int optname;
+	char* sent; /* as sent to the daemon. Staged values point into it */
+	unsigned int sent_len;
+	staged_opt_t* staged;
+	int count;
+	setsockopt_t orig_func; /* applies a non-TLS option locally afterwards */
+	char* user_val; /* as the application passed it, to know the repeat */
+	unsigned int user_len;
+	unsigned long deadline;
+	int answered;
+	int response;
+	int response_index;
+} pending_opt_t;
+
+/* Options not listed here keep the synchronous round trip, since we
+ * can't know whether the daemon would reject them */
+static const opt_class_t opt_class_table[] = {
+	/* Buffering and timing between the application and us */
+	{ SOL_SOCKET,	SO_SNDBUF,		OPT_CLASS_LOCAL },
+	{ SOL_SOCKET,	SO_RCVBUF,		OPT_CLASS_LOCAL },
+	{ SOL_SOCKET,	SO_SNDBUFFORCE,		OPT_CLASS_LOCAL },
+	{ SOL_SOCKET,	SO_RCVBUFFORCE,		OPT_CLASS_LOCAL },
+	{ SOL_SOCKET,	SO_RCVLOWAT,		OPT_CLASS_LOCAL },
+	{ SOL_SOCKET,	SO_SNDTIMEO,		OPT_CLASS_LOCAL },
+	{ SOL_SOCKET,	SO_RCVTIMEO,		OPT_CLASS_LOCAL },
+	{ SOL_SOCKET,	SO_TIMESTAMP,		OPT_CLASS_LOCAL },
+	{ SOL_SOCKET,	SO_TIMESTAMPNS,		OPT_CLASS_LOCAL },
+	{ SOL_SOCKET,	SO_BUSY_POLL,		OPT_CLASS_LOCAL },
+	{ SOL_SOCKET,	SO_ZEROCOPY,		OPT_CLASS_LOCAL },
+	{ IPPROTO_TCP,	TCP_QUICKACK,		OPT_CLASS_LOCAL },
+	{ IPPROTO_TCP,	TCP_NOTSENT_LOWAT,	OPT_CLASS_LOCAL },
+	/* These would break or mean nothing on a loopback connection */
+	{ SOL_SOCKET,	SO_BINDTODEVICE,	OPT_CLASS_DAEMON },
+	{ SOL_SOCKET,	SO_MARK,		OPT_CLASS_DAEMON },
+	{ IPPROTO_IP,	IP_TTL,			OPT_CLASS_DAEMON },
+	{ IPPROTO_TCP,	TCP_MAXSEG,		OPT_CLASS_DAEMON },
+	{ IPPROTO_TCP,	TCP_CONGESTION,		OPT_CLASS_DAEMON },
+	/* Only matter to the daemon at bind time. Telling it then keeps
+	 * the socket free to move to another daemon until it binds */
+	{ SOL_SOCKET,	SO_REUSEADDR,		OPT_CLASS_DEFER },
+	{ SOL_SOCKET,	SO_REUSEPORT,		OPT_CLASS_DEFER },
+	/* Common tuning that matters on both legs */
+	{ SOL_SOCKET,	SO_KEEPALIVE,		OPT_CLASS_MIRROR },
+	{ SOL_SOCKET,	SO_LINGER,		OPT_CLASS_MIRROR },
+	{ SOL_SOCKET,	SO_PRIORITY,		OPT_CLASS_MIRROR },
+	{ IPPROTO_IP,	IP_TOS,			OPT_CLASS_MIRROR },
+	{ IPPROTO_TCP,	TCP_NODELAY,		OPT_CLASS_MIRROR },
+	{ IPPROTO_TCP,	TCP_CORK,		OPT_CLASS_MIRROR },
+	{ IPPROTO_TCP,	TCP_KEEPIDLE,		OPT_CLASS_MIRROR },
+	{ IPPROTO_TCP,	TCP_KEEPINTVL,		OPT_CLASS_MIRROR },
+	{ IPPROTO_TCP,	TCP_KEEPCNT,		OPT_CLASS_MIRROR },
+	{ IPPROTO_TCP,	TCP_USER_TIMEOUT,	OPT_CLASS_MIRROR },
+};
 
 /* Helpers */
 int get_remote_hostname(tls_sock_data_t* sock_data, char __user *optval, int* __user len);
 int get_id(tls_sock_data_t* sock_data, char __user *optval, int* __user optlen);
-int set_remote_hostname(tls_sock_data_t* sock_data, char* optval, unsigned int len);
+static int prepare_tls_opt(tls_sock_data_t* sock_data, int optname, char** koptval, unsigned int* optlen, int* timeout_val);
+static int stage_tls_opt(int optname, char* koptval, unsigned int optlen, staged_opt_t* staged);
+static void commit_tls_opt(tls_sock_data_t* sock_data, staged_opt_t* staged);
+static void unstage_tls_opt(staged_opt_t* staged);
+static void unstage_batch(staged_opt_t* staged, int count);
+static int set_options_batch(tls_sock_data_t* sock_data, struct socket* sock, char* batch, unsigned int len, char __user *optval);
+static int send_opt(tls_sock_data_t* sock_data, struct socket* sock, pending_opt_t* pending, int timeout_val, char __user *optval, unsigned int optlen);
+static int finish_opt(tls_sock_data_t* sock_data, struct socket* sock, pending_opt_t* pending, char __user *optval, unsigned int optlen);
+static int resume_pending_opt(tls_sock_data_t* sock_data, struct socket* sock, int level, int optname, char __user *optval, unsigned int optlen, int* ret);
+static void free_pending_opt(pending_opt_t* pending);
+static int is_nonblocking(tls_sock_data_t* sock_data);
+static void wake_opt_waiters(tls_sock_data_t* sock_data);
+static int is_batchable_opt(int optname);
+static int move_tls_sock(tls_sock_data_t* sock_data, int new_id);
+static void log_tls_opt(tls_sock_data_t* sock_data, int optname, char* val, unsigned int len);
+static int classify_opt(int level, int optname, setsockopt_t orig_func);
+static int mirror_opt(tls_sock_data_t* sock_data, int level, int optname, char __user *optval, unsigned int optlen);
+static int opt_record_fits(struct tls_opt_record* rec, unsigned int remaining);
+static tls_opt_cache_t* get_cached_opt(tls_sock_data_t* sock_data, int optname);
+static void cache_opt(tls_sock_data_t* sock_data, int optname, char* val, unsigned int len, int immutable);
+static void cache_handshake_facts(tls_sock_data_t* sock_data, char* facts, unsigned int len);
+static void forget_requested_opts(tls_sock_data_t* sock_data);
+static int is_handshake_fact(int optname);
+static int copy_opt_to_user(char* val, unsigned int val_len, unsigned int offset, char __user *optval, int __user *optlen, int len);
+static int set_optval_offset(tls_sock_data_t* sock_data, char __user *optval, unsigned int optlen);
+static void expect_rdata(tls_sock_data_t* sock_data, u32 seq);
 static int is_valid_host_string(char* str, int len);
 char* get_absolute_path(char* rpath, int* rpath_len);
+static int resolve_fd_ref(tls_sock_data_t* sock_data, char** koptval, unsigned int* optlen);
 char* kgetcwd(char* buffer, int buflen);
 
 static DEFINE_HASHTABLE(tls_sock_data_table, HASH_TABLE_BITSIZE);
@@ -57,6 +182,33 @@ void rem_tls_sock_data(struct hlist_node* hash) {
 	return;
 }
 
+/**
+ * Frees TLS socket data and everything it owns. The caller must
+ * have already removed it from the hash table
+ * @param	sock_data - The TLS socket data to free
+ */
+void free_tls_sock_data(tls_sock_data_t* sock_data) {
+	int i;
+	for (i = 0; i < TLS_OPT_CACHE_SIZE; i++) {
+		kvfree(sock_data->opt_cache[i].val);
+	}
+	kvfree(sock_data->rdata);
+	if (sock_data->pending_opt != NULL) {
+		free_pending_opt(sock_data->pending_opt);
+	}
+	drop_ktls(sock_data);
+	drop_warm_connection(sock_data);
+	/* Closed before a nonblocking connect's handshake finished */
+	finish_handshake(sock_data->net, sock_data->daemon_id, sock_data->admission);
+	for (i = 0; i < sock_data->ref_file_count; i++) {
+		release_ref_file(sock_data->ref_files[i]);
+	}
+	kfree(sock_data->optlog);
+	kfree(sock_data->hostname);
+	kfree(sock_data);
+	return;
+}
+
 void tls_setup(void) {
 	register_netlink();
 	hash_init(tls_sock_data_table);
@@ -68,7 +220,10 @@ void tls_cleanup(void) {
         tls_sock_data_t* it;
         struct hlist_node tmp;
         struct hlist_node* tmpptr = &tmp;
+	HLIST_HEAD(doomed);
 
+	/* Freeing may sleep (releasing sockets and files), so entries
+	 * are only unlinked under the lock and freed after it */
         spin_lock(&tls_sock_data_table_lock);
         hash_for_each_safe(tls_sock_data_table, bkt, tmpptr, it, hash) {
 		/*if (it->int_addr.sa_family == AF_INET) {
@@ -78,77 +233,484 @@ void tls_cleanup(void) {
 			(*ref_unix_release)((it->sk)->sk_socket);
 		}*/
                 hash_del(&it->hash);
-                kfree(it->hostname);
-		kfree(it);
+		hlist_add_head(&it->hash, &doomed);
         }
         spin_unlock(&tls_sock_data_table_lock);
 
+	hlist_for_each_entry_safe(it, tmpptr, &doomed, hash) {
+		hlist_del(&it->hash);
+		free_tls_sock_data(it);
+	}
+
 	unregister_netlink();
 
 	return;
 }
 
 
-void report_return(unsigned long key, int ret) {
+/**
+ * Waits for the daemon to reply to a notification, keeping track of
+ * how loaded and how quick each daemon is for the balancer
+ * @param	sock_data - TLS socket data of the socket that is waiting
+ * @param	timeout - How long to wait, in jiffies
+ * @return	0 if the daemon didn't reply in time, otherwise the jiffies left
+ */
+unsigned long wait_for_daemon(tls_sock_data_t* sock_data, unsigned long timeout) {
+	unsigned long ret;
+	u64 start;
+	int daemon_id = sock_data->daemon_id;
+	start = ktime_get_ns();
+	daemon_request_started(sock_data->net, daemon_id);
+	ret = wait_for_completion_timeout(&sock_data->sock_event, timeout);
+	/* A daemon that never answers counts as having taken the
+	 * whole timeout */
+	daemon_request_finished(sock_data->net, daemon_id, ret != 0 ? ktime_get_ns() - start : jiffies_to_nsecs(timeout));
+	return ret;
+}
+
+/**
+ * Waits for the daemon's reply like wait_for_daemon, but gives up on a
+ * signal. The reply may still arrive afterwards, so the caller has to
+ * make sure someone is left to deal with it
+ * @param	sock_data - TLS socket data of the socket that is waiting
+ * @param	timeout - How long to wait, in jiffies
+ * @return	0 on timeout, -ERESTARTSYS on a signal, otherwise the
+ * 		jiffies left
+ */
+long wait_for_daemon_interruptible(tls_sock_data_t* sock_data, unsigned long timeout) {
+	long ret;
+	u64 start;
+	int daemon_id = sock_data->daemon_id;
+	start = ktime_get_ns();
+	daemon_request_started(sock_data->net, daemon_id);
+	ret = wait_for_completion_interruptible_timeout(&sock_data->sock_event, timeout);
+	daemon_request_finished(sock_data->net, daemon_id, ret != 0 ? ktime_get_ns() - start : jiffies_to_nsecs(timeout));
+	return ret;
+}
+
+/**
+ * Moves a socket off a daemon that is draining or gone, if the daemon
+ * isn't yet holding anything for it beyond its TLS options
+ * @param	sock_data - TLS socket data of the socket about to be used
+ * @return	0 if the socket can go ahead, otherwise an error
+ */
+int migrate_if_draining(tls_sock_data_t* sock_data) {
+	int new_id;
+	if (sock_data->pinned == 1 || daemon_is_active(sock_data->net, sock_data->daemon_id)) {
+		return 0;
+	}
+	new_id = assign_daemon(sock_data->net);
+	if (new_id < 0) {
+		/* There's nowhere to go */
+		return 0;
+	}
+	if (new_id == sock_data->daemon_id) {
+		/* There's nowhere better to go */
+		daemon_socket_removed(sock_data->net, new_id);
+		return 0;
+	}
+	return move_tls_sock(sock_data, new_id);
+}
+
+/**
+ * Moves a socket that is about to connect or bind to whichever daemon the
+ * attached selection program picks, if there is one
+ * @param	sock_data - TLS socket data of the socket
+ * @param	hook - TLS_SELECT_CONNECT or TLS_SELECT_BIND
+ * @param	uaddr - The address being connected or bound to
+ * @return	1 if the program chose the daemon, 0 if it's left to the
+ * 		policy, otherwise an error
+ */
+int route_by_selector(tls_sock_data_t* sock_data, int hook, struct sockaddr* uaddr) {
+	int new_id;
+	int ret;
+
+	if (sock_data->pinned == 1) {
+		return 0;
+	}
+	new_id = select_daemon(sock_data->net, hook, uaddr, sock_data->hostname);
+	if (new_id < 0) {
+		return 0;
+	}
+	if (new_id != sock_data->daemon_id) {
+		daemon_socket_added(sock_data->net, new_id);
+		ret = move_tls_sock(sock_data, new_id);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Moves a socket that is about to connect to the daemon its destination
+ * hashes to, when that policy is on, so that repeat connections to the
+ * same peer find that daemon's session cache warm. The remote hostname
+ * is used if the application gave one, otherwise the remote address
+ * @param	sock_data - TLS socket data of the connecting socket
+ * @param	uaddr - The address being connected to
+ * @return	0 if the socket can go ahead, otherwise an error
+ */
+int route_by_destination(tls_sock_data_t* sock_data, struct sockaddr* uaddr) {
+	struct sockaddr_in* sin;
+	char key[sizeof(sin->sin_addr) + sizeof(sin->sin_port)];
+	int new_id;
+
+	if (sock_data->pinned == 1) {
+		return 0;
+	}
+	if (sock_data->hostname != NULL) {
+		new_id = pick_daemon_for_peer(sock_data->net, sock_data->hostname, strnlen(sock_data->hostname, MAX_HOST_LEN));
+	}
+	else if (uaddr->sa_family == AF_HOSTNAME) {
+		new_id = pick_daemon_for_peer(sock_data->net, ((struct sockaddr_host*)uaddr)->sin_addr.name,
+				strnlen(((struct sockaddr_host*)uaddr)->sin_addr.name, sizeof(struct host_addr)));
+	}
+	else if (uaddr->sa_family == AF_INET) {
+		sin = (struct sockaddr_in*)uaddr;
+		memcpy(key, &sin->sin_addr, sizeof(sin->sin_addr));
+		memcpy(key + sizeof(sin->sin_addr), &sin->sin_port, sizeof(sin->sin_port));
+		new_id = pick_daemon_for_peer(sock_data->net, key, sizeof(key));
+	}
+	else {
+		return 0;
+	}
+	if (new_id < 0 || new_id == sock_data->daemon_id) {
+		return 0;
+	}
+	daemon_socket_added(sock_data->net, new_id);
+	return move_tls_sock(sock_data, new_id);
+}
+
+/**
+ * Spreads the members of a reuseport group across daemons, so that the
+ * daemons' own reuseport listeners share incoming connections and their
+ * handshakes between them. Called as a socket binds
+ * @param	sock_data - TLS socket data of the binding socket
+ * @param	sock - The binding socket
+ * @param	uaddr - The external address being bound to
+ * @return	0 if the socket can go ahead, otherwise an error
+ */
+int place_in_reuseport_group(tls_sock_data_t* sock_data, struct socket* sock, struct sockaddr* uaddr) {
+	int new_id = sock_data->daemon_id;
+	if (sock_data->pinned == 1 || sock->sk->sk_reuseport == 0) {
+		return 0;
+	}
+	sock_data->reuseport_group = join_reuseport_group(sock_data->net, uaddr, &new_id);
+	if (new_id == sock_data->daemon_id) {
+		return 0;
+	}
+	daemon_socket_added(sock_data->net, new_id);
+	return move_tls_sock(sock_data, new_id);
+}
+
+/**
+ * Marks a socket as tied to its daemon, which is about to hold state for
+ * it, and passes on any options that were held back until now
+ * @param	sock_data - TLS socket data of the socket
+ * @param	sock - The socket
+ */
+void pin_to_daemon(tls_sock_data_t* sock_data, struct socket* sock) {
+	int val;
+	if (sock_data->deferred_opts & DEFER_REUSEADDR) {
+		val = sock->sk->sk_reuse != SK_NO_REUSE;
+		send_setsockopt_notification(sock_data->net, sock_data->key, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val), 0, 0, sock_data->daemon_id);
+	}
+	if (sock_data->deferred_opts & DEFER_REUSEPORT) {
+		val = sock->sk->sk_reuseport;
+		send_setsockopt_notification(sock_data->net, sock_data->key, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val), 0, 0, sock_data->daemon_id);
+	}
+	sock_data->deferred_opts = 0;
+	sock_data->pinned = 1;
+	return;
+}
+
+/**
+ * Reassigns a socket to another daemon. The new daemon is told about the
+ * socket as if it had just been created and is given every option the
+ * old one accepted, in one batch
+ * @param	sock_data - TLS socket data of a socket that isn't pinned
+ * @param	new_id - The daemon to move to, already counting the socket
+ * @return	0 on success, otherwise an error
+ */
+int move_tls_sock(tls_sock_data_t* sock_data, int new_id) {
+	struct tls_opt_batch* hdr;
+	char comm[NAME_MAX];
+	char* comm_ptr;
+	char* batch;
+	unsigned int batch_len;
+	int old_id = sock_data->daemon_id;
+
+	send_close_notification(sock_data->net, sock_data->key, old_id);
+	daemon_socket_removed(sock_data->net, old_id);
+	/* Nothing the old daemon still owes us is wanted now, and
+	 * report_return turns away whatever it sends anyway */
+	sock_data->unacked_seq = 0;
+	sock_data->daemon_id = new_id;
+	comm_ptr = get_full_comm(comm, NAME_MAX);
+	send_socket_notification(sock_data->net, sock_data->key, comm_ptr, 0, new_id);
+	wait_for_daemon(sock_data, RESPONSE_TIMEOUT);
+	if (sock_data->optlog_count == 0) {
+		return 0;
+	}
+
+	batch_len = sizeof(struct tls_opt_batch) + sock_data->optlog_len;
+	batch = kmalloc(batch_len, GFP_KERNEL);
+	if (batch == NULL) {
+		return -ENOMEM;
+	}
+	hdr = (struct tls_opt_batch*)batch;
+	hdr->count = sock_data->optlog_count;
+	hdr->error_index = -1;
+	memcpy(batch + sizeof(struct tls_opt_batch), sock_data->optlog, sock_data->optlog_len);
+	send_setsockopt_notification(sock_data->net, sock_data->key, IPPROTO_TLS, TLS_OPTIONS_BATCH, batch, batch_len, 1, 0, new_id);
+	kfree(batch);
+	if (wait_for_daemon(sock_data, RESPONSE_TIMEOUT) == 0) {
+		/* Let's lie to the application if the daemon isn't responding */
+		return -ENOBUFS;
+	}
+	return sock_data->response;
+}
+
+void report_return(struct net* net, int portid, unsigned long key, int ret, int index, u32 seq) {
 	tls_sock_data_t* sock_data;
 	sock_data = get_tls_sock_data(key);
 	//BUG_ON(sock_data == NULL);
-	if (sock_data == NULL) {
+	/* Only the socket's own daemon answers for it. One it has moved
+	 * away from may still be answering what it was sent before */
+	if (sock_data == NULL || !net_eq(sock_data->net, net) || portid != sock_data->daemon_id) {
+		return;
+	}
+	/* Nobody waits for the socket notification's ack */
+	if (seq != 0 && seq == sock_data->unacked_seq) {
+		sock_data->unacked_seq = 0;
+		return;
+	}
+	if (seq != 0 && seq == sock_data->connect_seq) {
+		/* A nonblocking connect is acked before its handshake is
+		 * done. The ack only matters if the connect is refused */
+		if (sock_data->connect_ack_pending == 1) {
+			sock_data->connect_ack_pending = 0;
+			if (ret == 0) {
+				return;
+			}
+		}
+		report_handshake_finished(net, portid, key, ret, NULL, 0, -1, NULL, seq);
+		return;
+	}
+	if (seq != 0) {
+		/* A nonblocking setsockopt, kept for when it's repeated.
+		 * Otherwise it answers a notification we've given up on */
+		spin_lock(&sock_data->rdata_lock);
+		if (sock_data->pending_opt != NULL && sock_data->pending_opt->seq == seq) {
+			sock_data->pending_opt->response = ret;
+			sock_data->pending_opt->response_index = index;
+			sock_data->pending_opt->answered = 1;
+			WRITE_ONCE(sock_data->opt_waiting, 0);
+			spin_unlock(&sock_data->rdata_lock);
+			wake_opt_waiters(sock_data);
+			return;
+		}
+		spin_unlock(&sock_data->rdata_lock);
 		return;
 	}
 	sock_data->response = ret;
+	sock_data->response_index = index;
 	complete(&sock_data->sock_event);
 	return;
 }
 
-void report_data_return(unsigned long key, char* data, unsigned int len) {
+void report_data_return(struct net* net, unsigned long key, char* data, unsigned int len, unsigned int total, u32 seq) {
 	tls_sock_data_t* sock_data;
+	char* buf = NULL;
 	sock_data = get_tls_sock_data(key);
 	//BUG_ON(sock_data == NULL);
-	if (sock_data == NULL) {
+	if (sock_data == NULL || !net_eq(sock_data->net, net)) {
 		return;
 	}
-	sock_data->rdata = kmalloc(len, GFP_KERNEL);
-	if (sock_data->rdata == NULL) {
-		printk(KERN_ALERT "Failed to create memory for getsockopt return\n");
+	/* Chunks of a getsockopt that was given up on, or of one
+	 * before it, must not end up in the current one */
+	if (seq == 0 || seq != READ_ONCE(sock_data->rdata_seq)) {
+		return;
+	}
+	/* Large values arrive in several messages, the first of
+	 * which tells us how big the whole thing is. kvmalloc lets
+	 * big ones come from vmalloc instead of contiguous pages.
+	 * The size is the daemon's word, so it's held to a limit */
+	if (READ_ONCE(sock_data->rdata_size) == 0) {
+		if (max(total, len) > RDATA_MAX_LEN) {
+			printk(KERN_ALERT "Daemon returned a %u byte getsockopt value\n", max(total, len));
+			spin_lock(&sock_data->rdata_lock);
+			if (seq == sock_data->rdata_seq && sock_data->rdata_size == 0) {
+				sock_data->rdata_seq = 0;
+				sock_data->rdata_len = 0;
+				sock_data->response = -EMSGSIZE;
+				spin_unlock(&sock_data->rdata_lock);
+				complete(&sock_data->sock_event);
+				return;
+			}
+			spin_unlock(&sock_data->rdata_lock);
+			return;
+		}
+		buf = kvmalloc(max(total, len), GFP_KERNEL);
+		if (buf == NULL) {
+			printk(KERN_ALERT "Failed to create memory for getsockopt return\n");
+		}
+	}
+	spin_lock(&sock_data->rdata_lock);
+	if (seq != sock_data->rdata_seq) {
+		spin_unlock(&sock_data->rdata_lock);
+		kvfree(buf);
+		return;
+	}
+	if (sock_data->rdata_size == 0) {
+		sock_data->rdata_size = max(total, len);
+		sock_data->rdata_len = 0;
+		sock_data->rdata = buf;
+		buf = NULL;
+	}
+	len = min(len, sock_data->rdata_size - sock_data->rdata_len);
+	if (sock_data->rdata != NULL) {
+		memcpy(sock_data->rdata + sock_data->rdata_len, data, len);
+	}
+	sock_data->rdata_len += len;
+	if (sock_data->rdata_len < sock_data->rdata_size) {
+		spin_unlock(&sock_data->rdata_lock);
+		return;
 	}
-	memcpy(sock_data->rdata, data, len);
-	sock_data->rdata_len = len;
+	sock_data->rdata_size = 0;
+	sock_data->rdata_seq = 0;
 	/* set success if this callback is used.
 	 * The report_return case is for errors
 	 * and simple statuses */
 	sock_data->response = 0;
+	if (sock_data->rdata == NULL) {
+		sock_data->rdata_len = 0;
+		sock_data->response = -ENOMEM;
+	}
+	spin_unlock(&sock_data->rdata_lock);
 	complete(&sock_data->sock_event);
 	return;
 }
 
-void report_handshake_finished(unsigned long key, int response) {
+int report_handshake_finished(struct net* net, int portid, unsigned long key, int response, char* facts, unsigned int facts_len,
+		int ktls_fd, struct ssa_ktls_info* ktls, u32 seq) {
 	tls_sock_data_t* sock_data;
+	int handshake;
+	int ret = 0;
 	sock_data = get_tls_sock_data(key);
 	//BUG_ON(sock_data == NULL);
-	if (sock_data == NULL) {
-		return;
+	/* Socket keys are kernel addresses, which a daemon in another
+	 * namespace could guess, so only the socket's own namespace
+	 * may answer for it */
+	if (sock_data == NULL || !net_eq(sock_data->net, net) || portid != sock_data->daemon_id) {
+		return -EBADF;
 	}
-	sock_data->response = response;
-	if (sock_data->async_connect == 1) {
-		if (sock_data->unix_sock == NULL) {
-			inet_trigger_connect((struct socket*)key, sock_data->daemon_id);
+	/* Only the reply to the connect, or to an accept waiting on a
+	 * handover, moves it on. Anything else tagged is stale */
+	handshake = seq != 0 && seq == sock_data->connect_seq;
+	if (seq != 0 && handshake == 0) {
+		return -EBADF;
+	}
+	if (handshake == 1) {
+		sock_data->connect_seq = 0;
+		sock_data->connect_ack_pending = 0;
+	}
+	/* Facts are cached before anyone is woken up so that
+	 * getsockopt never races with their arrival */
+	if (response == 0) {
+		if (facts != NULL) {
+			cache_handshake_facts(sock_data, facts, facts_len);
 		}
-		else {
-			unix_trigger_connect((struct socket*)key, sock_data->daemon_id);
+		if (ktls != NULL) {
+			/* On failure the application still gets the
+			 * connection through the daemon, if the daemon
+			 * can carry on */
+			ret = prepare_ktls(sock_data, ktls_fd, ktls);
 		}
-		sock_data->async_connect = 0;
+		forget_requested_opts(sock_data);
+		sock_data->handshake_done = 1;
 	}
-	else {
+	sock_data->response = response;
+	if (handshake == 0 || cmpxchg(&sock_data->connect_blocking, 1, 2) == 1) {
 		complete(&sock_data->sock_event);
+		return ret;
 	}
-	return;
+
+	/* Nonblocking connect or accept, or a blocking connect interrupted
+	 * by a signal. Nobody is waiting, so we finish it here and wake
+	 * whoever polls or restarts the connect */
+	finish_handshake(sock_data->net, sock_data->daemon_id, sock_data->admission);
+	sock_data->admission = NULL;
+	if (response == 0 && (sock_data->ktls_file != NULL || sock_data->warm_sock != NULL)) {
+		/* The application may be in a call on the socket right now,
+		 * so the swap waits for its next one */
+		if (sock_data->ktls_file != NULL) {
+			drop_warm_connection(sock_data);
+		}
+		WRITE_ONCE(sock_data->connect_state, CONNECT_READY);
+		((struct socket*)key)->sk->sk_state_change(((struct socket*)key)->sk);
+	}
+	else if (sock_data->accepted == 1) {
+		/* The daemon keeps the connection it accepted */
+		((struct socket*)key)->state = SS_CONNECTED;
+		WRITE_ONCE(sock_data->connect_state, CONNECT_DONE);
+		((struct socket*)key)->sk->sk_state_change(((struct socket*)key)->sk);
+	}
+	else if (sock_data->unix_sock == NULL) {
+		inet_trigger_connect((struct socket*)key);
+	}
+	else {
+		unix_trigger_connect((struct socket*)key, sock_data->daemon_id);
+	}
+	return ret;
 }
 
+/**
+ * Forgets the replies a daemon that has gone away still owed its
+ * sockets. Accepts that were waiting on it for a handover keep the
+ * connection it made, which is about to be reset
+ * @param	net - The daemon's network namespace
+ * @param	daemon_id - The daemon's ID
+ */
+void forget_daemon_acks(struct net* net, int daemon_id) {
+	tls_sock_data_t* it;
+	struct socket* sock;
+	int bkt;
+
+	spin_lock(&tls_sock_data_table_lock);
+	hash_for_each(tls_sock_data_table, bkt, it, hash) {
+		if (!net_eq(it->net, net) || it->daemon_id != daemon_id) {
+			continue;
+		}
+		it->unacked_seq = 0;
+		it->connect_ack_pending = 0;
+		spin_lock(&it->rdata_lock);
+		if (it->pending_opt != NULL && it->pending_opt->answered == 0) {
+			/* Let's lie to the application if the daemon isn't responding */
+			it->pending_opt->response = -ENOBUFS;
+			it->pending_opt->answered = 1;
+			WRITE_ONCE(it->opt_waiting, 0);
+			wake_opt_waiters(it);
+		}
+		spin_unlock(&it->rdata_lock);
+		if (it->accepted == 1 && it->connect_seq != 0) {
+			it->connect_seq = 0;
+			sock = (struct socket*)it->key;
+			sock->state = SS_CONNECTED;
+			WRITE_ONCE(it->connect_state, CONNECT_DONE);
+			sock->sk->sk_state_change(sock->sk);
+		}
+	}
+	spin_unlock(&tls_sock_data_table_lock);
+	return;
+}
 
 int tls_common_setsockopt(tls_sock_data_t* sock_data, struct socket *sock, int level, int optname, char __user *optval, unsigned int optlen, setsockopt_t orig_func) {
 	int ret;
+	int class;
 	int timeout_val = RESPONSE_TIMEOUT;
+	pending_opt_t* pending;
 	char* koptval;
 	if (optval == NULL) {
 		return -EINVAL;	
@@ -156,6 +718,50 @@ int tls_common_setsockopt(tls_sock_data_t* sock_data, struct socket *sock, int l
 	if (optlen == 0) {
 		return -EINVAL;
 	}
+
+	if (level == IPPROTO_TLS && optname == TLS_OPTVAL_OFFSET) {
+		return set_optval_offset(sock_data, optval, optlen);
+	}
+
+	class = classify_opt(level, optname, orig_func);
+	if (class == OPT_CLASS_SYNC || class == OPT_CLASS_DAEMON) {
+		/* A nonblocking setsockopt is finished by repeating it, and
+		 * holds back other options that wait on the daemon until then */
+		if (resume_pending_opt(sock_data, sock, level, optname, optval, optlen, &ret) == 1) {
+			return ret;
+		}
+	}
+
+	ret = migrate_if_draining(sock_data);
+	if (ret != 0) {
+		return ret;
+	}
+
+	switch (class) {
+	case OPT_CLASS_LOCAL:
+		return orig_func(sock, level, optname, optval, optlen);
+	case OPT_CLASS_MIRROR:
+		ret = orig_func(sock, level, optname, optval, optlen);
+		if (ret != 0) {
+			return ret;
+		}
+		return mirror_opt(sock_data, level, optname, optval, optlen);
+	case OPT_CLASS_DEFER:
+		ret = orig_func(sock, level, optname, optval, optlen);
+		if (ret != 0) {
+			return ret;
+		}
+		sock_data->deferred_opts |= optname == SO_REUSEPORT ? DEFER_REUSEPORT : DEFER_REUSEADDR;
+		return 0;
+	case OPT_CLASS_DAEMON:
+		/* Skip the local half but still wait for the daemon's verdict */
+		orig_func = NULL;
+		break;
+	case OPT_CLASS_SYNC:
+	default:
+		break;
+	}
+
 	koptval = kmalloc(optlen, GFP_KERNEL);
 	if (koptval == NULL) {
 		return -ENOMEM;
@@ -165,75 +771,628 @@ int tls_common_setsockopt(tls_sock_data_t* sock_data, struct socket *sock, int l
 		return -EFAULT;
 	}
 
+	if (level == IPPROTO_TLS && optname == TLS_OPTIONS_BATCH) {
+		return set_options_batch(sock_data, sock, koptval, optlen, optval);
+	}
+
+	/* We return early if preliminary checks during our
+	 * kernel-side saving of sockopts failed. No sense
+	 * in telling the daemon about it. */
+	if (level == IPPROTO_TLS) {
+		ret = prepare_tls_opt(sock_data, optname, &koptval, &optlen, &timeout_val);
+		if (ret != 0) {
+			kfree(koptval);
+			return ret;
+		}
+	}
+
+	pending = kzalloc(sizeof(pending_opt_t), GFP_KERNEL);
+	if (pending == NULL) {
+		kfree(koptval);
+		return -ENOMEM;
+	}
+	pending->level = level;
+	pending->optname = optname;
+	pending->sent = koptval;
+	pending->sent_len = optlen;
+	pending->orig_func = orig_func;
+	if (level == IPPROTO_TLS) {
+		pending->staged = kzalloc(sizeof(staged_opt_t), GFP_KERNEL);
+		if (pending->staged == NULL) {
+			free_pending_opt(pending);
+			return -ENOMEM;
+		}
+		pending->count = 1;
+		ret = stage_tls_opt(optname, koptval, optlen, pending->staged);
+		if (ret != 0) {
+			free_pending_opt(pending);
+			return ret;
+		}
+	}
+	else {
+		/* Only TLS options can be replayed to another daemon */
+		sock_data->pinned = 1;
+	}
+	return send_opt(sock_data, sock, pending, timeout_val, optval, optlen);
+}
+
+/**
+ * Sends a setsockopt to the daemon and finishes it with the reply. A
+ * nonblocking socket doesn't wait for the reply: the call fails with
+ * -EAGAIN, the socket stops polling writable until the reply is in, and
+ * repeating the call then finishes it
+ * @param	sock_data - TLS socket data of the socket being configured
+ * @param	sock - The socket the option is applied to locally
+ * @param	pending - The option and its staged state. Freed here, or
+ * 		once the call is repeated
+ * @param	timeout_val - How long to wait for the daemon
+ * @param	optval - The user's option value
+ * @param	optlen - Length of optval
+ * @return	0 on success, -EAGAIN if the reply is still to come,
+ * 		otherwise an error
+ */
+int send_opt(tls_sock_data_t* sock_data, struct socket* sock, pending_opt_t* pending, int timeout_val, char __user *optval, unsigned int optlen) {
+	int ret;
+	if (is_nonblocking(sock_data)) {
+		pending->user_val = memdup_user(optval, optlen);
+		if (IS_ERR(pending->user_val)) {
+			ret = PTR_ERR(pending->user_val);
+			pending->user_val = NULL;
+			free_pending_opt(pending);
+			return ret;
+		}
+		pending->user_len = optlen;
+		pending->seq = next_notify_seq();
+		pending->deadline = jiffies + timeout_val;
+		spin_lock(&sock_data->rdata_lock);
+		sock_data->pending_opt = pending;
+		WRITE_ONCE(sock_data->opt_waiting, 1);
+		spin_unlock(&sock_data->rdata_lock);
+		send_setsockopt_notification(sock_data->net, (unsigned long)sock_data->key, pending->level, pending->optname,
+				pending->sent, pending->sent_len, 1, pending->seq, sock_data->daemon_id);
+		return -EAGAIN;
+	}
+
+	sock_data->response_index = -1;
+	send_setsockopt_notification(sock_data->net, (unsigned long)sock_data->key, pending->level, pending->optname,
+			pending->sent, pending->sent_len, 1, 0, sock_data->daemon_id);
+	if (wait_for_daemon(sock_data, timeout_val) == 0) {
+		free_pending_opt(pending);
+		/* Let's lie to the application if the daemon isn't responding */
+		return -ENOBUFS;
+	}
+	pending->response = sock_data->response;
+	pending->response_index = sock_data->response_index;
+	return finish_opt(sock_data, sock, pending, optval, optlen);
+}
+
+/**
+ * Saves our side of a setsockopt the daemon has answered, or drops it
+ * if the daemon refused it
+ * @param	sock_data - TLS socket data of the socket being configured
+ * @param	sock - The socket the option is applied to locally
+ * @param	pending - The answered option. Freed by this function
+ * @param	optval - The user's option value, or NULL if the application
+ * 		has moved on to another call and only our side is saved
+ * @param	optlen - Length of optval
+ * @return	The daemon's answer, or the local setsockopt's
+ */
+int finish_opt(tls_sock_data_t* sock_data, struct socket* sock, pending_opt_t* pending, char __user *optval, unsigned int optlen) {
+	int __user *error_index = NULL;
+	int ret = pending->response;
+	int i;
+
+	if (pending->level == IPPROTO_TLS && pending->optname == TLS_OPTIONS_BATCH && optval != NULL) {
+		error_index = &((struct tls_opt_batch __user *)optval)->error_index;
+	}
+	if (ret != 0) {
+		if (error_index != NULL && put_user(pending->response_index, error_index)) {
+			ret = -EFAULT;
+		}
+		free_pending_opt(pending);
+		return ret;
+	}
+
+	/* We only get here if the daemonside setsockopt succeeded. For a
+	 * batch, the daemon applied everything, so save all of it */
+	for (i = 0; i < pending->count; i++) {
+		commit_tls_opt(sock_data, &pending->staged[i]);
+	}
+	if (error_index != NULL && put_user(-1, error_index)) {
+		ret = -EFAULT;
+	}
+	else if (pending->level != IPPROTO_TLS) {
+		/* Now we do the same thing to the application socket, if applicable */
+		if (pending->orig_func != NULL) {
+			ret = optval != NULL ? pending->orig_func(sock, pending->level, pending->optname, optval, optlen) : 0;
+		}
+		else if (classify_opt(pending->level, pending->optname, NULL) != OPT_CLASS_DAEMON) {
+			ret = -EOPNOTSUPP;
+		}
+	}
+	free_pending_opt(pending);
+	return ret;
+}
+
+/**
+ * Finishes a nonblocking setsockopt when the application repeats it.
+ * Other options have to wait for its reply first. Once it's in, or it
+ * has been waited on for too long, they go ahead
+ * @param	sock_data - TLS socket data of the socket being configured
+ * @param	sock - The socket the option is applied to locally
+ * @param	level - The level of this call's option
+ * @param	optname - This call's option
+ * @param	optval - This call's option value
+ * @param	optlen - Length of optval
+ * @param	ret - Set to the result of this call if it's been dealt with
+ * @return	1 if this call has been dealt with, otherwise 0
+ */
+int resume_pending_opt(tls_sock_data_t* sock_data, struct socket* sock, int level, int optname, char __user *optval, unsigned int optlen, int* ret) {
+	pending_opt_t* pending = sock_data->pending_opt;
+	char* val;
+	int same = 0;
+
+	if (pending == NULL) {
+		return 0;
+	}
+	if (level == pending->level && optname == pending->optname && optlen == pending->user_len) {
+		val = memdup_user(optval, optlen);
+		if (IS_ERR(val)) {
+			*ret = PTR_ERR(val);
+			return 1;
+		}
+		same = memcmp(val, pending->user_val, optlen) == 0;
+		kfree(val);
+	}
+	spin_lock(&sock_data->rdata_lock);
+	if (pending->answered == 0 && time_before(jiffies, pending->deadline)) {
+		spin_unlock(&sock_data->rdata_lock);
+		*ret = -EAGAIN;
+		return 1;
+	}
+	/* A late reply now finds nothing to fill in */
+	sock_data->pending_opt = NULL;
+	WRITE_ONCE(sock_data->opt_waiting, 0);
+	spin_unlock(&sock_data->rdata_lock);
+
+	if (pending->answered == 0) {
+		free_pending_opt(pending);
+		/* Let's lie to the application if the daemon isn't responding */
+		*ret = -ENOBUFS;
+		return same;
+	}
+	if (same == 0) {
+		finish_opt(sock_data, sock, pending, NULL, 0);
+		return 0;
+	}
+	*ret = finish_opt(sock_data, sock, pending, optval, optlen);
+	return 1;
+}
+
+/* Frees a setsockopt and whatever of it wasn't saved */
+void free_pending_opt(pending_opt_t* pending) {
+	unstage_batch(pending->staged, pending->count);
+	kfree(pending->sent);
+	kfree(pending->user_val);
+	kfree(pending);
+	return;
+}
+
+/* Whether the application's socket is nonblocking. In unix mode the
+ * socket options are applied to is the internal one, which never is */
+int is_nonblocking(tls_sock_data_t* sock_data) {
+	struct socket* sock = (struct socket*)sock_data->key;
+	return sock->file != NULL && (sock->file->f_flags & O_NONBLOCK) != 0;
+}
+
+/* Wakes whoever polls the socket for a setsockopt's reply. Pollers wait
+ * on the socket the application's data goes through */
+void wake_opt_waiters(tls_sock_data_t* sock_data) {
+	struct socket* sock = sock_data->unix_sock != NULL ? sock_data->unix_sock : (struct socket*)sock_data->key;
+	wake_up_interruptible_all(sk_sleep(sock->sk));
+	return;
+}
+
+/**
+ * Decides where a socket option needs to be applied
+ * @param	level - The level of the option
+ * @param	optname - The option being set
+ * @param	orig_func - The setsockopt of the local socket, if it has one
+ * @return	One of the OPT_CLASS_* values
+ */
+int classify_opt(int level, int optname, setsockopt_t orig_func) {
+	int i;
+	int class = OPT_CLASS_SYNC;
+	if (level == IPPROTO_TLS) {
+		return OPT_CLASS_SYNC;
+	}
+	for (i = 0; i < ARRAY_SIZE(opt_class_table); i++) {
+		if (opt_class_table[i].level == level && opt_class_table[i].optname == optname) {
+			class = opt_class_table[i].class;
+			break;
+		}
+	}
+	/* Without a local socket to apply them to, these need the
+	 * daemon to say whether they worked */
+	if (orig_func == NULL && (class == OPT_CLASS_LOCAL || class == OPT_CLASS_MIRROR || class == OPT_CLASS_DEFER)) {
+		return OPT_CLASS_SYNC;
+	}
+	return class;
+}
+
+/**
+ * Tells the daemon about an option already applied locally, without
+ * waiting for it to be applied to the external socket. A failure here
+ * can't be reported back, so it only costs the daemon-side setting
+ * @param	sock_data - TLS socket data of the socket being configured
+ * @param	level - The level of the option
+ * @param	optname - The option being set
+ * @param	optval - The user's option value
+ * @param	optlen - Length of optval
+ * @return	0, as the local socket already has the option
+ */
+int mirror_opt(tls_sock_data_t* sock_data, int level, int optname, char __user *optval, unsigned int optlen) {
+	char* koptval;
+	koptval = kmalloc(optlen, GFP_KERNEL);
+	if (koptval == NULL) {
+		return 0;
+	}
+	if (copy_from_user(koptval, optval, optlen) != 0) {
+		kfree(koptval);
+		return 0;
+	}
+	sock_data->pinned = 1;
+	send_setsockopt_notification(sock_data->net, (unsigned long)sock_data->key, level, optname, koptval, optlen, 0, 0, sock_data->daemon_id);
+	kfree(koptval);
+	return 0;
+}
+
+/**
+ * Performs kernel-side checks and conversions on an option value
+ * before it is sent to the daemon
+ * @param	sock_data - TLS socket data of the socket being configured
+ * @param	optname - The option being set
+ * @param	koptval - Kernel copy of the value. May be replaced
+ * @param	optlen - Length of *koptval. Updated if *koptval is replaced
+ * @param	timeout_val - How long to wait for the daemon. May be extended
+ * @return	0 if the option may be sent to the daemon, otherwise an error
+ */
+int prepare_tls_opt(tls_sock_data_t* sock_data, int optname, char** koptval, unsigned int* optlen, int* timeout_val) {
 	switch (optname) {
 	case TLS_REMOTE_HOSTNAME:
-		ret = set_remote_hostname(sock_data, koptval, optlen);
-		break;
-	case TLS_HOSTNAME:
-		ret = 0;
+		/* Saved by commit_tls_opt once the daemon accepts it,
+		 * so it has to be checked here */
+		if (*optlen > MAX_HOST_LEN) {
+			return -EINVAL;
+		}
+		if (!is_valid_host_string(*koptval, *optlen)) {
+			return -EINVAL;
+		}
 		break;
 	case TLS_TRUSTED_PEER_CERTIFICATES:
 	case TLS_CERTIFICATE_CHAIN:
 	case TLS_PRIVATE_KEY:
 		/* We convert relative paths to absolute ones
 		 * here. We also skip things prefixed with '-'
-		 * because that denotes direct PEM encoding */
-		if (koptval[0] != '-' && koptval[0] != '/') {
-			koptval = get_absolute_path(koptval, &optlen);
-			if (koptval == NULL) {
+		 * because that denotes direct PEM encoding.
+		 * File descriptor references are replaced by
+		 * the id the daemon opens the file by */
+		if ((*koptval)[0] == TLS_FD_REF_PREFIX) {
+			return resolve_fd_ref(sock_data, koptval, optlen);
+		}
+		if ((*koptval)[0] != '-' && (*koptval)[0] != '/') {
+			*koptval = get_absolute_path(*koptval, optlen);
+			if (*koptval == NULL) {
 				return -ENOMEM;
 			}
 		}
-		ret = 0;
 		break;
+	case TLS_REQUEST_PEER_AUTH:
+		*timeout_val = HZ*150;
+		break;
+	case TLS_HOSTNAME:
 	case TLS_ALPN:
 	case TLS_SESSION_TTL:
 	case TLS_DISABLE_CIPHER:
 	case TLS_PEER_IDENTITY:
-		ret = 0;
-		break;
-	case TLS_REQUEST_PEER_AUTH:
-		timeout_val = HZ*150;
-		ret = 0;
-		break;
 	case TLS_PEER_CERTIFICATE_CHAIN:
 	case TLS_ID:
 	default:
-		ret = 0;
 		break;
 	}
+	return 0;
+}
 
-	/* We return early if preliminary checks during our
-	 * kernel-side saving of sockopts failed. No sense
-	 * in telling the daemon about it. */
+/**
+ * Allocates what the socket keeps of a TLS option before the option is
+ * sent to the daemon
+ * @param	optname - The option being set
+ * @param	koptval - Kernel copy of the value, as it will be sent to the
+ * 		daemon. Must outlive the staged option
+ * @param	optlen - Length of koptval
+ * @param	staged - Filled in for commit_tls_opt or unstage_tls_opt
+ * @return	0 on success, otherwise an error
+ */
+int stage_tls_opt(int optname, char* koptval, unsigned int optlen, staged_opt_t* staged) {
+	staged->optname = optname;
+	staged->val = koptval;
+	staged->len = optlen;
+	staged->copy = NULL;
+	switch (optname) {
+	case TLS_REMOTE_HOSTNAME:
+		staged->copy = kmemdup(koptval, optlen, GFP_KERNEL);
+		if (staged->copy == NULL) {
+			return -ENOMEM;
+		}
+		break;
+	case TLS_HOSTNAME:
+	case TLS_ALPN:
+	case TLS_SESSION_TTL:
+		/* Keep a shadow so getsockopt needn't ask the daemon.
+		 * Failing to allocate one just means we ask instead */
+		staged->copy = kmemdup(koptval, optlen, GFP_KERNEL);
+		break;
+	default:
+		break;
+	}
+	return 0;
+}
+
+/**
+ * Saves kernel-side state for an option the daemon has accepted. This
+ * can't fail, so a batch is saved whole or not at all
+ * @param	sock_data - TLS socket data of the socket being configured
+ * @param	staged - As filled in by stage_tls_opt. Its copy passes to
+ * 		the socket
+ */
+void commit_tls_opt(tls_sock_data_t* sock_data, staged_opt_t* staged) {
+	log_tls_opt(sock_data, staged->optname, staged->val, staged->len);
+	switch (staged->optname) {
+	case TLS_REMOTE_HOSTNAME:
+		kfree(sock_data->hostname);
+		sock_data->hostname = staged->copy;
+		break;
+	case TLS_HOSTNAME:
+	case TLS_ALPN:
+	case TLS_SESSION_TTL:
+		if (staged->copy != NULL) {
+			cache_opt(sock_data, staged->optname, staged->copy, staged->len, 0);
+		}
+		break;
+	case TLS_KTLS:
+		sock_data->ktls_wanted = staged->len >= sizeof(int) && *(int*)staged->val == 1;
+		break;
+	default:
+		break;
+	}
+	staged->copy = NULL;
+	return;
+}
+
+/* Frees a staged option the daemon didn't accept */
+void unstage_tls_opt(staged_opt_t* staged) {
+	kfree(staged->copy);
+	staged->copy = NULL;
+	return;
+}
+
+/* Frees the first count staged options of a batch, and the array */
+void unstage_batch(staged_opt_t* staged, int count) {
+	int i;
+	if (staged == NULL) {
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		unstage_tls_opt(&staged[i]);
+	}
+	kfree(staged);
+	return;
+}
+
+/**
+ * Validates a TLS_OPTIONS_BATCH value and forwards all of its records
+ * to the daemon in a single setsockopt notification
+ * @param	sock_data - TLS socket data of the socket being configured
+ * @param	sock - The socket being configured
+ * @param	batch - Kernel copy of the batch. Freed by this function
+ * @param	len - Length of batch
+ * @param	optval - The user's batch, for reporting the failed record index
+ * @return	0 if every record was applied, otherwise the first error
+ */
+int set_options_batch(tls_sock_data_t* sock_data, struct socket* sock, char* batch, unsigned int len, char __user *optval) {
+	struct tls_opt_batch* hdr;
+	struct tls_opt_record* rec;
+	struct tls_opt_record* out_rec;
+	int __user *error_index;
+	unsigned int remaining;
+	unsigned int out_len;
+	unsigned int val_len;
+	int timeout_val = RESPONSE_TIMEOUT;
+	pending_opt_t* pending;
+	staged_opt_t* staged;
+	unsigned int count;
+	char* out;
+	char* tmp;
+	char* val;
+	int ret = 0;
+	int i;
+
+	error_index = &((struct tls_opt_batch __user *)optval)->error_index;
+	if (len < sizeof(struct tls_opt_batch)) {
+		kfree(batch);
+		return -EINVAL;
+	}
+	hdr = (struct tls_opt_batch*)batch;
+	if (hdr->count == 0 || hdr->count > MAX_BATCH_OPTS) {
+		kfree(batch);
+		return -EINVAL;
+	}
+	count = hdr->count;
+
+	/* Values can grow during preparation (e.g., relative paths
+	 * becoming absolute), so the batch sent to the daemon is
+	 * rebuilt record by record */
+	out_len = sizeof(struct tls_opt_batch);
+	out = kmalloc(out_len, GFP_KERNEL);
+	if (out == NULL) {
+		kfree(batch);
+		return -ENOMEM;
+	}
+	((struct tls_opt_batch*)out)->count = hdr->count;
+	((struct tls_opt_batch*)out)->error_index = -1;
+
+	rec = (struct tls_opt_record*)(batch + sizeof(struct tls_opt_batch));
+	remaining = len - sizeof(struct tls_opt_batch);
+	for (i = 0; i < hdr->count; i++) {
+		if (!opt_record_fits(rec, remaining) || rec->optlen == 0) {
+			ret = -EINVAL;
+			break;
+		}
+		if (!is_batchable_opt(rec->optname)) {
+			ret = -EINVAL;
+			break;
+		}
+		val_len = rec->optlen;
+		val = kmemdup(TLS_OPT_DATA(rec), val_len, GFP_KERNEL);
+		if (val == NULL) {
+			ret = -ENOMEM;
+			break;
+		}
+		ret = prepare_tls_opt(sock_data, rec->optname, &val, &val_len, &timeout_val);
+		if (ret != 0) {
+			kfree(val);
+			break;
+		}
+		tmp = krealloc(out, out_len + TLS_OPT_SPACE(val_len), GFP_KERNEL);
+		if (tmp == NULL) {
+			kfree(val);
+			ret = -ENOMEM;
+			break;
+		}
+		out = tmp;
+		out_rec = (struct tls_opt_record*)(out + out_len);
+		out_rec->optname = rec->optname;
+		out_rec->optlen = val_len;
+		memset(TLS_OPT_DATA(out_rec), 0, TLS_OPT_ALIGN(val_len));
+		memcpy(TLS_OPT_DATA(out_rec), val, val_len);
+		out_len += TLS_OPT_SPACE(val_len);
+		kfree(val);
+
+		/* The final record doesn't need its padding */
+		remaining -= min_t(unsigned int, remaining, TLS_OPT_SPACE(rec->optlen));
+		rec = TLS_OPT_NEXT(rec);
+	}
+	kfree(batch);
+
+	/* Our side of every record is allocated before the daemon sees
+	 * any of them. Once it applies the batch nothing can fail, so
+	 * neither side is ever left with only part of it */
+	staged = NULL;
+	if (ret == 0) {
+		staged = kcalloc(count, sizeof(staged_opt_t), GFP_KERNEL);
+		if (staged == NULL) {
+			ret = -ENOMEM;
+			i = 0;
+		}
+	}
+	if (ret == 0) {
+		rec = (struct tls_opt_record*)(out + sizeof(struct tls_opt_batch));
+		for (i = 0; i < count; i++) {
+			ret = stage_tls_opt(rec->optname, TLS_OPT_DATA(rec), rec->optlen, &staged[i]);
+			if (ret != 0) {
+				break;
+			}
+			rec = TLS_OPT_NEXT(rec);
+		}
+	}
 	if (ret != 0) {
-		kfree(koptval);
+		unstage_batch(staged, i);
+		kfree(out);
+		if (put_user(i, error_index)) {
+			return -EFAULT;
+		}
 		return ret;
 	}
 
-	send_setsockopt_notification((unsigned long)sock_data->key, level, optname, koptval, optlen, sock_data->daemon_id);
-	kfree(koptval);
-	if (wait_for_completion_timeout(&sock_data->sock_event, timeout_val) == 0) {
-		/* Let's lie to the application if the daemon isn't responding */
-		return -ENOBUFS;
+	pending = kzalloc(sizeof(pending_opt_t), GFP_KERNEL);
+	if (pending == NULL) {
+		unstage_batch(staged, count);
+		kfree(out);
+		return -ENOMEM;
+	}
+	pending->level = IPPROTO_TLS;
+	pending->optname = TLS_OPTIONS_BATCH;
+	pending->sent = out;
+	pending->sent_len = out_len;
+	pending->staged = staged;
+	pending->count = count;
+	return send_opt(sock_data, sock, pending, timeout_val, optval, len);
+}
+
+/**
+ * Records an option the daemon accepted, so that it can be replayed
+ * to another daemon if this one goes away before the socket is used.
+ * Sockets whose options can't all be recorded are pinned instead
+ * @param	sock_data - TLS socket data of the socket being configured
+ * @param	optname - The option that was set
+ * @param	val - The value, as sent to the daemon
+ * @param	len - Length of val
+ */
+void log_tls_opt(tls_sock_data_t* sock_data, int optname, char* val, unsigned int len) {
+	struct tls_opt_record* rec;
+	char* tmp;
+	if (sock_data->pinned == 1) {
+		return;
+	}
+	if (!is_batchable_opt(optname) || sock_data->optlog_count >= MAX_BATCH_OPTS) {
+		sock_data->pinned = 1;
+		return;
 	}
-	if (sock_data->response != 0) {
-		return sock_data->response;
+	tmp = krealloc(sock_data->optlog, sock_data->optlog_len + TLS_OPT_SPACE(len), GFP_KERNEL);
+	if (tmp == NULL) {
+		sock_data->pinned = 1;
+		return;
 	}
+	sock_data->optlog = tmp;
+	rec = (struct tls_opt_record*)(sock_data->optlog + sock_data->optlog_len);
+	rec->optname = optname;
+	rec->optlen = len;
+	memset(TLS_OPT_DATA(rec), 0, TLS_OPT_ALIGN(len));
+	memcpy(TLS_OPT_DATA(rec), val, len);
+	sock_data->optlog_len += TLS_OPT_SPACE(len);
+	sock_data->optlog_count++;
+	return;
+}
 
-	/* We only get here if the daemonside setsockopt succeeded */
-	if (level != IPPROTO_TLS) {
-		/* Now we do the same thing to the application socket, if applicable */
-		if (orig_func != NULL) {
-			return orig_func(sock, level, optname, optval, optlen);
-		}
-		return -EOPNOTSUPP;
+/*
+ * Tests whether an option may appear in a TLS_OPTIONS_BATCH record
+ * @param	optname - The option name of the record
+ * @return	1 if the option may be batched and 0 otherwise
+ */
+int is_batchable_opt(int optname) {
+	switch (optname) {
+	case TLS_REMOTE_HOSTNAME:
+	case TLS_HOSTNAME:
+	case TLS_TRUSTED_PEER_CERTIFICATES:
+	case TLS_CERTIFICATE_CHAIN:
+	case TLS_PRIVATE_KEY:
+	case TLS_ALPN:
+	case TLS_SESSION_TTL:
+	case TLS_DISABLE_CIPHER:
+	case TLS_PEER_IDENTITY:
+	case TLS_REQUEST_PEER_AUTH:
+		return 1;
+	default:
+		return 0;
 	}
-	return 0;
 }
 
 
 int tls_common_getsockopt(tls_sock_data_t* sock_data, struct socket *sock, int level, int optname, char __user *optval, int __user *optlen, getsockopt_t orig_func) {
+	tls_opt_cache_t* cache;
+	unsigned int offset;
+	u32 seq;
+	int ret;
 	int len;
 	if (get_user(len, optlen)) {
 		return -EFAULT;
@@ -259,32 +1418,38 @@ int tls_common_getsockopt(tls_sock_data_t* sock_data, struct socket *sock, int l
 	case TLS_PEER_IDENTITY:
 	case TLS_REQUEST_PEER_AUTH:
 	case TLS_PEER_CERTIFICATE_CHAIN:
-		send_getsockopt_notification((unsigned long)sock_data->key, level, optname, sock_data->daemon_id);
-		if (wait_for_completion_timeout(&sock_data->sock_event, RESPONSE_TIMEOUT) == 0) {
+		/* A TLS_OPTVAL_OFFSET cursor only applies to one read */
+		offset = sock_data->optval_offset;
+		sock_data->optval_offset = 0;
+		cache = get_cached_opt(sock_data, optname);
+		if (cache != NULL) {
+			return copy_opt_to_user(cache->val, cache->len, offset, optval, optlen, len);
+		}
+		seq = next_notify_seq();
+		expect_rdata(sock_data, seq);
+		send_getsockopt_notification(sock_data->net, (unsigned long)sock_data->key, level, optname, seq, sock_data->daemon_id);
+		if (wait_for_daemon(sock_data, RESPONSE_TIMEOUT) == 0) {
+			expect_rdata(sock_data, 0);
 			/* Let's lie to the application if the daemon isn't responding */
 			return -ENOBUFS;
 		}
 		if (sock_data->response != 0) {
+			/* An error can cut a chunked reply short */
+			expect_rdata(sock_data, 0);
 			return sock_data->response;
 		}
-		/* We set this to the minimum of actual data length and size
-		 * of user's buffer rather than aborting if the user one is 
-		 * smaller because POSIX says to silently truncate in this
-		 * case */
-		len = min_t(unsigned int, len, sock_data->rdata_len);
-		if (unlikely(put_user(len, optlen))) {
-			kfree(sock_data->rdata);
-			sock_data->rdata = NULL;
-			sock_data->rdata_len = 0;
-			return -EFAULT;
+		ret = copy_opt_to_user(sock_data->rdata, sock_data->rdata_len, offset, optval, optlen, len);
+		/* Daemons that don't push handshake facts still only
+		 * need to be asked about them once */
+		if (sock_data->handshake_done == 1 && is_handshake_fact(optname)) {
+			cache_opt(sock_data, optname, sock_data->rdata, sock_data->rdata_len, 1);
 		}
-		if (copy_to_user(optval, sock_data->rdata, len)) {
-			kfree(sock_data->rdata);
-			sock_data->rdata = NULL;
-			sock_data->rdata_len = 0;
-			return -EFAULT;
+		else {
+			kvfree(sock_data->rdata);
 		}
-		break;
+		sock_data->rdata = NULL;
+		sock_data->rdata_len = 0;
+		return ret;
 	case TLS_ID:
 		return get_id(sock_data, optval, optlen);
 	default:
@@ -294,24 +1459,215 @@ int tls_common_getsockopt(tls_sock_data_t* sock_data, struct socket *sock, int l
 	return 0;
 }
 
-int set_remote_hostname(tls_sock_data_t* sock_data, char* optval, unsigned int len) {
-	/*
-	if (sock_data->is_connected == 1) {
-		return -EISCONN;
+/**
+ * Copies an option value out to the user, silently truncating it
+ * if the user's buffer is smaller, as POSIX says to
+ * @param	val - The option value
+ * @param	val_len - Length of val
+ * @param	offset - Where in val to start copying from
+ * @param	optval - The user's buffer
+ * @param	optlen - The user's buffer length, updated to the copied length
+ * @param	len - The user's buffer length, as already read from optlen
+ * @return	0 on success, otherwise -EFAULT
+ */
+int copy_opt_to_user(char* val, unsigned int val_len, unsigned int offset, char __user *optval, int __user *optlen, int len) {
+	/* Reading at or past the end yields nothing, like read(2) */
+	offset = min(offset, val_len);
+	len = min_t(unsigned int, len, val_len - offset);
+	if (unlikely(put_user(len, optlen))) {
+		return -EFAULT;
+	}
+	if (copy_to_user(optval, val + offset, len)) {
+		return -EFAULT;
 	}
-	*/
-	if (len > MAX_HOST_LEN) {
+	return 0;
+}
+
+/**
+ * Sets where the next read of an option value starts, so that values
+ * too big for one buffer can be read in pieces. This never involves
+ * the daemon
+ * @param	sock_data - TLS socket data of the socket being configured
+ * @param	optval - The user's offset, an unsigned int
+ * @param	optlen - Length of optval
+ * @return	0 on success, otherwise an error
+ */
+int set_optval_offset(tls_sock_data_t* sock_data, char __user *optval, unsigned int optlen) {
+	unsigned int offset;
+	if (optlen < sizeof(offset)) {
 		return -EINVAL;
 	}
-	sock_data->hostname = krealloc(sock_data->hostname, len, GFP_KERNEL);
-	if (sock_data->hostname == NULL) {
-		return -ENOMEM;
+	if (get_user(offset, (unsigned int __user *)optval)) {
+		return -EFAULT;
 	}
-	if (!is_valid_host_string(optval, len)) {
-		return -EINVAL;
+	sock_data->optval_offset = offset;
+	return 0;
+}
+
+/**
+ * Throws away whatever has arrived of an earlier getsockopt reply and
+ * sets which request chunks are taken from next
+ * @param	sock_data - TLS socket data of the socket being queried
+ * @param	seq - SSA_NL_A_SEQ of the request about to be sent, or 0 to
+ * 		take none, as when giving up on one
+ */
+void expect_rdata(tls_sock_data_t* sock_data, u32 seq) {
+	char* old;
+	spin_lock(&sock_data->rdata_lock);
+	old = sock_data->rdata;
+	sock_data->rdata = NULL;
+	sock_data->rdata_len = 0;
+	sock_data->rdata_size = 0;
+	sock_data->rdata_seq = seq;
+	spin_unlock(&sock_data->rdata_lock);
+	kvfree(old);
+	/* The last chunk may have come in just as we stopped waiting.
+	 * Its completion mustn't answer the next request */
+	if (seq == 0) {
+		try_wait_for_completion(&sock_data->sock_event);
+	}
+	return;
+}
+
+/**
+ * Finds the shadow copy of an option value, if we have one
+ * @param	sock_data - TLS socket data of the socket being queried
+ * @param	optname - The option being queried
+ * @return	The cached value, or NULL if the daemon must be asked
+ */
+tls_opt_cache_t* get_cached_opt(tls_sock_data_t* sock_data, int optname) {
+	tls_opt_cache_t* cache;
+	if (optname < TLS_OPT_CACHE_BASE || optname >= TLS_OPT_CACHE_BASE + TLS_OPT_CACHE_SIZE) {
+		return NULL;
+	}
+	cache = &sock_data->opt_cache[optname - TLS_OPT_CACHE_BASE];
+	if (cache->val == NULL) {
+		return NULL;
 	}
-	memcpy(sock_data->hostname, optval, len);
-	return  0;
+	/* What the application asked for isn't necessarily what was
+	 * negotiated, so only the daemon can answer once it's done */
+	if (cache->immutable == 0 && sock_data->handshake_done == 1) {
+		return NULL;
+	}
+	return cache;
+}
+
+/**
+ * Stores a shadow copy of an option value. Values pushed by the daemon
+ * after the handshake are immutable and are never replaced by values
+ * the application sets afterwards
+ * @param	sock_data - TLS socket data of the socket the value belongs to
+ * @param	optname - The option the value belongs to
+ * @param	val - kmalloc'd or kvmalloc'd value. Ownership passes to the cache
+ * @param	len - Length of val
+ * @param	immutable - Whether the value is a post-handshake fact
+ */
+void cache_opt(tls_sock_data_t* sock_data, int optname, char* val, unsigned int len, int immutable) {
+	tls_opt_cache_t* cache;
+	if (optname < TLS_OPT_CACHE_BASE || optname >= TLS_OPT_CACHE_BASE + TLS_OPT_CACHE_SIZE) {
+		kvfree(val);
+		return;
+	}
+	cache = &sock_data->opt_cache[optname - TLS_OPT_CACHE_BASE];
+	if (cache->immutable == 1 && immutable == 0) {
+		kvfree(val);
+		return;
+	}
+	kvfree(cache->val);
+	cache->val = val;
+	cache->len = len;
+	cache->immutable = immutable;
+	return;
+}
+
+/**
+ * Caches the post-handshake facts the daemon sent along with its
+ * handshake return. These use the TLS_OPTIONS_BATCH record format
+ * @param	sock_data - TLS socket data of the socket that finished its handshake
+ * @param	facts - The packed records
+ * @param	len - Length of facts
+ */
+void cache_handshake_facts(tls_sock_data_t* sock_data, char* facts, unsigned int len) {
+	struct tls_opt_batch* hdr;
+	struct tls_opt_record* rec;
+	unsigned int remaining;
+	char* val;
+	int i;
+
+	if (len < sizeof(struct tls_opt_batch)) {
+		return;
+	}
+	hdr = (struct tls_opt_batch*)facts;
+	rec = (struct tls_opt_record*)(facts + sizeof(struct tls_opt_batch));
+	remaining = len - sizeof(struct tls_opt_batch);
+	for (i = 0; i < hdr->count; i++) {
+		if (!opt_record_fits(rec, remaining)) {
+			printk(KERN_ALERT "Malformed handshake facts from daemon\n");
+			return;
+		}
+		if (is_handshake_fact(rec->optname)) {
+			val = kmemdup(TLS_OPT_DATA(rec), rec->optlen, GFP_KERNEL);
+			if (val != NULL) {
+				cache_opt(sock_data, rec->optname, val, rec->optlen, 1);
+			}
+		}
+		remaining -= min_t(unsigned int, remaining, TLS_OPT_SPACE(rec->optlen));
+		rec = TLS_OPT_NEXT(rec);
+	}
+	return;
+}
+
+/**
+ * Drops the cached values the application set, which stop being the
+ * socket's values once the handshake has negotiated its own. Called as
+ * the handshake finishes, after any facts the daemon pushed are cached
+ * @param	sock_data - TLS socket data of the socket that finished its handshake
+ */
+void forget_requested_opts(tls_sock_data_t* sock_data) {
+	tls_opt_cache_t* cache;
+	int i;
+	for (i = 0; i < TLS_OPT_CACHE_SIZE; i++) {
+		cache = &sock_data->opt_cache[i];
+		if (cache->immutable == 1) {
+			continue;
+		}
+		kvfree(cache->val);
+		cache->val = NULL;
+		cache->len = 0;
+	}
+	return;
+}
+
+/*
+ * Tests whether an option's value is fixed once the handshake completes
+ * @param	optname - The option to check
+ * @return	1 if the value never changes after the handshake and 0 otherwise
+ */
+int is_handshake_fact(int optname) {
+	switch (optname) {
+	case TLS_ALPN:
+	case TLS_PEER_IDENTITY:
+	case TLS_PEER_CERTIFICATE_CHAIN:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Tests whether an option record lies entirely within a buffer
+ * @param	rec - The record to check
+ * @param	remaining - Bytes left in the buffer, starting at rec
+ * @return	1 if the record header and value fit and 0 otherwise
+ */
+int opt_record_fits(struct tls_opt_record* rec, unsigned int remaining) {
+	if (remaining < TLS_OPT_HDRLEN) {
+		return 0;
+	}
+	if (rec->optlen > remaining - TLS_OPT_HDRLEN) {
+		return 0;
+	}
+	return 1;
 }
 
 int get_remote_hostname(tls_sock_data_t* sock_data, char __user *optval, int* __user len) {
@@ -425,3 +1781,64 @@ char* get_absolute_path(char* rpath, int* rpath_len) {
 	*rpath_len = strlen(apath)+1;
 	return apath;
 }
+
+/**
+ * Replaces a TLS_FD_REF_PREFIX option value naming one of the calling
+ * process's descriptors with one naming the file by the id the daemon
+ * knows it by. The socket holds the file from here on, so nothing the
+ * application does with the descriptor afterwards changes what the
+ * daemon gets, or what is replayed if the socket moves to another daemon
+ * @param	sock_data - TLS socket data of the socket being configured
+ * @param	koptval - Kernel copy of the value. Replaced with the new one
+ * @param	optlen - Length of *koptval. Updated to the new value's length
+ * @return	0 on success, otherwise an error
+ */
+int resolve_fd_ref(tls_sock_data_t* sock_data, char** koptval, unsigned int* optlen) {
+	char ref[12];
+	char* val;
+	unsigned int ref_len;
+	u32 id;
+	int fd;
+	int ret;
+	int i;
+
+	/* Everything after the prefix, less any terminating null */
+	ref_len = strnlen(*koptval + 1, *optlen - 1);
+	if (ref_len == 0 || ref_len >= sizeof(ref)) {
+		return -EINVAL;
+	}
+	memcpy(ref, *koptval + 1, ref_len);
+	ref[ref_len] = '\0';
+	if (kstrtoint(ref, 10, &fd) != 0 || fd < 0) {
+		return -EINVAL;
+	}
+	val = kmalloc(sizeof(ref) + 1, GFP_KERNEL);
+	if (val == NULL) {
+		return -ENOMEM;
+	}
+	ret = hold_ref_file(sock_data->net, fd, &id);
+	if (ret != 0) {
+		kfree(val);
+		return ret;
+	}
+
+	/* One hold per file is enough for the socket */
+	for (i = 0; i < sock_data->ref_file_count; i++) {
+		if (sock_data->ref_files[i] == id) {
+			release_ref_file(id);
+			break;
+		}
+	}
+	if (i == sock_data->ref_file_count) {
+		if (sock_data->ref_file_count == MAX_REF_FILES) {
+			release_ref_file(id);
+			kfree(val);
+			return -ETOOMANYREFS;
+		}
+		sock_data->ref_files[sock_data->ref_file_count++] = id;
+	}
+	kfree(*koptval);
+	*koptval = val;
+	*optlen = snprintf(val, sizeof(ref) + 1, "%c%u", TLS_FD_REF_PREFIX, id) + 1;
+	return 0;
+}
@@ -29,17 +29,44 @@
 
 #include <linux/hashtable.h>
 #include <linux/completion.h>
+#include <linux/spinlock.h>
 #include <linux/socket.h>
 #include <linux/net.h>
+#include "socktls.h"
 
 #define RESPONSE_TIMEOUT	HZ*10
 #define HANDSHAKE_TIMEOUT	HZ*180
 #define DAEMON_START_PORT	8443
-#define NUM_DAEMONS		1	
+#define MAX_REF_FILES		8 /* files a socket's options may name by descriptor */
+
+/* Option values answered kernel-side, indexed by optname */
+#define TLS_OPT_CACHE_BASE	TLS_REMOTE_HOSTNAME
+#define TLS_OPT_CACHE_SIZE	(TLS_ID - TLS_REMOTE_HOSTNAME + 1)
+
+/* Where a connect is. Nonblocking connects move on from
+ * CONNECT_HANDSHAKING in the daemon's handshake callback */
+#define CONNECT_IDLE		0 /* not started, or a blocking attempt failed */
+#define CONNECT_HANDSHAKING	1 /* waiting on the daemon's handshake */
+#define CONNECT_INTERNAL	2 /* connecting to the daemon, or interrupted doing so */
+#define CONNECT_DONE		3
+#define CONNECT_FAILED		4 /* the error is in sk_err */
+#define CONNECT_READY		5 /* a connection waits for the application's next call to swap it in or attach it */
+#define CONNECT_SWAPPING	6 /* one of the application's threads is swapping it in or attaching it */
+
+struct reuseport_group;
+struct admission_owner;
+struct pending_opt;
 
 typedef int (*setsockopt_t)(struct socket *sock, int level, int optname, char __user *optval, unsigned int optlen);
 typedef int (*getsockopt_t)(struct socket *sock, int level, int optname, char __user *optval, int __user *optlen);
 
+/* A shadow copy of an option value held by the daemon */
+typedef struct tls_opt_cache {
+	char* val;
+	unsigned int len;
+	int immutable; /* pushed by the daemon after the handshake */
+} tls_opt_cache_t;
+
 /* This struct holds additional data needed by our TLS sockets */
 /* This structure only works because sockaddr is going
  * to be bigger than our sockaddr_un addresses, which are
@@ -57,28 +84,70 @@ typedef struct tls_sock_data {
 	int rem_addrlen;
         char *hostname;
 	int is_bound;
-	int async_connect;
-	int interrupted; 
+	int connect_state;
+	int connect_blocking; /* 1 a thread waits in connect for the handshake, 2 its reply is in */
+	u32 unacked_seq; /* socket notification whose ack nobody waits for, 0 for none */
+	u32 connect_seq; /* connect or accept notification the handshake result answers */
+	int connect_ack_pending; /* a nonblocking connect's ack is still to come */
+	int accepted; /* from accept, so the handshake result is a handover or nothing */
+	struct admission_owner* admission; /* handshake slot of a connect in progress */
 	struct completion sock_event;
 	int response;
+	int response_index; /* first failed record of a TLS_OPTIONS_BATCH */
 	char* rdata; /* returned data from asynchronous callback */
 	unsigned int rdata_len; /* length of data returned from async callback */
+	unsigned int rdata_size; /* full length of a reply still arriving in chunks */
+	u32 rdata_seq; /* getsockopt the arriving chunks must belong to, 0 for none */
+	spinlock_t rdata_lock; /* keeps late replies and giving up on them apart */
+	struct pending_opt* pending_opt; /* nonblocking setsockopt sent to the daemon, until repeated */
+	int opt_waiting; /* pending_opt isn't answered yet, so the socket doesn't poll writable */
+	unsigned int optval_offset; /* where the next option value read starts */
+	struct net* net; /* namespace of the socket, and of its daemon */
 	int daemon_id; /* userspace daemon to which the socket is assigned */
+	__be32 daemon_addr; /* loopback address the daemon is reached on */
+	int handshake_done; /* post-handshake facts can no longer change */
+	int pinned; /* the daemon holds state that can't be moved to another */
+	struct file* ktls_file; /* daemon's kernel TLS connection, then the home of our original sock */
+	int ktls; /* data goes straight to the peer through kernel TLS */
+	const struct proto_ops* ktls_ops; /* kernel TLS's own ops for the data path */
+	int ktls_wanted; /* TLS_KTLS was set, so accepts wait for a handover */
+	struct socket* warm_sock; /* pooled connection to the daemon, the internal leg once connected */
+	unsigned int deferred_opts; /* set locally, not yet told to the daemon */
+	struct reuseport_group* reuseport_group;
+	char* optlog; /* TLS options the daemon accepted, as tls_opt_records */
+	unsigned int optlog_len;
+	unsigned int optlog_count;
+	tls_opt_cache_t opt_cache[TLS_OPT_CACHE_SIZE];
+	u32 ref_files[MAX_REF_FILES]; /* ids of the files held for TLS_FD_REF_PREFIX values */
+	int ref_file_count;
 } tls_sock_data_t;
 
 /* Hashing */
 tls_sock_data_t* get_tls_sock_data(unsigned long key);
 void put_tls_sock_data(unsigned long key, struct hlist_node* hash);
 void rem_tls_sock_data(struct hlist_node* hash);
+void free_tls_sock_data(tls_sock_data_t* sock_data);
 
 /* Allocation */
 void tls_setup(void);
 void tls_cleanup(void);
 
+/* Waiting on the daemon */
+unsigned long wait_for_daemon(tls_sock_data_t* sock_data, unsigned long timeout);
+long wait_for_daemon_interruptible(tls_sock_data_t* sock_data, unsigned long timeout);
+int migrate_if_draining(tls_sock_data_t* sock_data);
+int route_by_selector(tls_sock_data_t* sock_data, int hook, struct sockaddr* uaddr);
+int route_by_destination(tls_sock_data_t* sock_data, struct sockaddr* uaddr);
+int place_in_reuseport_group(tls_sock_data_t* sock_data, struct socket* sock, struct sockaddr* uaddr);
+void pin_to_daemon(tls_sock_data_t* sock_data, struct socket* sock);
+
 /* Data reporting */
-void report_return(unsigned long key, int ret);
-void report_data_return(unsigned long key, char* data, unsigned int len);
-void report_handshake_finished(unsigned long key, int response);
+void report_return(struct net* net, int portid, unsigned long key, int ret, int index, u32 seq);
+void report_data_return(struct net* net, unsigned long key, char* data, unsigned int len, unsigned int total, u32 seq);
+struct ssa_ktls_info;
+int report_handshake_finished(struct net* net, int portid, unsigned long key, int response, char* facts, unsigned int facts_len,
+		int ktls_fd, struct ssa_ktls_info* ktls, u32 seq);
+void forget_daemon_acks(struct net* net, int daemon_id);
 
 /* Socket functionality */
 int tls_common_setsockopt(tls_sock_data_t* sock_data, struct socket *sock, int level, int optname, char __user *optval, unsigned int optlen, setsockopt_t orig_func);
@@ -0,0 +1,687 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/topology.h>
+#include <linux/atomic.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/jhash.h>
+#include <linux/hashtable.h>
+#include <linux/in.h>
+#include <net/net_namespace.h>
+#include <net/netns/generic.h>
+#include <linux/seq_file_net.h>
+#include "tls_daemon.h"
+#include "tls_common.h"
+#include "tls_select.h"
+
+/* Daemon n listens on DAEMON_START_PORT + n, on the loopback of its
+ * network namespace, and is expected to pin itself to daemon_cpus[n],
+ * or to CPU n if that isn't given. The first num_daemons of the initial
+ * namespace are assumed present at load. Others, including all those
+ * in other namespaces, join by registering over netlink */
+static int num_daemons = 1;
+module_param(num_daemons, int, 0444);
+MODULE_PARM_DESC(num_daemons, "Number of TLS daemons to assign sockets to at load");
+
+static int daemon_cpus[MAX_DAEMONS];
+static int num_daemon_cpus = 0;
+module_param_array(daemon_cpus, int, &num_daemon_cpus, 0444);
+MODULE_PARM_DESC(daemon_cpus, "CPU each daemon is pinned to");
+
+static int daemon_policy = DAEMON_POLICY_LOCAL;
+module_param(daemon_policy, int, 0644);
+MODULE_PARM_DESC(daemon_policy, "0 = CPU-local round robin, 1 = least loaded, 2 = fastest, 3 = hash of destination");
+
+/* Updated without locks, so these are approximate, which is all
+ * the balancer needs */
+typedef struct daemon_load {
+	atomic_t outstanding; /* requests awaiting a reply */
+	atomic_t sockets; /* sockets assigned to the daemon */
+	u64 latency_ewma; /* nanoseconds, weighted 1/8 toward new samples */
+} daemon_load_t;
+
+typedef struct daemon_list {
+	int count;
+	int ids[MAX_DAEMONS];
+} daemon_list_t;
+
+/* Which daemons new sockets may go to. Rebuilt and swapped under RCU
+ * whenever a daemon comes or goes, so assigning never takes a lock */
+typedef struct daemon_map {
+	struct rcu_head rcu;
+	daemon_list_t active;
+	daemon_list_t local[]; /* the active daemons local to each CPU */
+} daemon_map_t;
+
+/* Each network namespace has its own pool of daemons, reached over
+ * its own netlink and loopback, and sockets only use their own
+ * namespace's pool */
+typedef struct daemon_pool {
+	daemon_load_t loads[MAX_DAEMONS];
+	int states[MAX_DAEMONS]; /* written under lock */
+	int registered[MAX_DAEMONS]; /* joined over netlink, written under lock */
+	int cpu_overrides[MAX_DAEMONS];
+	daemon_map_t __rcu *map;
+	struct mutex lock;
+} daemon_pool_t;
+
+/* Sockets listening on the same external address with SO_REUSEPORT,
+ * counted per daemon so that members can be spread across them */
+struct reuseport_group {
+	struct hlist_node hash;
+	struct net* net;
+	struct sockaddr_in addr;
+	int total;
+	int members[MAX_DAEMONS];
+};
+
+static DEFINE_HASHTABLE(reuseport_groups, 6);
+static DEFINE_MUTEX(reuseport_groups_lock);
+
+static unsigned int daemon_pool_net_id;
+static DEFINE_PER_CPU(unsigned int, daemon_rr);
+
+static int daemon_pool_net_init(struct net* net);
+static void daemon_pool_net_exit(struct net* net);
+static daemon_pool_t* get_daemon_pool(struct net* net);
+static int daemon_cpu(daemon_pool_t* pool, int n);
+static int rebuild_daemon_map(daemon_pool_t* pool);
+static u64 daemon_cost(daemon_pool_t* pool, int n);
+static int pick_cheapest_daemon(daemon_pool_t* pool, daemon_map_t* map, daemon_list_t* local, unsigned int next);
+static int daemon_index(int daemon_id);
+static int daemon_proc_show(struct seq_file* m, void* v);
+static int daemon_proc_open(struct inode* inode, struct file* file);
+
+static struct pernet_operations daemon_pool_net_ops = {
+	.init = daemon_pool_net_init,
+	.exit = daemon_pool_net_exit,
+	.id = &daemon_pool_net_id,
+	.size = sizeof(daemon_pool_t),
+};
+
+static const struct file_operations daemon_proc_fops = {
+	.owner = THIS_MODULE,
+	.open = daemon_proc_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release_net,
+};
+
+/**
+ * Sets up a daemon pool, with its /proc/net/ssa_daemons view, in every
+ * network namespace, present and future
+ * @return	0 on success, otherwise an error
+ */
+int tls_daemon_setup(void) {
+	int ret;
+	int n;
+
+	if (num_daemons < 1 || num_daemons > MAX_DAEMONS) {
+		printk(KERN_ALERT "num_daemons must be between 1 and %d\n", MAX_DAEMONS);
+		return -EINVAL;
+	}
+	for (n = 0; n < num_daemon_cpus; n++) {
+		if (daemon_cpus[n] < 0 || daemon_cpus[n] >= nr_cpu_ids) {
+			printk(KERN_ALERT "Daemon %d pinned to nonexistent CPU %d\n", n, daemon_cpus[n]);
+			return -EINVAL;
+		}
+	}
+
+	ret = register_pernet_subsys(&daemon_pool_net_ops);
+	if (ret != 0) {
+		return ret;
+	}
+	printk(KERN_INFO "Assigning sockets to %d TLS daemon(s)\n", num_daemons);
+	return 0;
+}
+
+void tls_daemon_cleanup(void) {
+	unregister_pernet_subsys(&daemon_pool_net_ops);
+	return;
+}
+
+int daemon_pool_net_init(struct net* net) {
+	daemon_pool_t* pool = get_daemon_pool(net);
+	int ret;
+	int n;
+
+	mutex_init(&pool->lock);
+	mutex_lock(&pool->lock);
+	for (n = 0; n < MAX_DAEMONS; n++) {
+		pool->cpu_overrides[n] = -1;
+		pool->states[n] = net_eq(net, &init_net) && n < num_daemons ? DAEMON_ACTIVE : DAEMON_ABSENT;
+	}
+	ret = rebuild_daemon_map(pool);
+	mutex_unlock(&pool->lock);
+	if (ret != 0) {
+		return ret;
+	}
+
+	if (proc_create_data("ssa_daemons", 0444, net->proc_net, &daemon_proc_fops, NULL) == NULL) {
+		printk(KERN_ALERT "Failed to create /proc/net/ssa_daemons\n");
+	}
+	return 0;
+}
+
+void daemon_pool_net_exit(struct net* net) {
+	daemon_pool_t* pool = get_daemon_pool(net);
+	remove_proc_entry("ssa_daemons", net->proc_net);
+	kfree(rcu_dereference_protected(pool->map, 1));
+	return;
+}
+
+/**
+ * Adds a daemon to its namespace's pool, or returns a draining one
+ * to service
+ * @param	net - The daemon's network namespace
+ * @param	daemon_id - The daemon's ID (netlink port and listening port)
+ * @param	cpu - The CPU the daemon is pinned to, or -1 if unknown
+ * @return	0 on success, otherwise an error
+ */
+int register_daemon(struct net* net, int daemon_id, int cpu) {
+	daemon_pool_t* pool = get_daemon_pool(net);
+	int ret;
+	int n = daemon_index(daemon_id);
+	if (n < 0) {
+		return -EINVAL;
+	}
+	if (cpu >= nr_cpu_ids) {
+		return -EINVAL;
+	}
+	mutex_lock(&pool->lock);
+	pool->cpu_overrides[n] = cpu;
+	pool->states[n] = DAEMON_ACTIVE;
+	pool->registered[n] = 1;
+	ret = rebuild_daemon_map(pool);
+	mutex_unlock(&pool->lock);
+	printk(KERN_INFO "TLS daemon %d registered\n", daemon_id);
+	return ret;
+}
+
+/**
+ * Starts draining a daemon. It gets no new sockets, its connected
+ * sockets carry on, and sockets it hasn't started working for yet
+ * move elsewhere the next time they're used
+ * @param	net - The daemon's network namespace
+ * @param	daemon_id - The daemon's ID
+ * @return	0 on success, otherwise an error
+ */
+int unregister_daemon(struct net* net, int daemon_id) {
+	daemon_pool_t* pool = get_daemon_pool(net);
+	int ret;
+	int n = daemon_index(daemon_id);
+	if (n < 0) {
+		return -EINVAL;
+	}
+	mutex_lock(&pool->lock);
+	pool->registered[n] = 0;
+	if (pool->states[n] != DAEMON_ACTIVE) {
+		mutex_unlock(&pool->lock);
+		return 0;
+	}
+	pool->states[n] = DAEMON_DRAINING;
+	ret = rebuild_daemon_map(pool);
+	mutex_unlock(&pool->lock);
+	printk(KERN_INFO "TLS daemon %d draining\n", daemon_id);
+	return ret;
+}
+
+/**
+ * Drains a daemon whose netlink socket has closed without it
+ * unregistering. Only a port that registered in this namespace's pool
+ * counts, so other netlink users, and daemons of other namespaces
+ * with the same port, are left alone
+ * @param	net - Network namespace of the closed socket
+ * @param	daemon_id - Port of the closed socket
+ * @return	1 if a registered daemon was drained and 0 otherwise
+ */
+int release_daemon(struct net* net, int daemon_id) {
+	daemon_pool_t* pool = get_daemon_pool(net);
+	int n = daemon_index(daemon_id);
+	if (n < 0) {
+		return 0;
+	}
+	mutex_lock(&pool->lock);
+	if (pool->registered[n] == 0) {
+		mutex_unlock(&pool->lock);
+		return 0;
+	}
+	pool->registered[n] = 0;
+	if (pool->states[n] == DAEMON_ACTIVE) {
+		pool->states[n] = DAEMON_DRAINING;
+		rebuild_daemon_map(pool);
+		printk(KERN_INFO "TLS daemon %d draining\n", daemon_id);
+	}
+	mutex_unlock(&pool->lock);
+	return 1;
+}
+
+/**
+ * Tests whether new work may still be sent to a daemon
+ * @param	net - The daemon's network namespace
+ * @param	daemon_id - The daemon's ID
+ * @return	1 if the daemon is active and 0 otherwise
+ */
+int daemon_is_active(struct net* net, int daemon_id) {
+	int n = daemon_index(daemon_id);
+	if (n < 0) {
+		return 0;
+	}
+	return READ_ONCE(get_daemon_pool(net)->states[n]) == DAEMON_ACTIVE;
+}
+
+/**
+ * Counts the daemons new work may be sent to
+ * @param	net - The network namespace whose pool to count
+ * @return	The number of active daemons
+ */
+int active_daemon_count(struct net* net) {
+	int count;
+	rcu_read_lock();
+	count = rcu_dereference(get_daemon_pool(net)->map)->active.count;
+	rcu_read_unlock();
+	return count;
+}
+
+/**
+ * Picks a daemon for a new socket from those active on the current CPU,
+ * by the current policy, and counts the socket against it. Only RCU and
+ * this CPU's state are touched, so no lock is needed
+ * @param	net - The socket's network namespace
+ * @return	The ID (netlink port and listening port) of the daemon, or
+ * 		-EPROTONOSUPPORT if a namespace other than the initial one
+ * 		has no daemons
+ */
+int assign_daemon(struct net* net) {
+	daemon_pool_t* pool = get_daemon_pool(net);
+	daemon_map_t* map;
+	daemon_list_t* local;
+	unsigned int next;
+	int cpu;
+	int n;
+
+	n = select_daemon(net, TLS_SELECT_CREATE, NULL, NULL);
+	if (n >= 0) {
+		daemon_socket_added(net, n);
+		return n;
+	}
+
+	rcu_read_lock();
+	map = rcu_dereference(pool->map);
+	if (map->active.count == 0) {
+		rcu_read_unlock();
+		if (!net_eq(net, &init_net)) {
+			/* No daemon could reach the socket's loopback */
+			return -EPROTONOSUPPORT;
+		}
+		/* Nobody to choose from, so behave as we always did */
+		daemon_socket_added(net, DAEMON_START_PORT);
+		return DAEMON_START_PORT;
+	}
+	next = get_cpu_var(daemon_rr)++;
+	cpu = smp_processor_id();
+	put_cpu_var(daemon_rr);
+	local = &map->local[cpu];
+	switch (READ_ONCE(daemon_policy)) {
+	case DAEMON_POLICY_LEAST_LOADED:
+	case DAEMON_POLICY_FASTEST:
+		n = pick_cheapest_daemon(pool, map, local, next);
+		break;
+	case DAEMON_POLICY_PEER_HASH:
+		/* Where it ends up is decided when it connects */
+	case DAEMON_POLICY_LOCAL:
+	default:
+		n = local->ids[next % local->count];
+		break;
+	}
+	rcu_read_unlock();
+	daemon_socket_added(net, DAEMON_START_PORT + n);
+	return DAEMON_START_PORT + n;
+}
+
+/**
+ * Picks a daemon for a connection by rendezvous hashing of its
+ * destination over the active daemons. The same destination always
+ * gets the same daemon, and only destinations on a daemon that comes
+ * or goes are moved when the pool changes
+ * @param	net - The connecting socket's network namespace
+ * @param	key - Bytes identifying the destination
+ * @param	len - Length of key
+ * @return	The ID of the daemon, or -1 if the policy isn't
+ * 		DAEMON_POLICY_PEER_HASH or there are no active daemons
+ */
+int pick_daemon_for_peer(struct net* net, const void* key, unsigned int len) {
+	daemon_map_t* map;
+	u32 best_weight = 0;
+	u32 weight;
+	int best = -1;
+	int i;
+
+	if (READ_ONCE(daemon_policy) != DAEMON_POLICY_PEER_HASH) {
+		return -1;
+	}
+	rcu_read_lock();
+	map = rcu_dereference(get_daemon_pool(net)->map);
+	for (i = 0; i < map->active.count; i++) {
+		weight = jhash(key, len, map->active.ids[i]);
+		if (best == -1 || weight > best_weight) {
+			best = map->active.ids[i];
+			best_weight = weight;
+		}
+	}
+	rcu_read_unlock();
+	if (best == -1) {
+		return -1;
+	}
+	return DAEMON_START_PORT + best;
+}
+
+/**
+ * Adds a socket binding with SO_REUSEPORT to the group for its address
+ * and picks the daemon it should use: the active one with the fewest
+ * members of the group, preferring the daemon it already has
+ * @param	net - The binding socket's network namespace
+ * @param	addr - The external address being bound to
+ * @param	daemon_id - The socket's daemon. Updated to the one it should use
+ * @return	The group, or NULL if the address can't be grouped
+ */
+struct reuseport_group* join_reuseport_group(struct net* net, struct sockaddr* addr, int* daemon_id) {
+	struct reuseport_group* group;
+	struct sockaddr_in* sin = (struct sockaddr_in*)addr;
+	daemon_map_t* map;
+	u32 key;
+	int best;
+	int n;
+	int i;
+
+	if (addr->sa_family != AF_INET) {
+		return NULL;
+	}
+	key = jhash_2words(sin->sin_addr.s_addr, sin->sin_port, 0);
+	mutex_lock(&reuseport_groups_lock);
+	hash_for_each_possible(reuseport_groups, group, hash, key) {
+		if (net_eq(group->net, net) && group->addr.sin_addr.s_addr == sin->sin_addr.s_addr &&
+				group->addr.sin_port == sin->sin_port) {
+			break;
+		}
+	}
+	if (group == NULL) {
+		group = kzalloc(sizeof(struct reuseport_group), GFP_KERNEL);
+		if (group == NULL) {
+			mutex_unlock(&reuseport_groups_lock);
+			return NULL;
+		}
+		group->net = net;
+		group->addr = *sin;
+		hash_add(reuseport_groups, &group->hash, key);
+	}
+
+	best = daemon_is_active(net, *daemon_id) ? daemon_index(*daemon_id) : -1;
+	rcu_read_lock();
+	map = rcu_dereference(get_daemon_pool(net)->map);
+	for (i = 0; i < map->active.count; i++) {
+		n = map->active.ids[i];
+		if (best < 0 || group->members[n] < group->members[best]) {
+			best = n;
+		}
+	}
+	rcu_read_unlock();
+	if (best < 0) {
+		best = daemon_index(*daemon_id);
+	}
+	if (best >= 0) {
+		group->members[best]++;
+		group->total++;
+		*daemon_id = DAEMON_START_PORT + best;
+	}
+	mutex_unlock(&reuseport_groups_lock);
+	return group;
+}
+
+/**
+ * Removes a socket from its reuseport group, freeing the group once
+ * it's empty
+ * @param	group - The group the socket joined
+ * @param	daemon_id - The daemon the socket was counted against
+ */
+void leave_reuseport_group(struct reuseport_group* group, int daemon_id) {
+	int n = daemon_index(daemon_id);
+	mutex_lock(&reuseport_groups_lock);
+	if (n >= 0 && group->members[n] > 0) {
+		group->members[n]--;
+		group->total--;
+	}
+	if (group->total == 0) {
+		hash_del(&group->hash);
+		kfree(group);
+	}
+	mutex_unlock(&reuseport_groups_lock);
+	return;
+}
+
+void daemon_socket_added(struct net* net, int daemon_id) {
+	int n = daemon_index(daemon_id);
+	if (n < 0) {
+		return;
+	}
+	atomic_inc(&get_daemon_pool(net)->loads[n].sockets);
+	return;
+}
+
+void daemon_socket_removed(struct net* net, int daemon_id) {
+	int n = daemon_index(daemon_id);
+	if (n < 0) {
+		return;
+	}
+	atomic_dec(&get_daemon_pool(net)->loads[n].sockets);
+	return;
+}
+
+/**
+ * Notes that a socket is waiting on a daemon
+ * @param	net - The daemon's network namespace
+ * @param	daemon_id - The daemon being waited on
+ */
+void daemon_request_started(struct net* net, int daemon_id) {
+	int n = daemon_index(daemon_id);
+	if (n < 0) {
+		return;
+	}
+	atomic_inc(&get_daemon_pool(net)->loads[n].outstanding);
+	return;
+}
+
+/**
+ * Notes that a daemon replied, or that we gave up waiting on it
+ * @param	net - The daemon's network namespace
+ * @param	daemon_id - The daemon that was waited on
+ * @param	latency_ns - How long the wait took
+ */
+void daemon_request_finished(struct net* net, int daemon_id, u64 latency_ns) {
+	daemon_load_t* load;
+	u64 ewma;
+	int n = daemon_index(daemon_id);
+	if (n < 0) {
+		return;
+	}
+	load = &get_daemon_pool(net)->loads[n];
+	atomic_dec(&load->outstanding);
+	ewma = READ_ONCE(load->latency_ewma);
+	if (ewma == 0) {
+		ewma = latency_ns;
+	}
+	else {
+		ewma = ewma - (ewma >> 3) + (latency_ns >> 3);
+	}
+	WRITE_ONCE(load->latency_ewma, ewma);
+	return;
+}
+
+/**
+ * Works out which active daemons are local to each CPU and publishes
+ * the result. A CPU uses the daemons pinned to it if there are any,
+ * otherwise those on its NUMA node, and otherwise all of them.
+ * Must be called with the pool's lock held
+ * @param	pool - The pool to rebuild the map of
+ * @return	0 on success, otherwise an error
+ */
+int rebuild_daemon_map(daemon_pool_t* pool) {
+	daemon_map_t* map;
+	daemon_map_t* old_map;
+	daemon_list_t* local;
+	int cpu;
+	int n;
+
+	map = kzalloc(sizeof(daemon_map_t) + nr_cpu_ids * sizeof(daemon_list_t), GFP_KERNEL);
+	if (map == NULL) {
+		return -ENOMEM;
+	}
+	for (n = 0; n < MAX_DAEMONS; n++) {
+		if (pool->states[n] == DAEMON_ACTIVE) {
+			map->active.ids[map->active.count++] = n;
+		}
+	}
+	for_each_possible_cpu(cpu) {
+		local = &map->local[cpu];
+		for (n = 0; n < map->active.count; n++) {
+			if (daemon_cpu(pool, map->active.ids[n]) == cpu) {
+				local->ids[local->count++] = map->active.ids[n];
+			}
+		}
+		if (local->count == 0) {
+			for (n = 0; n < map->active.count; n++) {
+				if (cpu_to_node(daemon_cpu(pool, map->active.ids[n])) == cpu_to_node(cpu)) {
+					local->ids[local->count++] = map->active.ids[n];
+				}
+			}
+		}
+		if (local->count == 0) {
+			*local = map->active;
+		}
+	}
+
+	old_map = rcu_dereference_protected(pool->map, lockdep_is_held(&pool->lock));
+	rcu_assign_pointer(pool->map, map);
+	if (old_map != NULL) {
+		kfree_rcu(old_map, rcu);
+	}
+	return 0;
+}
+
+/**
+ * Estimates what a new request to a daemon would cost under the
+ * current policy
+ * @param	pool - The daemon's pool
+ * @param	n - Index of the daemon in the pool
+ * @return	The cost. Lower is better
+ */
+u64 daemon_cost(daemon_pool_t* pool, int n) {
+	u64 outstanding = atomic_read(&pool->loads[n].outstanding);
+	if (READ_ONCE(daemon_policy) == DAEMON_POLICY_FASTEST) {
+		/* A new request waits behind everything already queued */
+		return READ_ONCE(pool->loads[n].latency_ewma) * (outstanding + 1);
+	}
+	return outstanding;
+}
+
+/**
+ * Picks the active daemon with the lowest cost. The CPU's local daemons
+ * are looked at first so they win ties, and where the scan starts
+ * rotates so that idle daemons share new sockets evenly
+ * @param	pool - The pool to pick from
+ * @param	map - The pool's current daemon map
+ * @param	local - The current CPU's daemons
+ * @param	next - This CPU's round robin counter
+ * @return	Index of the chosen daemon in the pool
+ */
+int pick_cheapest_daemon(daemon_pool_t* pool, daemon_map_t* map, daemon_list_t* local, unsigned int next) {
+	int best;
+	u64 best_cost;
+	u64 cost;
+	int n;
+	int i;
+
+	best = local->ids[next % local->count];
+	best_cost = daemon_cost(pool, best);
+	for (i = 0; i < local->count; i++) {
+		n = local->ids[(next + i) % local->count];
+		cost = daemon_cost(pool, n);
+		if (cost < best_cost) {
+			best = n;
+			best_cost = cost;
+		}
+	}
+	for (i = 0; i < map->active.count; i++) {
+		n = map->active.ids[(next + i) % map->active.count];
+		cost = daemon_cost(pool, n);
+		if (cost < best_cost) {
+			best = n;
+			best_cost = cost;
+		}
+	}
+	return best;
+}
+
+/**
+ * Finds the CPU a daemon is pinned to
+ * @param	pool - The daemon's pool
+ * @param	n - Index of the daemon in the pool
+ * @return	The daemon's CPU
+ */
+int daemon_cpu(daemon_pool_t* pool, int n) {
+	if (pool->cpu_overrides[n] >= 0) {
+		return pool->cpu_overrides[n];
+	}
+	if (n < num_daemon_cpus) {
+		return daemon_cpus[n];
+	}
+	return n % nr_cpu_ids;
+}
+
+/**
+ * Converts a daemon ID to its index in the pool
+ * @param	daemon_id - The daemon's ID
+ * @return	The index, or -1 if the ID is out of range
+ */
+int daemon_index(int daemon_id) {
+	int n = daemon_id - DAEMON_START_PORT;
+	if (n < 0 || n >= MAX_DAEMONS) {
+		return -1;
+	}
+	return n;
+}
+
+daemon_pool_t* get_daemon_pool(struct net* net) {
+	return net_generic(net, daemon_pool_net_id);
+}
+
+int daemon_proc_show(struct seq_file* m, void* v) {
+	static const char* state_names[] = { "absent", "active", "draining" };
+	daemon_pool_t* pool = get_daemon_pool(seq_file_single_net(m));
+	daemon_load_t* load;
+	int state;
+	int n;
+	seq_printf(m, "id\tstate\tcpu\tsockets\toutstanding\tlatency_us\n");
+	for (n = 0; n < MAX_DAEMONS; n++) {
+		state = READ_ONCE(pool->states[n]);
+		load = &pool->loads[n];
+		if (state == DAEMON_ABSENT && atomic_read(&load->sockets) == 0) {
+			continue;
+		}
+		seq_printf(m, "%d\t%s\t%d\t%d\t%d\t%llu\n", DAEMON_START_PORT + n,
+			state_names[state], daemon_cpu(pool, n),
+			atomic_read(&load->sockets), atomic_read(&load->outstanding),
+			(unsigned long long)(READ_ONCE(load->latency_ewma) / NSEC_PER_USEC));
+	}
+	return 0;
+}
+
+int daemon_proc_open(struct inode* inode, struct file* file) {
+	return single_open_net(inode, file, daemon_proc_show);
+}
@@ -0,0 +1,47 @@
+#ifndef TLS_DAEMON_H
+#define TLS_DAEMON_H
+
+#include <linux/types.h>
+#include <linux/socket.h>
+
+struct net;
+
+#define MAX_DAEMONS	64
+
+/* Daemon states */
+#define DAEMON_ABSENT		0
+#define DAEMON_ACTIVE		1
+#define DAEMON_DRAINING		2 /* no new sockets */
+
+/* Daemon selection policies */
+#define DAEMON_POLICY_LOCAL		0 /* round robin among CPU-local daemons */
+#define DAEMON_POLICY_LEAST_LOADED	1 /* fewest outstanding requests */
+#define DAEMON_POLICY_FASTEST		2 /* lowest expected reply latency */
+#define DAEMON_POLICY_PEER_HASH		3 /* by destination, decided at connect */
+
+int tls_daemon_setup(void);
+void tls_daemon_cleanup(void);
+
+/* Pool membership. Each network namespace has its own pool */
+int register_daemon(struct net* net, int daemon_id, int cpu);
+int unregister_daemon(struct net* net, int daemon_id);
+int release_daemon(struct net* net, int daemon_id);
+int daemon_is_active(struct net* net, int daemon_id);
+int active_daemon_count(struct net* net);
+
+/* Socket assignment */
+int assign_daemon(struct net* net);
+int pick_daemon_for_peer(struct net* net, const void* key, unsigned int len);
+void daemon_socket_added(struct net* net, int daemon_id);
+void daemon_socket_removed(struct net* net, int daemon_id);
+
+/* Reuseport listener groups */
+struct reuseport_group;
+struct reuseport_group* join_reuseport_group(struct net* net, struct sockaddr* addr, int* daemon_id);
+void leave_reuseport_group(struct reuseport_group* group, int daemon_id);
+
+/* Load tracking */
+void daemon_request_started(struct net* net, int daemon_id);
+void daemon_request_finished(struct net* net, int daemon_id, u64 latency_ns);
+
+#endif /* TLS_DAEMON_H */
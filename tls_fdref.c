@@ -0,0 +1,163 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/hashtable.h>
+#include <linux/file.h>
+#include <linux/fs.h>
+#include <linux/err.h>
+#include <linux/cred.h>
+#include <net/net_namespace.h>
+#include "tls_fdref.h"
+
+/* Files named by TLS_FD_REF_PREFIX option values. The kernel holds the
+ * file the application passed and gives the daemon an id in place of
+ * the descriptor, which the daemon opens for itself with
+ * SSA_NL_C_FILE_FETCH. The file's contents never go through netlink.
+ * Sockets passing the same file share its entry and its id, so the
+ * daemon can keep what it parsed from a file for as long as the id
+ * is in use. A socket holds the files it named until it's freed, as
+ * its options may be replayed to another daemon until then */
+#define REF_FILE_HASH_BITS	6
+
+struct ref_file {
+	struct hlist_node by_inode;
+	struct hlist_node by_id;
+	struct net* net; /* not a reference, the sockets holding the file pin it */
+	struct file* file;
+	u32 id;
+	int refs;
+};
+
+static DEFINE_HASHTABLE(ref_files_by_inode, REF_FILE_HASH_BITS);
+static DEFINE_HASHTABLE(ref_files_by_id, REF_FILE_HASH_BITS);
+static DEFINE_SPINLOCK(ref_files_lock);
+static u32 last_ref_file_id;
+
+static struct ref_file* find_by_inode(struct net* net, struct inode* inode);
+static struct ref_file* find_by_id(u32 id);
+
+/**
+ * Takes a hold on the file behind one of the calling process's
+ * descriptors, for a socket to name in its options
+ * @param	net - Namespace of the socket, whose daemons may open the file
+ * @param	fd - The descriptor
+ * @param	id - Set to the id the daemon knows the file by
+ * @return	0 on success, otherwise an error
+ */
+int hold_ref_file(struct net* net, int fd, u32* id) {
+	struct ref_file* entry;
+	struct ref_file* held;
+	struct file* file;
+
+	/* Only regular files (including memfds) make sense here */
+	file = fget(fd);
+	if (file == NULL) {
+		return -EBADF;
+	}
+	if (!S_ISREG(file_inode(file)->i_mode)) {
+		fput(file);
+		return -EINVAL;
+	}
+	if (!(file->f_mode & FMODE_READ)) {
+		fput(file);
+		return -EBADF;
+	}
+	entry = kmalloc(sizeof(struct ref_file), GFP_KERNEL);
+	if (entry == NULL) {
+		fput(file);
+		return -ENOMEM;
+	}
+
+	spin_lock(&ref_files_lock);
+	held = find_by_inode(net, file_inode(file));
+	if (held != NULL) {
+		held->refs++;
+		*id = held->id;
+		spin_unlock(&ref_files_lock);
+		kfree(entry);
+		fput(file);
+		return 0;
+	}
+	/* Ids in use aren't handed out again, and 0 is never one */
+	do {
+		last_ref_file_id++;
+	} while (last_ref_file_id == 0 || find_by_id(last_ref_file_id) != NULL);
+	entry->net = net;
+	entry->file = file;
+	entry->id = last_ref_file_id;
+	entry->refs = 1;
+	hash_add(ref_files_by_inode, &entry->by_inode, (unsigned long)file_inode(file));
+	hash_add(ref_files_by_id, &entry->by_id, entry->id);
+	*id = entry->id;
+	spin_unlock(&ref_files_lock);
+	return 0;
+}
+
+/**
+ * Drops a socket's hold on a file. The file is closed, and its id
+ * forgotten, once no socket holds it
+ * @param	id - The file's id, as given by hold_ref_file
+ */
+void release_ref_file(u32 id) {
+	struct ref_file* entry;
+
+	spin_lock(&ref_files_lock);
+	entry = find_by_id(id);
+	if (entry == NULL || --entry->refs > 0) {
+		spin_unlock(&ref_files_lock);
+		return;
+	}
+	hash_del(&entry->by_inode);
+	hash_del(&entry->by_id);
+	spin_unlock(&ref_files_lock);
+	fput(entry->file);
+	kfree(entry);
+	return;
+}
+
+/**
+ * Opens a held file for a daemon. It's a file of the daemon's own, so
+ * its reads don't move the application's offset, opened read only with
+ * the credentials the application opened it with
+ * @param	net - Namespace of the daemon
+ * @param	id - The file's id
+ * @return	The new file, otherwise an error pointer
+ */
+struct file* open_ref_file(struct net* net, u32 id) {
+	struct ref_file* entry;
+	struct file* file;
+	struct file* daemon_file;
+
+	spin_lock(&ref_files_lock);
+	entry = find_by_id(id);
+	if (entry == NULL || !net_eq(entry->net, net)) {
+		spin_unlock(&ref_files_lock);
+		return ERR_PTR(-ENOENT);
+	}
+	file = get_file(entry->file);
+	spin_unlock(&ref_files_lock);
+	daemon_file = dentry_open(&file->f_path, O_RDONLY, file->f_cred);
+	fput(file);
+	return daemon_file;
+}
+
+struct ref_file* find_by_inode(struct net* net, struct inode* inode) {
+	struct ref_file* entry;
+	hash_for_each_possible(ref_files_by_inode, entry, by_inode, (unsigned long)inode) {
+		if (file_inode(entry->file) == inode && net_eq(entry->net, net)) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+struct ref_file* find_by_id(u32 id) {
+	struct ref_file* entry;
+	hash_for_each_possible(ref_files_by_id, entry, by_id, id) {
+		if (entry->id == id) {
+			return entry;
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,13 @@
+#ifndef TLS_FDREF_H
+#define TLS_FDREF_H
+
+#include <linux/types.h>
+
+struct net;
+struct file;
+
+int hold_ref_file(struct net* net, int fd, u32* id);
+void release_ref_file(u32 id);
+struct file* open_ref_file(struct net* net, u32 id);
+
+#endif /* TLS_FDREF_H */
@@ -8,21 +8,44 @@
 #include <net/inet_common.h>
 #include <linux/limits.h>
 #include <linux/cpumask.h>
-#include <linux/spinlock.h>
 #include "tls_inet.h"
 #include "tls_common.h"
+#include "tls_daemon.h"
+#include "tls_admit.h"
+#include "tls_ktls.h"
+#include "tls_warm.h"
 #include "netlink.h"
 
 static atomic_long_t tls_memory_allocated;
 static struct percpu_counter tls_orphan_count;
 static struct percpu_counter tls_sockets_allocated;
 
-static unsigned int balancer = 0;
-static DEFINE_SPINLOCK(load_balance_lock);
-
 static struct proto_ops ref_inet_stream_ops;
 static struct proto ref_tcp_prot;
 
+/* Every internal connection is a loopback one, and each pair of
+ * addresses has only the ephemeral port range to go round. Spreading
+ * the source and daemon ends across 127.0.0.0/8 multiplies that by the
+ * number of addresses used. Daemons must listen on the wildcard address
+ * for loopback_daemon_addrs above 1 */
+#define LOOPBACK_ADDRS_MAX	((1 << 24) - 2)
+
+static int loopback_sources = 1;
+module_param(loopback_sources, int, 0644);
+MODULE_PARM_DESC(loopback_sources, "Loopback addresses internal connections are made from, starting at 127.0.0.1");
+
+static int loopback_daemon_addrs = 1;
+module_param(loopback_daemon_addrs, int, 0644);
+MODULE_PARM_DESC(loopback_daemon_addrs, "Loopback addresses daemons are reached on, starting at 127.0.0.1");
+
+static DEFINE_PER_CPU(unsigned int, loopback_next);
+
+/* Most data MSG_FASTOPEN hands the daemon with the connect. It's what a
+ * TLS 1.3 server usually accepts as early data */
+#define EARLY_DATA_MAX		16384
+
+static __be32 pick_loopback_addr(int count);
+
 /* TLS functions for INET ops */
 int tls_inet_init_sock(struct sock *sk);
 int tls_inet_release(struct socket* sock);
@@ -32,7 +55,28 @@ int tls_inet_listen(struct socket *sock, int backlog);
 int tls_inet_accept(struct socket *sock, struct socket *newsock, int flags, bool kern);
 int tls_inet_setsockopt(struct socket *sock, int level, int optname, char __user *optval, unsigned int optlen);
 int tls_inet_getsockopt(struct socket *sock, int level, int optname, char __user *optval, int __user *optlen);
-/* We don't need sendmsg, recvmsg, poll, etc here because we're using the native socket functions */
+ssize_t tls_inet_splice_read(struct socket *sock, loff_t *ppos, struct pipe_inode_info *pipe, size_t len, unsigned int flags);
+int tls_inet_sendmsg(struct socket *sock, struct msghdr *msg, size_t size);
+int tls_inet_recvmsg(struct socket *sock, struct msghdr *msg, size_t size, int flags);
+int tls_inet_shutdown(struct socket *sock, int how);
+unsigned int tls_inet_poll(struct file *file, struct socket *sock, struct poll_table_struct *wait);
+int tls_inet_getname(struct socket *sock, struct sockaddr *uaddr, int *uaddr_len, int peer);
+int tls_inet_ioctl(struct socket *sock, unsigned int cmd, unsigned long arg);
+ssize_t tls_inet_sendpage(struct socket *sock, struct page *page, int offset, size_t size, int flags);
+static struct socket* internal_leg(struct socket* sock);
+static void settle_connect(tls_sock_data_t* sock_data, struct socket* sock);
+static int wait_for_handshake(tls_sock_data_t* sock_data, struct socket* sock, int nonblock);
+static int connect_to_daemon(tls_sock_data_t* sock_data, struct socket* sock, int flags);
+static int start_connect(struct socket *sock, struct sockaddr *uaddr, int addr_len, int flags, char* early_data, int early_len);
+static int send_fastopen(struct socket *sock, struct msghdr *msg, size_t size);
+/* We don't need ioctl, etc here because we're using the native socket functions,
+ * except that a connect that took a pooled connection leaves it behind the
+ * application's sock, and every call that reaches the connection goes on to it.
+ * sendpage goes through the sock's proto, so kernel TLS picks it up without help.
+ * sendmsg refuses MSG_ZEROCOPY and connects for MSG_FASTOPEN. sendmsg, recvmsg,
+ * shutdown and poll also step in to swap in a connection a nonblocking connect
+ * left ready, and sendmsg, recvmsg and poll hold back a socket whose handshake
+ * is still going */
 
 int set_tls_prot_inet_stream(struct proto* tls_prot, struct proto_ops* tls_proto_ops) {
 	/* We share operations with TCP for transport to daemon */
@@ -65,6 +109,14 @@ int set_tls_prot_inet_stream(struct proto* tls_prot, struct proto_ops* tls_proto
 	tls_proto_ops->accept = tls_inet_accept;
 	tls_proto_ops->setsockopt = tls_inet_setsockopt;
 	tls_proto_ops->getsockopt = tls_inet_getsockopt;
+	tls_proto_ops->sendmsg = tls_inet_sendmsg;
+	tls_proto_ops->recvmsg = tls_inet_recvmsg;
+	tls_proto_ops->shutdown = tls_inet_shutdown;
+	tls_proto_ops->poll = tls_inet_poll;
+	tls_proto_ops->getname = tls_inet_getname;
+	tls_proto_ops->ioctl = tls_inet_ioctl;
+	tls_proto_ops->sendpage = tls_inet_sendpage;
+	tls_proto_ops->splice_read = tls_inet_splice_read;
 
 	return 0;
 }
@@ -90,23 +142,28 @@ int tls_inet_init_sock(struct sock *sk) {
 
 	((struct sockaddr_in*)&sock_data->int_addr)->sin_family = AF_INET;
 	((struct sockaddr_in*)&sock_data->int_addr)->sin_port = 0;
-	((struct sockaddr_in*)&sock_data->int_addr)->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	((struct sockaddr_in*)&sock_data->int_addr)->sin_addr.s_addr = loopback_source_addr();
 
 	sock_data->key = (unsigned long)sk->sk_socket;
-	spin_lock(&load_balance_lock);
-	sock_data->daemon_id = DAEMON_START_PORT + balancer;
+	sock_data->net = sock_net(sk);
+	sock_data->daemon_id = assign_daemon(sock_data->net);
+	if (sock_data->daemon_id < 0) {
+		ret = sock_data->daemon_id;
+		kfree(sock_data);
+		return ret;
+	}
 	//printk(KERN_INFO "Assigning new socket to daemon %d\n", sock_data->daemon_id);
-	balancer = (balancer + 1) % NUM_DAEMONS;
-	spin_unlock(&load_balance_lock);
 	init_completion(&sock_data->sock_event);
+	spin_lock_init(&sock_data->rdata_lock);
 	put_tls_sock_data(sock_data->key, &sock_data->hash);
 	ret = ref_tcp_prot.init(sk);
 
 	comm_ptr = get_full_comm(comm, NAME_MAX);
 
-	send_socket_notification((unsigned long)sk->sk_socket, comm_ptr, sock_data->daemon_id);
-	wait_for_completion_timeout(&sock_data->sock_event, RESPONSE_TIMEOUT);
-	/* We're not checking return values here because init_sock always returns 0 */
+	/* init_sock always returns 0, so there's no point waiting for the
+	 * daemon's ack and holding up whoever creates the socket */
+	sock_data->unacked_seq = next_notify_seq();
+	send_socket_notification(sock_data->net, (unsigned long)sk->sk_socket, comm_ptr, sock_data->unacked_seq, sock_data->daemon_id);
 	return ret;
 }
 
@@ -116,13 +173,14 @@ int tls_inet_release(struct socket* sock) {
 		/* We're not treating this particular socket.*/
 		return ref_inet_stream_ops.release(sock);
 	}
-	send_close_notification((unsigned long)sock, sock_data->daemon_id);
+	send_close_notification(sock_data->net, (unsigned long)sock, sock_data->daemon_id);
 	//wait_for_completion_timeout(&sock_data->sock_event, RESPONSE_TIMEOUT);
-	if (sock_data->hostname != NULL) {
-		kfree(sock_data->hostname);
+	if (sock_data->reuseport_group != NULL) {
+		leave_reuseport_group(sock_data->reuseport_group, sock_data->daemon_id);
 	}
+	daemon_socket_removed(sock_data->net, sock_data->daemon_id);
 	rem_tls_sock_data(&sock_data->hash);
-	kfree(sock_data);
+	free_tls_sock_data(sock_data);
 	return ref_inet_stream_ops.release(sock);
 }
 
@@ -145,9 +203,25 @@ int tls_inet_bind(struct socket *sock, struct sockaddr *uaddr, int addr_len) {
 	 * it for us */
 	((struct sockaddr_in*)&sock_data->int_addr)->sin_port = inet_sk(sock->sk)->inet_sport;
 
-	send_bind_notification((unsigned long)sock, &sock_data->int_addr,
+	/* The daemon is about to hold state for this socket */
+	ret = migrate_if_draining(sock_data);
+	if (ret != 0) {
+		return ret;
+	}
+	ret = route_by_selector(sock_data, TLS_SELECT_BIND, uaddr);
+	if (ret < 0) {
+		return ret;
+	}
+	if (ret == 0) {
+		ret = place_in_reuseport_group(sock_data, sock, uaddr);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+	pin_to_daemon(sock_data, sock);
+	send_bind_notification(sock_data->net, (unsigned long)sock, &sock_data->int_addr,
 			(struct sockaddr*)uaddr, sock_data->daemon_id);
-	if (wait_for_completion_timeout(&sock_data->sock_event, RESPONSE_TIMEOUT) == 0) {
+	if (wait_for_daemon(sock_data, RESPONSE_TIMEOUT) == 0) {
 		/* Let's lie to the application if the daemon isn't responding */
 		return -EADDRINUSE;
 	}
@@ -162,119 +236,233 @@ int tls_inet_bind(struct socket *sock, struct sockaddr *uaddr, int addr_len) {
 }
 
 int tls_inet_connect(struct socket *sock, struct sockaddr *uaddr, int addr_len, int flags) {
+	return start_connect(sock, uaddr, addr_len, flags, NULL, 0);
+}
+
+/**
+ * Connects through the daemon, or moves a connect already under way on
+ * @param	sock - The application's socket
+ * @param	uaddr - The peer's address
+ * @param	addr_len - Length of uaddr
+ * @param	flags - The connect flags, O_NONBLOCK or not
+ * @param	early_data - Data for the daemon to send as soon as it can,
+ * 		or NULL. Only used by a connect that's just starting
+ * @param	early_len - Length of early_data
+ * @return	As connect
+ */
+int start_connect(struct socket *sock, struct sockaddr *uaddr, int addr_len, int flags, char* early_data, int early_len) {
 	int ret;
 	/*struct sockaddr_in* uaddr_in;*/
 	int blocking;
+	struct admission_owner* admission;
 
-	struct sockaddr_in reroute_addr = {
-		.sin_family = AF_INET,
-		.sin_addr.s_addr = htonl(INADDR_LOOPBACK)
-	};
 	struct sockaddr_in int_addr = {
 		.sin_family = AF_INET,
 		.sin_port = 0,
-		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
 	};
 
-	/* Save original destination address information */
 	tls_sock_data_t* sock_data = get_tls_sock_data((unsigned long)sock);
+	blocking = !(flags & O_NONBLOCK);
+
+	switch (READ_ONCE(sock_data->connect_state)) {
+	case CONNECT_HANDSHAKING:
+		if (blocking == 0 || sock_data->connect_blocking != 0) {
+			return -EALREADY;
+		}
+		/* Restarted after a signal, or a blocking connect behind a
+		 * nonblocking one. The handshake callback moves it on */
+		ret = wait_event_interruptible(*sk_sleep(sock->sk),
+				READ_ONCE(sock_data->connect_state) != CONNECT_HANDSHAKING);
+		if (ret != 0) {
+			return ret;
+		}
+		return tls_inet_connect(sock, uaddr, addr_len, flags);
+	case CONNECT_INTERNAL:
+		/* Restarted after a signal, or asked again while a
+		 * nonblocking connect finishes */
+		return connect_to_daemon(sock_data, sock, flags);
+	case CONNECT_READY:
+	case CONNECT_SWAPPING:
+		/* As with TCP, the first connect after a nonblocking one
+		 * completes reports success */
+		settle_connect(sock_data, sock);
+		return 0;
+	case CONNECT_DONE:
+		return -EISCONN;
+	case CONNECT_FAILED:
+		ret = sock_error(sock->sk);
+		return ret != 0 ? ret : -ECONNABORTED;
+	default:
+		break;
+	}
+
+	/* Save original destination address information */
+	int_addr.sin_addr.s_addr = ((struct sockaddr_in*)&sock_data->int_addr)->sin_addr.s_addr;
 	sock_data->rem_addr = (struct sockaddr)(*uaddr);
 	sock_data->rem_addrlen = addr_len;
 
+	/* The daemon is about to hold state for this socket */
+	ret = migrate_if_draining(sock_data);
+	if (ret != 0) {
+		return ret;
+	}
+	ret = route_by_selector(sock_data, TLS_SELECT_CONNECT, uaddr);
+	if (ret == 0) {
+		ret = route_by_destination(sock_data, uaddr);
+	}
+	if (ret < 0) {
+		return ret;
+	}
+	pin_to_daemon(sock_data, sock);
+	/* Kept for a connect restarted after a signal */
+	sock_data->daemon_addr = loopback_daemon_addr();
+
 	/* Pre-emptively bind the source port so we can register it before remote
-	 * connection. We only do this if the application hasn't explicitly called
-	 * bind already */
+	 * connection, or take an already open connection to the daemon, which
+	 * the notification names by its internal address. We only do this if
+	 * the application hasn't explicitly called bind already */
 	if (sock_data->is_bound == 0) {
-		ref_inet_stream_ops.bind(sock, (struct sockaddr*)&int_addr, sizeof(int_addr));
-		int_addr.sin_port = inet_sk(sock->sk)->inet_sport;
+		sock_data->warm_sock = take_warm_connection(sock_data->net, sock_data->daemon_id);
+		if (sock_data->warm_sock != NULL) {
+			int_addr.sin_addr.s_addr = inet_sk(sock_data->warm_sock->sk)->inet_saddr;
+			int_addr.sin_port = inet_sk(sock_data->warm_sock->sk)->inet_sport;
+		}
+		else {
+			ref_inet_stream_ops.bind(sock, (struct sockaddr*)&int_addr, sizeof(int_addr));
+			int_addr.sin_port = inet_sk(sock->sk)->inet_sport;
+		}
 		memcpy(&sock_data->int_addr, &int_addr, sizeof(int_addr));
 		sock_data->is_bound = 1;
 		sock_data->int_addrlen = sizeof(int_addr);
 	}
 
-	blocking = !(flags & O_NONBLOCK);
-
-	/* If we've been interrupted (in a previous call to connect)
-	 * then we're currently being called again and shouldn't
-	 * double send connect notifies or wait */
-	if (sock_data->interrupted == 1) {
-		reroute_addr.sin_port = htons(sock_data->daemon_id);
-		ret = ref_inet_stream_ops.connect(sock, ((struct sockaddr*)&reroute_addr), sizeof(reroute_addr), flags);
-		if (ret != 0) {
-			if (ret == -ERESTARTSYS) { /* Interrupted by signal, transparently restart */
-				sock_data->interrupted = 1;
-			}
-			else {
-				sock_data->interrupted = 0;
-			}
-		}
+	ret = admit_handshake(sock_data->net, sock_data->daemon_id, blocking, &admission);
+	if (ret != 0) {
 		return ret;
 	}
-
-	/* Connect notifications and waiting should only happen the first time for
-	 * any connection attempt */
+	sock_data->connect_blocking = blocking;
+	sock_data->connect_seq = next_notify_seq();
+	sock_data->connect_state = CONNECT_HANDSHAKING;
 
 	if (blocking == 0) {
-		sock_data->async_connect = 1;
-		send_connect_notification((unsigned long)sock, &sock_data->int_addr, uaddr, blocking,
-			sock_data->daemon_id);
-		printk(KERN_ALERT "nonblocking wait going\n");
-		if (wait_for_completion_timeout(&sock_data->sock_event, RESPONSE_TIMEOUT) == 0) {
-			return -EHOSTUNREACH;
-		}
-		if (sock_data->response != 0) {
-			sock->sk->sk_err = -sock_data->response;
-			return sock_data->response;
-		}
-		/* XXX should we mess with the socket state here? Maybe fake SS_CONNECTING? */
-		return 0;
+		/* The handshake callback takes it from here, in
+		 * inet_trigger_connect. Until then tls_inet_poll holds
+		 * back the unconnected socket's events */
+		sock_data->admission = admission;
+		sock_data->connect_ack_pending = 1;
+		send_connect_notification(sock_data->net, (unsigned long)sock, &sock_data->int_addr, uaddr, blocking,
+			sock_data->warm_sock != NULL, early_data, early_len, sock_data->connect_seq, sock_data->daemon_id);
+		return -EINPROGRESS;
 	}
 
-	/* Blocking case */
-	send_connect_notification((unsigned long)sock, &sock_data->int_addr, uaddr, blocking,
-			sock_data->daemon_id);
-	//printk(KERN_ALERT "blocking wait going\n");
-	if (wait_for_completion_timeout(&sock_data->sock_event, HANDSHAKE_TIMEOUT) == 0) {
+	/* Blocking case. A signal doesn't have to wait out the handshake:
+	 * the callback then finishes the connect as it would a nonblocking
+	 * one, and the restarted connect waits for that */
+	sock_data->admission = admission;
+	send_connect_notification(sock_data->net, (unsigned long)sock, &sock_data->int_addr, uaddr, blocking,
+			sock_data->warm_sock != NULL, early_data, early_len, sock_data->connect_seq, sock_data->daemon_id);
+	ret = wait_for_daemon_interruptible(sock_data, HANDSHAKE_TIMEOUT);
+	if (ret == -ERESTARTSYS) {
+		if (cmpxchg(&sock_data->connect_blocking, 1, 0) == 1) {
+			return -ERESTARTSYS;
+		}
+		/* The reply beat the signal */
+		wait_for_completion(&sock_data->sock_event);
+		ret = 1;
+	}
+	finish_handshake(sock_data->net, sock_data->daemon_id, sock_data->admission);
+	sock_data->admission = NULL;
+	if (ret == 0) {
+		/* A late answer is for a connect that's no longer there */
+		sock_data->connect_seq = 0;
+		sock_data->connect_state = CONNECT_IDLE;
 		/* Let's lie to the application if the daemon isn't responding */
 		return -EHOSTUNREACH;
 	}
 	if (sock_data->response != 0) {
+		sock_data->connect_state = CONNECT_IDLE;
 		return sock_data->response;
 	}
-
-	reroute_addr.sin_port = htons(sock_data->daemon_id);
-	ret = ref_inet_stream_ops.connect(sock, ((struct sockaddr*)&reroute_addr), sizeof(reroute_addr), flags);
-	if (ret != 0) {
-		if (ret == -ERESTARTSYS) { /* Interrupted by signal, transparently restart */
-			sock_data->interrupted = 1;
+	if (sock_data->ktls_file != NULL) {
+		/* Talk to the peer directly rather than through the daemon */
+		drop_warm_connection(sock_data);
+		sock_data->connect_state = CONNECT_DONE;
+		return take_over_ktls(sock_data, sock);
+	}
+	if (sock_data->warm_sock != NULL) {
+		ret = attach_warm_connection(sock_data, sock);
+		if (ret == 0) {
+			sock_data->connect_state = CONNECT_DONE;
 		}
 		return ret;
+	}
+	sock_data->connect_state = CONNECT_INTERNAL;
+	return connect_to_daemon(sock_data, sock, flags);
+}
+
+/**
+ * Makes the internal connection to the daemon once its handshake with
+ * the peer is done, and moves the connect on according to the result
+ * @param	sock_data - TLS socket data of the connecting socket
+ * @param	sock - The application's socket
+ * @param	flags - The connect flags, O_NONBLOCK or not
+ * @return	As the underlying connect
+ */
+int connect_to_daemon(tls_sock_data_t* sock_data, struct socket* sock, int flags) {
+	int ret;
+	struct sockaddr_in reroute_addr = {
+		.sin_family = AF_INET,
+	};
 
+	reroute_addr.sin_addr.s_addr = sock_data->daemon_addr;
+	reroute_addr.sin_port = htons(sock_data->daemon_id);
+	ret = ref_inet_stream_ops.connect(sock, ((struct sockaddr*)&reroute_addr), sizeof(reroute_addr), flags);
+	switch (ret) {
+	case 0:
+		sock_data->connect_state = CONNECT_DONE;
+		break;
+	case -EISCONN:
+		sock_data->connect_state = CONNECT_DONE;
+		break;
+	case -ERESTARTSYS: /* Interrupted by signal, transparently restart */
+	case -EINPROGRESS:
+	case -EALREADY:
+		break;
+	default:
+		sock_data->connect_state = CONNECT_IDLE;
+		break;
 	}
-	return 0;
+	return ret;
 }
 
 int tls_inet_listen(struct socket *sock, int backlog) {
+	int ret;
 	tls_sock_data_t* sock_data = get_tls_sock_data((unsigned long)sock);
         struct sockaddr_in int_addr = {
                 .sin_family = AF_INET,
                 .sin_port = 0,
-                .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
         };
 
 	if (sock_data->is_bound == 0) {
+		int_addr.sin_addr.s_addr = ((struct sockaddr_in*)&sock_data->int_addr)->sin_addr.s_addr;
 		ref_inet_stream_ops.bind(sock, (struct sockaddr*)&int_addr, sizeof(int_addr));
 		int_addr.sin_port = inet_sk(sock->sk)->inet_sport;
 		memcpy(&sock_data->int_addr, &int_addr, sizeof(int_addr));
 		sock_data->int_addrlen = sizeof(int_addr);
 		sock_data->is_bound = 1;
 	}
-	send_listen_notification((unsigned long)sock, 
+	/* The daemon is about to hold state for this socket */
+	ret = migrate_if_draining(sock_data);
+	if (ret != 0) {
+		return ret;
+	}
+	pin_to_daemon(sock_data, sock);
+	send_listen_notification(sock_data->net, (unsigned long)sock, 
 			(struct sockaddr*)&sock_data->int_addr,
 		        (struct sockaddr*)&sock_data->ext_addr,
 			sock_data->daemon_id);
 
-	if (wait_for_completion_timeout(&sock_data->sock_event, RESPONSE_TIMEOUT) == 0) {
+	if (wait_for_daemon(sock_data, RESPONSE_TIMEOUT) == 0) {
 		/* Let's lie to the application if the daemon isn't responding */
 		return -EADDRINUSE;
 	}
@@ -306,16 +494,49 @@ int tls_inet_accept(struct socket *sock, struct socket *newsock, int flags, bool
 
 	memset(sock_data, 0, sizeof(tls_sock_data_t));
 
+	sock_data->net = listen_sock_data->net;
 	sock_data->daemon_id = listen_sock_data->daemon_id;
+	daemon_socket_added(sock_data->net, sock_data->daemon_id);
+	/* The listener's daemon owns the connection */
+	sock_data->pinned = 1;
+	/* The daemon only connects to us once its handshake is done */
+	sock_data->handshake_done = 1;
+	sock_data->connect_state = CONNECT_DONE;
 	sock_data->key = (unsigned long)newsock;
 	init_completion(&sock_data->sock_event);
+	spin_lock_init(&sock_data->rdata_lock);
 	put_tls_sock_data(sock_data->key, &sock_data->hash);
 
 	((struct sockaddr_in*)&sock_data->int_addr)->sin_family = AF_INET;
 	((struct sockaddr_in*)&sock_data->int_addr)->sin_port = inet_sk(newsock->sk)->inet_dport;
-	((struct sockaddr_in*)&sock_data->int_addr)->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-	send_accept_notification((unsigned long)newsock, &sock_data->int_addr, sock_data->daemon_id);
-	wait_for_completion_timeout(&sock_data->sock_event, RESPONSE_TIMEOUT);
+	/* The daemon may come from any of the loopback addresses */
+	((struct sockaddr_in*)&sock_data->int_addr)->sin_addr.s_addr = inet_sk(newsock->sk)->inet_daddr;
+	if (listen_sock_data->ktls_wanted == 0 &&
+			queue_accept_notification(sock_data->net, (unsigned long)newsock, &sock_data->int_addr, sock_data->daemon_id) == 0) {
+		/* The daemon hears about it shortly, and before anything else
+		 * about the socket, so there's nothing to wait for */
+		return ret;
+	}
+	if (listen_sock_data->ktls_wanted == 1 && (flags & O_NONBLOCK)) {
+		/* A nonblocking accept doesn't wait for the handover. Until
+		 * the daemon's answer says whose connection it is, the socket
+		 * holds back its data and events as a connecting one does,
+		 * and the answer is handled like a nonblocking connect's */
+		sock_data->accepted = 1;
+		sock_data->connect_seq = next_notify_seq();
+		sock_data->connect_state = CONNECT_HANDSHAKING;
+		newsock->state = SS_UNCONNECTED;
+		send_accept_notification(sock_data->net, (unsigned long)newsock, &sock_data->int_addr,
+				sock_data->connect_seq, sock_data->daemon_id);
+		return ret;
+	}
+	send_accept_notification(sock_data->net, (unsigned long)newsock, &sock_data->int_addr, 0, sock_data->daemon_id);
+	wait_for_daemon(sock_data, RESPONSE_TIMEOUT);
+	if (sock_data->ktls_file != NULL) {
+		/* The daemon answered with a handshake return handing over its
+		 * connection to the peer */
+		return take_over_ktls(sock_data, newsock);
+	}
 	return ret;
 }
 
@@ -324,7 +545,14 @@ int tls_inet_setsockopt(struct socket *sock, int level, int optname, char __user
 	if (sock_data == NULL) {
 		return -EBADF;
 	}
-	return tls_common_setsockopt(sock_data, sock, level, optname, optval, optlen, ref_inet_stream_ops.setsockopt);
+	settle_connect(sock_data, sock);
+	if (level == SOL_SOCKET && optname == SO_ZEROCOPY) {
+		/* See tls_inet_sendmsg. The socket layer would refuse it
+		 * too, but with an error code userspace can't name */
+		return -EOPNOTSUPP;
+	}
+	/* The local half of an option is for the connection */
+	return tls_common_setsockopt(sock_data, internal_leg(sock), level, optname, optval, optlen, ref_inet_stream_ops.setsockopt);
 }
 
 int tls_inet_getsockopt(struct socket *sock, int level, int optname, char __user *optval, int __user *optlen) {
@@ -332,16 +560,308 @@ int tls_inet_getsockopt(struct socket *sock, int level, int optname, char __user
 	if (sock_data == NULL) {
 		return -EBADF;
 	}
+	settle_connect(sock_data, sock);
+	/* What the socket is, it says itself. The rest is the connection's */
+	if (level != SOL_SOCKET || (optname != SO_PROTOCOL && optname != SO_DOMAIN &&
+			optname != SO_TYPE && optname != SO_ACCEPTCONN)) {
+		sock = internal_leg(sock);
+	}
 	return tls_common_getsockopt(sock_data, sock, level, optname, optval, optlen, ref_inet_stream_ops.getsockopt);
 }
 
-void inet_trigger_connect(struct socket* sock, int daemon_id) {
-	struct sockaddr_in reroute_addr = {
-		.sin_family = AF_INET,
-		.sin_addr.s_addr = htonl(INADDR_LOOPBACK)
-	};
-	reroute_addr.sin_port = htons(daemon_id);
-	ref_inet_stream_ops.connect(sock, ((struct sockaddr*)&reroute_addr), sizeof(reroute_addr), O_NONBLOCK);
-	printk(KERN_ALERT "Async connect done\n");
+/**
+ * Sends on the application's socket. MSG_ZEROCOPY is refused rather than
+ * quietly dropped. Neither data path can leave the user's pages pinned
+ * until the peer has them: the loopback leg is copied out when the
+ * daemon's end receives it, and kernel TLS encrypts full records straight
+ * from the user's pages but is done with them when the send returns
+ * @param	sock - The application's socket
+ * @param	msg - What to send
+ * @param	size - Bytes to send
+ * @return	Bytes sent, otherwise an error
+ */
+int tls_inet_sendmsg(struct socket *sock, struct msghdr *msg, size_t size) {
+	tls_sock_data_t* sock_data;
+	int ret;
+
+	if (msg->msg_flags & MSG_ZEROCOPY) {
+		return -EOPNOTSUPP;
+	}
+	if (msg->msg_flags & MSG_FASTOPEN) {
+		return send_fastopen(sock, msg, size);
+	}
+	/* Only an unconnected socket, or an accepted one waiting on a
+	 * handover, can be waiting on the daemon */
+	if (sock->sk->sk_state != TCP_CLOSE && sock->state != SS_UNCONNECTED) {
+		return ref_inet_stream_ops.sendmsg(sock, msg, size);
+	}
+	sock_data = get_tls_sock_data((unsigned long)sock);
+	ret = wait_for_handshake(sock_data, sock, msg->msg_flags & MSG_DONTWAIT);
+	if (ret != 0) {
+		return ret;
+	}
+	settle_connect(sock_data, sock);
+	return ref_inet_stream_ops.sendmsg(internal_leg(sock), msg, size);
+}
+
+/**
+ * Starts a connect carrying the first bytes of data. The daemon sends
+ * them as soon as it can: in the SYN of a TCP Fast Open connection to
+ * the peer, and as TLS 1.3 early data if the socket set TLS_EARLY_DATA
+ * and there's a session to resume
+ * @param	sock - The application's socket
+ * @param	msg - The message, addressed to the peer
+ * @param	size - Length of the message
+ * @return	The number of bytes the daemon took, otherwise an error
+ */
+int send_fastopen(struct socket *sock, struct msghdr *msg, size_t size) {
+	tls_sock_data_t* sock_data;
+	char* data;
+	int flags;
+	int len;
+	int ret;
+
+	sock_data = get_tls_sock_data((unsigned long)sock);
+	if (sock_data == NULL) {
+		return -EBADF;
+	}
+	/* The flag must never reach the internal connection, which would
+	 * then connect to the peer itself */
+	msg->msg_flags &= ~MSG_FASTOPEN;
+	if (READ_ONCE(sock_data->connect_state) != CONNECT_IDLE) {
+		/* Already connecting or connected, so it's an ordinary send */
+		return tls_inet_sendmsg(sock, msg, size);
+	}
+	if (msg->msg_name == NULL) {
+		return -EDESTADDRREQ;
+	}
+	flags = (msg->msg_flags & MSG_DONTWAIT) ? O_NONBLOCK : 0;
+	len = min_t(size_t, size, EARLY_DATA_MAX);
+	if ((data = kmalloc(len, GFP_KERNEL)) == NULL) {
+		return -ENOBUFS;
+	}
+	if (copy_from_iter(data, len, &msg->msg_iter) != len) {
+		kfree(data);
+		return -EFAULT;
+	}
+	ret = start_connect(sock, (struct sockaddr*)msg->msg_name, msg->msg_namelen, flags, data, len);
+	kfree(data);
+	if (ret == 0 || ret == -EINPROGRESS || ret == -ERESTARTSYS) {
+		/* The daemon has the data whatever becomes of the connect.
+		 * As with TCP, nonblocking callers learn how that went from
+		 * poll, and the rest of a long message goes in later sends */
+		return len;
+	}
+	return ret;
+}
+
+int tls_inet_recvmsg(struct socket *sock, struct msghdr *msg, size_t size, int flags) {
+	tls_sock_data_t* sock_data;
+	int ret;
+	/* As in tls_inet_sendmsg */
+	if (sock->sk->sk_state == TCP_CLOSE || sock->state == SS_UNCONNECTED) {
+		sock_data = get_tls_sock_data((unsigned long)sock);
+		ret = wait_for_handshake(sock_data, sock, flags & MSG_DONTWAIT);
+		if (ret != 0) {
+			return ret;
+		}
+		settle_connect(sock_data, sock);
+	}
+	return ref_inet_stream_ops.recvmsg(internal_leg(sock), msg, size, flags);
+}
+
+int tls_inet_shutdown(struct socket *sock, int how) {
+	if (sock->sk->sk_state == TCP_CLOSE || sock->state == SS_UNCONNECTED) {
+		settle_connect(get_tls_sock_data((unsigned long)sock), sock);
+	}
+	return ref_inet_stream_ops.shutdown(internal_leg(sock), how);
+}
+
+unsigned int tls_inet_poll(struct file *file, struct socket *sock, struct poll_table_struct *wait) {
+	unsigned int mask;
+	struct socket* leg;
+	tls_sock_data_t* sock_data = get_tls_sock_data((unsigned long)sock);
+	/* Unconnected TCP looks writable and hung up, which would end a
+	 * nonblocking connect early. An accepted socket waiting on a
+	 * handover mustn't look ready either */
+	if (sock_data != NULL && READ_ONCE(sock_data->connect_state) == CONNECT_HANDSHAKING) {
+		sock_poll_wait(file, sk_sleep(sock->sk), wait);
+		if (READ_ONCE(sock_data->connect_state) == CONNECT_HANDSHAKING) {
+			return 0;
+		}
+	}
+	settle_connect(sock_data, sock);
+	/* Kernel TLS only reports data as readable once a whole record
+	 * is in */
+	if (sock_data != NULL && sock_data->ktls_ops != NULL) {
+		mask = sock_data->ktls_ops->poll(file, sock, wait);
+	}
+	else if ((leg = internal_leg(sock)) != sock) {
+		/* The leg wakes the application's socket's queue, see
+		 * attach_warm_connection, so that's the one to wait on */
+		sock_poll_wait(file, sk_sleep(sock->sk), wait);
+		mask = ref_inet_stream_ops.poll(file, leg, NULL);
+	}
+	else {
+		mask = ref_inet_stream_ops.poll(file, sock, wait);
+	}
+	/* A nonblocking setsockopt is repeated once it's writable. An
+	 * unconnected socket also looks hung up, which would end the
+	 * wait early */
+	if (sock_data != NULL && READ_ONCE(sock_data->opt_waiting) == 1) {
+		mask &= ~(POLLOUT | POLLWRNORM);
+		if (sock->state == SS_UNCONNECTED) {
+			mask &= ~POLLHUP;
+		}
+	}
+	return mask;
+}
+
+int tls_inet_getname(struct socket *sock, struct sockaddr *uaddr, int *uaddr_len, int peer) {
+	return ref_inet_stream_ops.getname(internal_leg(sock), uaddr, uaddr_len, peer);
+}
+
+int tls_inet_ioctl(struct socket *sock, unsigned int cmd, unsigned long arg) {
+	return ref_inet_stream_ops.ioctl(internal_leg(sock), cmd, arg);
+}
+
+ssize_t tls_inet_sendpage(struct socket *sock, struct page *page, int offset, size_t size, int flags) {
+	return ref_inet_stream_ops.sendpage(internal_leg(sock), page, offset, size, flags);
+}
+
+ssize_t tls_inet_splice_read(struct socket *sock, loff_t *ppos, struct pipe_inode_info *pipe, size_t len, unsigned int flags) {
+	tls_sock_data_t* sock_data = get_tls_sock_data((unsigned long)sock);
+	settle_connect(sock_data, sock);
+	/* Records have to be decrypted on the way into the pipe */
+	if (sock_data != NULL && sock_data->ktls_ops != NULL && sock_data->ktls_ops->splice_read != NULL) {
+		return sock_data->ktls_ops->splice_read(sock, ppos, pipe, len, flags);
+	}
+	return ref_inet_stream_ops.splice_read(internal_leg(sock), ppos, pipe, len, flags);
+}
+
+/**
+ * Finds the socket the application's data goes through: its own sock,
+ * connected to the daemon, or the pooled connection a connect left
+ * behind it. The lookup is only needed while the sock is unconnected
+ * @param	sock - The application's socket
+ * @return	The socket to hand the call on to
+ */
+struct socket* internal_leg(struct socket* sock) {
+	tls_sock_data_t* sock_data;
+	if (sock->sk->sk_state != TCP_CLOSE) {
+		return sock;
+	}
+	sock_data = get_tls_sock_data((unsigned long)sock);
+	if (sock_data == NULL || sock_data->warm_sock == NULL ||
+			READ_ONCE(sock_data->connect_state) != CONNECT_DONE) {
+		return sock;
+	}
+	return sock_data->warm_sock;
+}
+
+/**
+ * Holds back a send or receive until the daemon's handshake is done, or
+ * until it has answered an accept that waits on a handover. MSG_FASTOPEN
+ * returns early, so more may follow before the connection exists. TCP
+ * holds back sends while its own handshake is in flight, and so do we
+ * @param	sock_data - TLS socket data of the application's socket, or NULL
+ * @param	sock - The application's socket
+ * @param	nonblock - Nonzero to fail rather than wait
+ * @return	0 once there's nothing to wait for, otherwise an error
+ */
+int wait_for_handshake(tls_sock_data_t* sock_data, struct socket* sock, int nonblock) {
+	if (sock_data == NULL || READ_ONCE(sock_data->connect_state) != CONNECT_HANDSHAKING) {
+		return 0;
+	}
+	if (nonblock) {
+		return -EAGAIN;
+	}
+	return wait_event_interruptible(*sk_sleep(sock->sk),
+			READ_ONCE(sock_data->connect_state) != CONNECT_HANDSHAKING);
+}
+
+/**
+ * Swaps in, or attaches behind the socket, the connection a nonblocking
+ * connect's handshake left ready.
+ * The handshake callback runs in the daemon's context, while the
+ * application may be in a call on the socket, so the swap is left to
+ * the application's next call
+ * @param	sock_data - TLS socket data of the application's socket, or NULL
+ * @param	sock - The application's socket
+ */
+void settle_connect(tls_sock_data_t* sock_data, struct socket* sock) {
+	int state;
+	if (sock_data == NULL) {
+		return;
+	}
+	state = READ_ONCE(sock_data->connect_state);
+	if (state != CONNECT_READY && state != CONNECT_SWAPPING) {
+		return;
+	}
+	if (cmpxchg(&sock_data->connect_state, CONNECT_READY, CONNECT_SWAPPING) != CONNECT_READY) {
+		/* Another of the application's threads is swapping it in.
+		 * Both socks wake the same wait queue, the socket's own */
+		wait_event(*sk_sleep(sock->sk), READ_ONCE(sock_data->connect_state) == CONNECT_DONE);
+		return;
+	}
+	if (sock_data->ktls_file != NULL) {
+		take_over_ktls(sock_data, sock);
+	}
+	else {
+		attach_warm_connection(sock_data, sock);
+	}
+	WRITE_ONCE(sock_data->connect_state, CONNECT_DONE);
+	sock->sk->sk_state_change(sock->sk);
+	return;
+}
+
+/**
+ * Carries a nonblocking connect on from the daemon's handshake result.
+ * Pollers are woken by the internal connection being made, or by the
+ * error being reported
+ * @param	sock - The application's socket
+ */
+void inet_trigger_connect(struct socket* sock) {
+	int ret;
+	tls_sock_data_t* sock_data = get_tls_sock_data((unsigned long)sock);
+	if (sock_data == NULL) {
+		return;
+	}
+	ret = sock_data->response;
+	if (ret == 0) {
+		sock_data->connect_state = CONNECT_INTERNAL;
+		ret = connect_to_daemon(sock_data, sock, O_NONBLOCK);
+		if (ret == 0 || ret == -EINPROGRESS) {
+			return;
+		}
+	}
+	sock_data->connect_state = CONNECT_FAILED;
+	sock->sk->sk_err = -ret;
+	sock->sk->sk_error_report(sock->sk);
 	return;
 }
+
+__be32 loopback_source_addr(void) {
+	return pick_loopback_addr(READ_ONCE(loopback_sources));
+}
+
+__be32 loopback_daemon_addr(void) {
+	return pick_loopback_addr(READ_ONCE(loopback_daemon_addrs));
+}
+
+/**
+ * Spread internal connections across the start of 127.0.0.0/8
+ * @param count number of loopback addresses to use, clamped to the /8
+ * @return an address in network byte order
+ */
+static __be32 pick_loopback_addr(int count) {
+	unsigned int n;
+	if (count <= 1) {
+		return htonl(INADDR_LOOPBACK);
+	}
+	if (count > LOOPBACK_ADDRS_MAX) {
+		count = LOOPBACK_ADDRS_MAX;
+	}
+	n = this_cpu_inc_return(loopback_next);
+	return htonl(INADDR_LOOPBACK + (n % count));
+}
@@ -6,6 +6,8 @@
 
 int set_tls_prot_inet_stream(struct proto* tls_prot, struct proto_ops* tls_proto_ops);
 void inet_stream_cleanup(void);
-void inet_trigger_connect(struct socket* sock, int daemon_id);
+__be32 loopback_source_addr(void);
+__be32 loopback_daemon_addr(void);
+void inet_trigger_connect(struct socket* sock);
 
 #endif /* TLS_INET_H */
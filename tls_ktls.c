@@ -0,0 +1,114 @@
+#include <linux/kernel.h>
+#include <linux/file.h>
+#include <linux/net.h>
+#include <linux/tcp.h>
+#include <linux/tls.h>
+#include <net/sock.h>
+#include <net/tcp.h>
+#include "tls_ktls.h"
+#include "tls_common.h"
+#include "netlink.h"
+
+/* Once the daemon has done a handshake it may give us its connection to
+ * the peer, with the keys and record sequence numbers it negotiated. The
+ * connection is put in kernel TLS and swapped in for the socket the
+ * application holds, taking the daemon out of the data path. This works
+ * for connecting sockets, from the handshake return, and for accepted
+ * ones, from the daemon's reply to the accept notification. Either way
+ * sendfile and splice then go through kernel crypto with no copies to
+ * or from user space */
+
+/**
+ * Puts the daemon's connection to the peer into kernel TLS and holds on
+ * to it until the application's socket can take it. Runs in the daemon's
+ * context, as it returns the handshake, since fd is in its fd table
+ * @param	sock_data - TLS socket data of the connecting socket
+ * @param	fd - The daemon's descriptor for its connection to the peer
+ * @param	info - Keys and sequence numbers for each direction
+ * @return	0 on success, otherwise an error. The daemon must not use
+ * 		the connection itself after a failure
+ */
+int prepare_ktls(tls_sock_data_t* sock_data, int fd, struct ssa_ktls_info* info) {
+	struct socket* dsock;
+	struct file* file;
+	int ret;
+
+	if (sock_data->unix_sock != NULL) {
+		return -EOPNOTSUPP;
+	}
+	file = fget(fd);
+	if (file == NULL) {
+		return -EBADF;
+	}
+	dsock = sock_from_file(file, &ret);
+	if (dsock == NULL) {
+		fput(file);
+		return ret;
+	}
+	if (dsock->sk->sk_protocol != IPPROTO_TCP || dsock->sk->sk_state != TCP_ESTABLISHED ||
+			!net_eq(sock_net(dsock->sk), sock_data->net)) {
+		fput(file);
+		return -EINVAL;
+	}
+	ret = kernel_setsockopt(dsock, SOL_TCP, TCP_ULP, "tls", sizeof("tls"));
+	if (ret == 0) {
+		ret = kernel_setsockopt(dsock, SOL_TLS, TLS_TX, (char*)&info->tx, sizeof(info->tx));
+	}
+	if (ret == 0) {
+		ret = kernel_setsockopt(dsock, SOL_TLS, TLS_RX, (char*)&info->rx, sizeof(info->rx));
+	}
+	if (ret != 0) {
+		printk(KERN_ALERT "Failed to set up kernel TLS: %d\n", ret);
+		fput(file);
+		return ret;
+	}
+	sock_data->ktls_file = file;
+	return 0;
+}
+
+/**
+ * Swaps the daemon's kernel TLS connection in for the application's
+ * socket. Only call it from the application's own calls on the socket,
+ * or before it has the socket. The application's original sock,
+ * unconnected or connected to the daemon, goes to the daemon's socket.
+ * We keep our reference to that until the application's socket is
+ * freed, as another of its threads may still be using the sock
+ * @param	sock_data - TLS socket data of the application's socket
+ * @param	sock - The application's socket
+ * @return	0 on success, otherwise an error
+ */
+int take_over_ktls(tls_sock_data_t* sock_data, struct socket* sock) {
+	struct socket* dsock;
+	struct sock* old_sk;
+	struct sock* peer_sk;
+	int ret;
+
+	dsock = sock_from_file(sock_data->ktls_file, &ret);
+	old_sk = sock->sk;
+	peer_sk = dsock->sk;
+	/* Receiving through kernel TLS replaces the socket's ops too, and
+	 * the application's socket has to keep ours. The daemon's socket
+	 * gets plain TCP's back, as it now holds a plain TCP sock */
+	sock_data->ktls_ops = dsock->ops;
+	dsock->ops = &inet_stream_ops;
+
+	lock_sock(old_sk);
+	lock_sock_nested(peer_sk, SINGLE_DEPTH_NESTING);
+	sock_graft(peer_sk, sock);
+	sock_graft(old_sk, dsock);
+	sock->state = SS_CONNECTED;
+	dsock->state = SS_UNCONNECTED;
+	release_sock(peer_sk);
+	release_sock(old_sk);
+
+	sock_data->ktls = 1;
+	return 0;
+}
+
+void drop_ktls(tls_sock_data_t* sock_data) {
+	if (sock_data->ktls_file != NULL) {
+		fput(sock_data->ktls_file);
+		sock_data->ktls_file = NULL;
+	}
+	return;
+}
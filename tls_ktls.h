@@ -0,0 +1,13 @@
+#ifndef TLS_KTLS_H
+#define TLS_KTLS_H
+
+#include <linux/net.h>
+#include "tls_common.h"
+
+struct ssa_ktls_info;
+
+int prepare_ktls(tls_sock_data_t* sock_data, int fd, struct ssa_ktls_info* info);
+int take_over_ktls(tls_sock_data_t* sock_data, struct socket* sock);
+void drop_ktls(tls_sock_data_t* sock_data);
+
+#endif /* TLS_KTLS_H */
@@ -0,0 +1,175 @@
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/skbuff.h>
+#include <linux/bpf.h>
+#include <linux/filter.h>
+#include <linux/cgroup.h>
+#include <linux/cred.h>
+#include <linux/sched.h>
+#include <linux/in.h>
+#include <linux/in6.h>
+#include <net/net_namespace.h>
+#include <net/netns/generic.h>
+#include "socktls.h"
+#include "tls_select.h"
+#include "tls_daemon.h"
+#include "tls_common.h"
+
+/* An operator-supplied BPF_PROG_TYPE_SOCKET_FILTER program that picks
+ * daemons. It sees a struct tls_select_ctx as its packet data. Each
+ * network namespace has its own, attached from inside it, so that one
+ * namespace can't steer another's sockets */
+typedef struct selector_net {
+	struct bpf_prog __rcu *prog;
+} selector_net_t;
+
+static unsigned int selector_net_id;
+static int selector_ready;
+static DEFINE_MUTEX(daemon_selector_lock);
+
+static void selector_net_exit(struct net* net);
+
+static struct pernet_operations selector_net_ops = {
+	.exit = selector_net_exit,
+	.id = &selector_net_id,
+	.size = sizeof(selector_net_t),
+};
+
+/* Each CPU keeps an skb to hand the context to the program in, so
+ * that running it needs no allocation */
+static DEFINE_PER_CPU(struct sk_buff*, selector_skbs);
+
+int tls_select_setup(void) {
+	struct sk_buff* skb;
+	int cpu;
+	int ret;
+	for_each_possible_cpu(cpu) {
+		skb = alloc_skb(sizeof(struct tls_select_ctx), GFP_KERNEL);
+		if (skb == NULL) {
+			tls_select_cleanup();
+			return -ENOMEM;
+		}
+		skb_put(skb, sizeof(struct tls_select_ctx));
+		*per_cpu_ptr(&selector_skbs, cpu) = skb;
+	}
+	ret = register_pernet_subsys(&selector_net_ops);
+	if (ret != 0) {
+		tls_select_cleanup();
+		return ret;
+	}
+	selector_ready = 1;
+	return 0;
+}
+
+void tls_select_cleanup(void) {
+	int cpu;
+	/* The namespaces' programs are put by selector_net_exit */
+	if (selector_ready == 1) {
+		selector_ready = 0;
+		unregister_pernet_subsys(&selector_net_ops);
+	}
+	for_each_possible_cpu(cpu) {
+		kfree_skb(*per_cpu_ptr(&selector_skbs, cpu));
+		*per_cpu_ptr(&selector_skbs, cpu) = NULL;
+	}
+	return;
+}
+
+void selector_net_exit(struct net* net) {
+	attach_daemon_selector(net, -1);
+	return;
+}
+
+/**
+ * Replaces a network namespace's daemon selection program
+ * @param	net - The namespace the program is for
+ * @param	prog_fd - File descriptor of the program, in the caller's
+ * 		fd table, or -1 to go back to the daemon_policy alone
+ * @return	0 on success, otherwise an error
+ */
+int attach_daemon_selector(struct net* net, int prog_fd) {
+	selector_net_t* sn = net_generic(net, selector_net_id);
+	struct bpf_prog* prog = NULL;
+	struct bpf_prog* old_prog;
+	if (prog_fd >= 0) {
+		prog = bpf_prog_get_type(prog_fd, BPF_PROG_TYPE_SOCKET_FILTER);
+		if (IS_ERR(prog)) {
+			return PTR_ERR(prog);
+		}
+	}
+	mutex_lock(&daemon_selector_lock);
+	old_prog = rcu_dereference_protected(sn->prog, lockdep_is_held(&daemon_selector_lock));
+	rcu_assign_pointer(sn->prog, prog);
+	mutex_unlock(&daemon_selector_lock);
+	if (old_prog != NULL) {
+		synchronize_rcu();
+		bpf_prog_put(old_prog);
+	}
+	return 0;
+}
+
+/**
+ * Asks the selection program, if one is attached, which daemon a socket
+ * should use
+ * @param	net - The socket's network namespace
+ * @param	hook - One of the TLS_SELECT_* points the decision is made at
+ * @param	addr - The remote (connect) or external (bind) address, or NULL
+ * @param	hostname - The remote hostname, or NULL if not known
+ * @return	The ID of the daemon to use, or -1 to leave it to the policy
+ */
+int select_daemon(struct net* net, int hook, struct sockaddr* addr, char* hostname) {
+	struct tls_select_ctx* ctx;
+	struct bpf_prog* prog;
+	struct sk_buff* skb;
+	u32 index;
+
+	if (selector_ready == 0) {
+		return -1;
+	}
+	rcu_read_lock();
+	prog = rcu_dereference(((selector_net_t*)net_generic(net, selector_net_id))->prog);
+	if (prog == NULL) {
+		rcu_read_unlock();
+		return -1;
+	}
+	skb = *get_cpu_ptr(&selector_skbs);
+	ctx = (struct tls_select_ctx*)skb->data;
+	memset(ctx, 0, sizeof(struct tls_select_ctx));
+	ctx->hook = hook;
+	ctx->pid = task_tgid_nr(current);
+	ctx->uid = from_kuid_munged(&init_user_ns, current_uid());
+	ctx->netns = net->ns.inum;
+#ifdef CONFIG_CGROUPS
+	ctx->cgroup_id = cgroup_id(task_dfl_cgroup(current));
+#endif
+	if (addr != NULL && addr->sa_family == AF_INET) {
+		ctx->family = AF_INET;
+		ctx->port = ((struct sockaddr_in*)addr)->sin_port;
+		memcpy(ctx->addr, &((struct sockaddr_in*)addr)->sin_addr, sizeof(struct in_addr));
+	}
+	else if (addr != NULL && addr->sa_family == AF_INET6) {
+		ctx->family = AF_INET6;
+		ctx->port = ((struct sockaddr_in6*)addr)->sin6_port;
+		memcpy(ctx->addr, &((struct sockaddr_in6*)addr)->sin6_addr, sizeof(struct in6_addr));
+	}
+	else if (addr != NULL && addr->sa_family == AF_HOSTNAME && hostname == NULL) {
+		ctx->family = AF_HOSTNAME;
+		ctx->port = ((struct sockaddr_host*)addr)->sin_port;
+		hostname = ((struct sockaddr_host*)addr)->sin_addr.name;
+	}
+	if (hostname != NULL) {
+		strncpy(ctx->hostname, hostname, sizeof(ctx->hostname) - 1);
+	}
+	index = bpf_prog_run_save_cb(prog, skb);
+	put_cpu_ptr(&selector_skbs);
+	rcu_read_unlock();
+
+	if (index >= MAX_DAEMONS || !daemon_is_active(net, DAEMON_START_PORT + index)) {
+		return -1;
+	}
+	return DAEMON_START_PORT + index;
+}
@@ -0,0 +1,13 @@
+#ifndef TLS_SELECT_H
+#define TLS_SELECT_H
+
+#include <linux/socket.h>
+
+struct net;
+
+int tls_select_setup(void);
+void tls_select_cleanup(void);
+int attach_daemon_selector(struct net* net, int prog_fd);
+int select_daemon(struct net* net, int hook, struct sockaddr* addr, char* hostname);
+
+#endif /* TLS_SELECT_H */
@@ -0,0 +1,217 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/jiffies.h>
+#include <net/net_namespace.h>
+#include <net/netns/generic.h>
+#include "tls_session.h"
+
+/* Client sessions the daemons have made, kept here rather than in the
+ * daemon that made them so that they outlive daemon restarts and any
+ * daemon in the namespace can resume them. The least recently used
+ * session is evicted when the store is full */
+static int session_cache_size = 1024;
+module_param(session_cache_size, int, 0644);
+MODULE_PARM_DESC(session_cache_size, "Client TLS sessions kept for resumption in each network namespace, 0 for none");
+
+#define SESSION_HASH_BITS	8
+#define SESSION_MAX_LEN		16384
+/* The longest a TLS 1.3 ticket may be used for, and the lifetime of
+ * sessions stored without one */
+#define SESSION_LIFETIME_MAX	(7 * 24 * 60 * 60)
+
+struct tls_session {
+	struct hlist_node hash;
+	struct list_head lru;
+	struct ssa_session_key key;
+	u32 key_hash;
+	unsigned long expires;
+	unsigned int len;
+	char data[];
+};
+
+typedef struct session_store {
+	spinlock_t lock;
+	DECLARE_HASHTABLE(sessions, SESSION_HASH_BITS);
+	struct list_head lru; /* most recently used first */
+	int count;
+} session_store_t;
+
+static unsigned int session_net_id;
+static int session_ready;
+
+static int session_net_init(struct net* net);
+static void session_net_exit(struct net* net);
+static void normalize_key(struct ssa_session_key* out, struct ssa_session_key* in);
+static struct tls_session* find_session(session_store_t* store, struct ssa_session_key* key, u32 key_hash);
+static void unlink_session(session_store_t* store, struct tls_session* session);
+
+static struct pernet_operations session_net_ops = {
+	.init = session_net_init,
+	.exit = session_net_exit,
+	.id = &session_net_id,
+	.size = sizeof(session_store_t),
+};
+
+int tls_session_setup(void) {
+	int ret = register_pernet_subsys(&session_net_ops);
+	if (ret == 0) {
+		session_ready = 1;
+	}
+	return ret;
+}
+
+void tls_session_cleanup(void) {
+	if (session_ready == 0) {
+		return;
+	}
+	session_ready = 0;
+	unregister_pernet_subsys(&session_net_ops);
+	return;
+}
+
+int session_net_init(struct net* net) {
+	session_store_t* store = net_generic(net, session_net_id);
+	spin_lock_init(&store->lock);
+	hash_init(store->sessions);
+	INIT_LIST_HEAD(&store->lru);
+	store->count = 0;
+	return 0;
+}
+
+void session_net_exit(struct net* net) {
+	session_store_t* store = net_generic(net, session_net_id);
+	struct tls_session* session;
+	struct tls_session* tmp;
+	list_for_each_entry_safe(session, tmp, &store->lru, lru) {
+		unlink_session(store, session);
+		kfree(session);
+	}
+	return;
+}
+
+/**
+ * Saves a daemon's client session, replacing any saved under the same
+ * key, and evicts the least recently used sessions over the limit
+ * @param	net - The daemon's network namespace
+ * @param	key - The server and configuration the session is for
+ * @param	data - The session, as the daemon serialized it
+ * @param	len - Length of data
+ * @param	lifetime - Seconds the session may be resumed for, or 0 for
+ * 		the longest TLS allows
+ * @return	0 on success, otherwise an error
+ */
+int store_session(struct net* net, struct ssa_session_key* key, char* data, unsigned int len, unsigned int lifetime) {
+	session_store_t* store;
+	struct tls_session* session;
+	struct tls_session* old;
+	LIST_HEAD(evicted);
+
+	if (session_ready == 0 || READ_ONCE(session_cache_size) <= 0) {
+		return -EOPNOTSUPP;
+	}
+	if (len == 0 || len > SESSION_MAX_LEN) {
+		return -EINVAL;
+	}
+	if (lifetime == 0 || lifetime > SESSION_LIFETIME_MAX) {
+		lifetime = SESSION_LIFETIME_MAX;
+	}
+	if ((session = kmalloc(sizeof(struct tls_session) + len, GFP_KERNEL)) == NULL) {
+		printk(KERN_ALERT "kmalloc failed in store_session\n");
+		return -ENOMEM;
+	}
+	normalize_key(&session->key, key);
+	session->key_hash = jhash(&session->key, sizeof(session->key), 0);
+	session->expires = jiffies + lifetime * HZ;
+	session->len = len;
+	memcpy(session->data, data, len);
+
+	store = net_generic(net, session_net_id);
+	spin_lock(&store->lock);
+	old = find_session(store, &session->key, session->key_hash);
+	if (old != NULL) {
+		unlink_session(store, old);
+		list_add(&old->lru, &evicted);
+	}
+	hash_add(store->sessions, &session->hash, session->key_hash);
+	list_add(&session->lru, &store->lru);
+	store->count++;
+	while (store->count > READ_ONCE(session_cache_size)) {
+		old = list_last_entry(&store->lru, struct tls_session, lru);
+		unlink_session(store, old);
+		list_add(&old->lru, &evicted);
+	}
+	spin_unlock(&store->lock);
+
+	list_for_each_entry_safe(session, old, &evicted, lru) {
+		kfree(session);
+	}
+	return 0;
+}
+
+/**
+ * Looks up a saved client session for a daemon to resume
+ * @param	net - The daemon's network namespace
+ * @param	key - The server and configuration to resume a session with
+ * @param	data - Set to a copy of the session, which the caller frees
+ * @return	The length of the session, or -ENOENT if there's none
+ */
+int fetch_session(struct net* net, struct ssa_session_key* key, char** data) {
+	session_store_t* store;
+	struct tls_session* session;
+	struct tls_session* expired = NULL;
+	struct ssa_session_key norm;
+	int ret = -ENOENT;
+
+	if (session_ready == 0) {
+		return -ENOENT;
+	}
+	normalize_key(&norm, key);
+	store = net_generic(net, session_net_id);
+	spin_lock(&store->lock);
+	session = find_session(store, &norm, jhash(&norm, sizeof(norm), 0));
+	if (session != NULL && time_after_eq(jiffies, session->expires)) {
+		unlink_session(store, session);
+		expired = session;
+	}
+	else if (session != NULL) {
+		list_move(&session->lru, &store->lru);
+		*data = kmemdup(session->data, session->len, GFP_ATOMIC);
+		ret = *data != NULL ? session->len : -ENOMEM;
+	}
+	spin_unlock(&store->lock);
+	kfree(expired);
+	return ret;
+}
+
+/* Keys are hashed and compared whole, so whatever follows the hostname
+ * is zeroed */
+void normalize_key(struct ssa_session_key* out, struct ssa_session_key* in) {
+	memset(out, 0, sizeof(struct ssa_session_key));
+	out->config_id = in->config_id;
+	out->port = in->port;
+	strscpy(out->hostname, in->hostname, sizeof(out->hostname));
+	return;
+}
+
+struct tls_session* find_session(session_store_t* store, struct ssa_session_key* key, u32 key_hash) {
+	struct tls_session* session;
+	hash_for_each_possible(store->sessions, session, hash, key_hash) {
+		if (session->key_hash == key_hash && memcmp(&session->key, key, sizeof(struct ssa_session_key)) == 0) {
+			return session;
+		}
+	}
+	return NULL;
+}
+
+void unlink_session(session_store_t* store, struct tls_session* session) {
+	hash_del(&session->hash);
+	list_del(&session->lru);
+	store->count--;
+	return;
+}
@@ -0,0 +1,13 @@
+#ifndef TLS_SESSION_H
+#define TLS_SESSION_H
+
+#include "netlink.h"
+
+struct net;
+
+int tls_session_setup(void);
+void tls_session_cleanup(void);
+int store_session(struct net* net, struct ssa_session_key* key, char* data, unsigned int len, unsigned int lifetime);
+int fetch_session(struct net* net, struct ssa_session_key* key, char** data);
+
+#endif /* TLS_SESSION_H */
@@ -3,6 +3,8 @@
 #include <net/inet_common.h>
 #include "tls_unix.h"
 #include "tls_common.h"
+#include "tls_daemon.h"
+#include "tls_admit.h"
 #include "netlink.h"
 
 /* TLS functions for Unix domain sockets */
@@ -14,7 +16,7 @@ int tls_unix_listen(struct socket *sock, int backlog);
 int tls_unix_accept(struct socket *sock, struct socket *newsock, int flags, bool kern);
 int tls_unix_setsockopt(struct socket *sock, int level, int optname, char __user *optval, unsigned int optlen);
 int tls_unix_getsockopt(struct socket *sock, int level, int optname, char __user *optval, int __user *optlen);
-//int tls_unix_getname(struct socket *sock, struct sockaddr *uaddr, int *uaddr_len, int peer);
+int tls_unix_getname(struct socket *sock, struct sockaddr *uaddr, int *uaddr_len, int peer);
 unsigned int tls_unix_poll(struct file *file, struct socket *sock, struct poll_table_struct *wait);
 int tls_unix_ioctl(struct socket *sock, unsigned int cmd, unsigned long arg);
 int tls_unix_shutdown(struct socket *sock, int how);
@@ -23,6 +25,8 @@ int tls_unix_recvmsg(struct socket *sock, struct msghdr *msg, size_t size, int f
 ssize_t tls_unix_sendpage(struct socket *sock, struct page *page, int offset, size_t size, int flags);
 ssize_t tls_unix_splice_read(struct socket *sk, loff_t *ppos, struct pipe_inode_info *pipe, size_t len, unsigned int flags);
 
+static void set_daemon_name(struct sockaddr_un* addr, int* addrlen, int daemon_id);
+
 static struct proto_ops ref_unix_stream_ops;
 static struct proto ref_unix_prot;
 
@@ -55,7 +59,7 @@ int set_tls_prot_unix_stream(struct proto* tls_prot, struct proto_ops* tls_proto
 	tls_proto_ops->getsockopt = tls_unix_getsockopt;
 	/* INET ops have no socketpair, so we're emulating that */
 	tls_proto_ops->socketpair = sock_no_socketpair;
-	//tls_proto_ops->getname = tls_unix_getname;
+	tls_proto_ops->getname = tls_unix_getname;
 	tls_proto_ops->poll = tls_unix_poll;
 	tls_proto_ops->ioctl = tls_unix_ioctl;
 	tls_proto_ops->shutdown = tls_unix_shutdown;
@@ -85,6 +89,7 @@ int tls_unix_init_sock(struct sock *sk) {
 
 	if ((sock_data = kmalloc(sizeof(tls_sock_data_t), GFP_KERNEL)) == NULL) {
 		printk(KERN_ALERT "kmalloc failed in tls_unix_init_sock\n");
+		sock_release(unix_sock);
 		return -1;
 	}
 	
@@ -95,39 +100,46 @@ int tls_unix_init_sock(struct sock *sk) {
 	
 	sock_data->key = (unsigned long)sk->sk_socket;
 	sock_data->unix_sock = unix_sock;
-	sock_data->daemon_id = DAEMON_START_PORT;
-	//sock_data->daemon_id = DAEMON_START_PORT + (balancer % nr_cpu_ids);
+	sock_data->net = sock_net(sk);
+	sock_data->daemon_id = assign_daemon(sock_data->net);
+	if (sock_data->daemon_id < 0) {
+		ret = sock_data->daemon_id;
+		kfree(sock_data);
+		sock_release(unix_sock);
+		return ret;
+	}
 	//printk(KERN_INFO "Assigning new socket to daemon %d\n", sock_data->daemon_id);
-	//balancer = (balancer+1) % nr_cpu_ids;
 	init_completion(&sock_data->sock_event);
+	spin_lock_init(&sock_data->rdata_lock);
 	put_tls_sock_data(sock_data->key, &sock_data->hash);
 	
 	comm_ptr = get_full_comm(comm, NAME_MAX);
 
-	send_socket_notification(sock_data->key, comm_ptr, sock_data->daemon_id);
-	wait_for_completion_timeout(&sock_data->sock_event, RESPONSE_TIMEOUT);
-	/* We're not checking daemon return values here because init_sock needs to return
-	 * at this point anyway 0 */
+	/* init_sock needs to return 0 at this point anyway, so there's no
+	 * point waiting for the daemon's ack */
+	sock_data->unacked_seq = next_notify_seq();
+	send_socket_notification(sock_data->net, sock_data->key, comm_ptr, sock_data->unacked_seq, sock_data->daemon_id);
 	return 0;
 }
 
 int tls_unix_release(struct socket* sock) {
+	struct sock* sk = sock->sk;
 	tls_sock_data_t* sock_data = get_tls_sock_data((unsigned long)sock);
-	if (sock_data == NULL) {
-		/* Since inet_create creates our sockets, we use inet_release
-		 * to free them */
-		//return inet_release(sock);
-		return 0;
+	if (sock_data != NULL) {
+		send_close_notification(sock_data->net, sock_data->key, sock_data->daemon_id);
+		//wait_for_completion_timeout(&sock_data->sock_event, RESPONSE_TIMEOUT);
+		daemon_socket_removed(sock_data->net, sock_data->daemon_id);
+		rem_tls_sock_data(&sock_data->hash);
+		sock_release(sock_data->unix_sock);
+		free_tls_sock_data(sock_data);
 	}
-	send_close_notification(sock_data->key, sock_data->daemon_id);
-	//wait_for_completion_timeout(&sock_data->sock_event, RESPONSE_TIMEOUT);
-	if (sock_data->hostname != NULL) {
-		kfree(sock_data->hostname);
+	/* The sock inet_create gave us only holds socket-level options, and
+	 * has no close of its own for inet_release to call */
+	if (sk != NULL) {
+		sock->sk = NULL;
+		sock_orphan(sk);
+		sock_put(sk);
 	}
-	rem_tls_sock_data(&sock_data->hash);
-	kfree(sock_data);
-	ref_unix_stream_ops.release(sock_data->unix_sock);
-	//return inet_release(sock);
 	return 0;
 }
 
@@ -153,8 +165,18 @@ int tls_unix_bind(struct socket *sock, struct sockaddr *uaddr, int addr_len) {
 	 * it for us */
 	memcpy(&sock_data->int_addr, unix_sk(unix_sock->sk)->addr->name, sizeof(sa_family_t) + 6);
 
-	send_bind_notification((unsigned long)sock, &sock_data->int_addr, (struct sockaddr*)uaddr, sock_data->daemon_id);
-	if (wait_for_completion_timeout(&sock_data->sock_event, RESPONSE_TIMEOUT) == 0) {
+	/* The daemon is about to hold state for this socket */
+	ret = migrate_if_draining(sock_data);
+	if (ret != 0) {
+		return ret;
+	}
+	ret = route_by_selector(sock_data, TLS_SELECT_BIND, uaddr);
+	if (ret < 0) {
+		return ret;
+	}
+	pin_to_daemon(sock_data, sock);
+	send_bind_notification(sock_data->net, (unsigned long)sock, &sock_data->int_addr, (struct sockaddr*)uaddr, sock_data->daemon_id);
+	if (wait_for_daemon(sock_data, RESPONSE_TIMEOUT) == 0) {
 		/* Let's lie to the application if the daemon isn't responding */
 		return -EADDRINUSE;
 	}
@@ -170,11 +192,11 @@ int tls_unix_bind(struct socket *sock, struct sockaddr *uaddr, int addr_len) {
 
 int tls_unix_connect(struct socket *sock, struct sockaddr *uaddr, int addr_len, int flags) {
 	int ret;
+	int blocking;
 	int reroute_addrlen;
 	struct socket* unix_sock;
-	struct sockaddr_un reroute_addr = {
-		.sun_family = AF_UNIX,
-	};
+	struct admission_owner* admission;
+	struct sockaddr_un reroute_addr;
 
 	struct sockaddr_un int_addr = {
 		.sun_family = AF_UNIX
@@ -183,6 +205,31 @@ int tls_unix_connect(struct socket *sock, struct sockaddr *uaddr, int addr_len,
 	/* Save original destination address information */
 	tls_sock_data_t* sock_data = get_tls_sock_data((unsigned long)sock);
 	unix_sock = sock_data->unix_sock;
+	blocking = (flags & O_NONBLOCK) == 0;
+	if (unix_sock->state == SS_CONNECTED) {
+		return -EISCONN;
+	}
+	if (sock_data->connect_state == CONNECT_HANDSHAKING) {
+		if (blocking == 0 || sock_data->connect_blocking != 0) {
+			return -EALREADY;
+		}
+		/* Restarted after a signal, or a blocking connect behind a
+		 * nonblocking one. unix_trigger_connect moves it on */
+		ret = wait_event_interruptible(*sk_sleep(unix_sock->sk),
+				READ_ONCE(sock_data->connect_state) != CONNECT_HANDSHAKING);
+		if (ret != 0) {
+			return ret;
+		}
+		/* As with TCP, the first connect after the one under way
+		 * completes reports how it went */
+		if (sock_data->connect_state == CONNECT_DONE) {
+			return 0;
+		}
+	}
+	if (sock_data->connect_state == CONNECT_FAILED) {
+		ret = sock_error(sock->sk);
+		return ret != 0 ? ret : -ECONNABORTED;
+	}
 	sock_data->rem_addr = (struct sockaddr)(*uaddr);
 	sock_data->rem_addrlen = addr_len;
 
@@ -196,29 +243,77 @@ int tls_unix_connect(struct socket *sock, struct sockaddr *uaddr, int addr_len,
 		sock_data->is_bound = 1;
 	}
 
-	send_connect_notification((unsigned long)sock, &sock_data->int_addr, uaddr, sock_data->daemon_id,1);
-	if (wait_for_completion_timeout(&sock_data->sock_event, RESPONSE_TIMEOUT) == 0) {
+	/* The daemon is about to hold state for this socket */
+	ret = migrate_if_draining(sock_data);
+	if (ret != 0) {
+		return ret;
+	}
+	ret = route_by_selector(sock_data, TLS_SELECT_CONNECT, uaddr);
+	if (ret == 0) {
+		ret = route_by_destination(sock_data, uaddr);
+	}
+	if (ret < 0) {
+		return ret;
+	}
+	pin_to_daemon(sock_data, sock);
+	ret = admit_handshake(sock_data->net, sock_data->daemon_id, blocking, &admission);
+	if (ret != 0) {
+		return ret;
+	}
+
+	sock_data->connect_blocking = blocking;
+	sock_data->connect_seq = next_notify_seq();
+	sock_data->connect_state = CONNECT_HANDSHAKING;
+
+	if (blocking == 0) {
+		/* The handshake finishing connects us, in unix_trigger_connect */
+		sock_data->admission = admission;
+		sock_data->connect_ack_pending = 1;
+		send_connect_notification(sock_data->net, (unsigned long)sock, &sock_data->int_addr, uaddr, blocking,
+				0, NULL, 0, sock_data->connect_seq, sock_data->daemon_id);
+		return -EINPROGRESS;
+	}
+
+	/* Blocking case. As for INET, a signal doesn't have to wait out
+	 * the handshake: the callback then finishes the connect as it
+	 * would a nonblocking one, and the restarted connect waits for that */
+	sock_data->admission = admission;
+	send_connect_notification(sock_data->net, (unsigned long)sock, &sock_data->int_addr, uaddr, blocking,
+			0, NULL, 0, sock_data->connect_seq, sock_data->daemon_id);
+	ret = wait_for_daemon_interruptible(sock_data, HANDSHAKE_TIMEOUT);
+	if (ret == -ERESTARTSYS) {
+		if (cmpxchg(&sock_data->connect_blocking, 1, 0) == 1) {
+			return -ERESTARTSYS;
+		}
+		/* The reply beat the signal */
+		wait_for_completion(&sock_data->sock_event);
+		ret = 1;
+	}
+	finish_handshake(sock_data->net, sock_data->daemon_id, sock_data->admission);
+	sock_data->admission = NULL;
+	if (ret == 0) {
+		sock_data->connect_seq = 0;
+		sock_data->connect_state = CONNECT_IDLE;
 		/* Let's lie to the application if the daemon isn't responding */
 		return -EHOSTUNREACH;
 	}
 	if (sock_data->response != 0) {
+		sock_data->connect_state = CONNECT_IDLE;
 		return sock_data->response;
 	}
 
-	reroute_addrlen = sprintf(reroute_addr.sun_path+1, "%d", sock_data->daemon_id) + 1 + sizeof(sa_family_t);
-	printk(KERN_INFO "sock is redirected to %s\n", reroute_addr.sun_path+1);
+	set_daemon_name(&reroute_addr, &reroute_addrlen, sock_data->daemon_id);
 	ret = ref_unix_stream_ops.connect(unix_sock, ((struct sockaddr*)&reroute_addr), reroute_addrlen, flags);
-	if (ret != 0) {
-		return ret;
-	}
-	return 0;
+	sock_data->connect_state = ret == 0 ? CONNECT_DONE : CONNECT_IDLE;
+	return ret;
 }
 
 int tls_unix_listen(struct socket *sock, int backlog) {
+	int ret;
 	struct socket* unix_sock;
 	tls_sock_data_t* sock_data = get_tls_sock_data((unsigned long)sock);
         struct sockaddr_un int_addr = {
-                .sun_family = AF_INET,
+                .sun_family = AF_UNIX,
         };
 
 	unix_sock = sock_data->unix_sock;
@@ -230,12 +325,18 @@ int tls_unix_listen(struct socket *sock, int backlog) {
 		memcpy(&sock_data->int_addr, unix_sk(unix_sock->sk)->addr->name, sock_data->int_addrlen);
 		sock_data->is_bound = 1;
 	}
-	send_listen_notification((unsigned long)sock, 
+	/* The daemon is about to hold state for this socket */
+	ret = migrate_if_draining(sock_data);
+	if (ret != 0) {
+		return ret;
+	}
+	pin_to_daemon(sock_data, sock);
+	send_listen_notification(sock_data->net, (unsigned long)sock, 
 			(struct sockaddr*)&sock_data->int_addr,
 		        (struct sockaddr*)&sock_data->ext_addr,
 			sock_data->daemon_id);
 
-	if (wait_for_completion_timeout(&sock_data->sock_event, RESPONSE_TIMEOUT) == 0) {
+	if (wait_for_daemon(sock_data, RESPONSE_TIMEOUT) == 0) {
 		/* Let's lie to the application if the daemon isn't responding */
 		return -EADDRINUSE;
 	}
@@ -245,15 +346,85 @@ int tls_unix_listen(struct socket *sock, int backlog) {
 	return ref_unix_stream_ops.listen(unix_sock, backlog);
 }
 
-/* XXX Unix development has essentially halted since it didn't
- * seem to enhance performance. the accept method, and maybe some
- * others, will need to be updated to reflect current inet practices
- * if it is to be used again */
+/* The daemon connects to the listener's internal socket once it has done
+ * the handshake. The connection it makes becomes the internal socket of
+ * newsock, which is given a sock of its own like any other TLS socket */
 int tls_unix_accept(struct socket *sock, struct socket *newsock, int flags, bool kern) {
-	struct socket* unix_sock;
-	tls_sock_data_t* sock_data = get_tls_sock_data((unsigned long)sock);
-	unix_sock = sock_data->unix_sock;
-	return ref_unix_stream_ops.accept(unix_sock, newsock, flags, kern);
+	tls_sock_data_t* listen_sock_data;
+	tls_sock_data_t* sock_data;
+	struct socket* new_unix_sock;
+	struct unix_address* addr;
+	struct sock* peer;
+	struct sock* newsk;
+	int ret;
+
+	listen_sock_data = get_tls_sock_data((unsigned long)sock);
+	if (listen_sock_data == NULL) {
+		return -EBADF;
+	}
+	ret = sock_create_lite(PF_UNIX, SOCK_STREAM, 0, &new_unix_sock);
+	if (ret != 0) {
+		return ret;
+	}
+	new_unix_sock->ops = listen_sock_data->unix_sock->ops;
+	ret = ref_unix_stream_ops.accept(listen_sock_data->unix_sock, new_unix_sock, flags, kern);
+	if (ret != 0) {
+		sock_release(new_unix_sock);
+		return ret;
+	}
+
+	newsk = sk_alloc(sock_net(sock->sk), PF_INET, GFP_KERNEL, sock->sk->sk_prot, kern);
+	if (newsk == NULL) {
+		sock_release(new_unix_sock);
+		return -ENOMEM;
+	}
+	sock_init_data(newsock, newsk);
+	newsk->sk_protocol = IPPROTO_TLS;
+
+	if ((sock_data = kmalloc(sizeof(tls_sock_data_t), GFP_KERNEL)) == NULL) {
+		printk(KERN_ALERT "kmalloc failed in tls_unix_accept\n");
+		sock_release(new_unix_sock);
+		return -ENOMEM;
+	}
+	memset(sock_data, 0, sizeof(tls_sock_data_t));
+
+	sock_data->net = listen_sock_data->net;
+	sock_data->daemon_id = listen_sock_data->daemon_id;
+	daemon_socket_added(sock_data->net, sock_data->daemon_id);
+	/* The listener's daemon owns the connection */
+	sock_data->pinned = 1;
+	/* The daemon only connects to us once its handshake is done */
+	sock_data->handshake_done = 1;
+	sock_data->connect_state = CONNECT_DONE;
+	sock_data->key = (unsigned long)newsock;
+	sock_data->unix_sock = new_unix_sock;
+	sock_data->is_bound = 1;
+	sock_data->ext_addr = listen_sock_data->ext_addr;
+	sock_data->ext_addrlen = listen_sock_data->ext_addrlen;
+	init_completion(&sock_data->sock_event);
+	spin_lock_init(&sock_data->rdata_lock);
+	put_tls_sock_data(sock_data->key, &sock_data->hash);
+
+	/* The daemon knows the connection by the name its end was bound to */
+	sock_data->int_addr.sa_family = AF_UNIX;
+	sock_data->int_addrlen = sizeof(sa_family_t);
+	unix_state_lock(new_unix_sock->sk);
+	peer = unix_sk(new_unix_sock->sk)->peer;
+	addr = peer != NULL ? unix_sk(peer)->addr : NULL;
+	if (addr != NULL) {
+		sock_data->int_addrlen = min_t(int, addr->len, sizeof(sock_data->int_addr));
+		memcpy(&sock_data->int_addr, addr->name, sock_data->int_addrlen);
+	}
+	unix_state_unlock(new_unix_sock->sk);
+
+	/* Kernel TLS isn't available over unix sockets, so there's never
+	 * a handover to wait for */
+	if (queue_accept_notification(sock_data->net, (unsigned long)newsock, &sock_data->int_addr, sock_data->daemon_id) != 0) {
+		send_accept_notification(sock_data->net, (unsigned long)newsock, &sock_data->int_addr, 0, sock_data->daemon_id);
+		wait_for_daemon(sock_data, RESPONSE_TIMEOUT);
+	}
+	newsock->state = SS_CONNECTED;
+	return 0;
 }
 
 int tls_unix_setsockopt(struct socket *sock, int level, int optname, char __user *optval, unsigned int optlen) {
@@ -270,19 +441,56 @@ int tls_unix_getsockopt(struct socket *sock, int level, int optname, char __user
 	return tls_common_getsockopt(sock_data, unix_sock, level, optname, optval, optlen, NULL);
 }
 
-//int tls_unix_getname(struct socket *sock, struct sockaddr *uaddr, int *uaddr_len, int peer) {
-	//struct socket* unix_sock;
-	//tls_sock_data_t* sock_data = get_tls_sock_data((unsigned long)sock);
-	//unix_sock = sock_data->unix_sock;
-	//return ref_unix_stream_ops.getname(unix_sock, uaddr, uaddr_len, peer);
-//}
+/* The internal socket's names are the daemon's business. Applications
+ * see the addresses they bound and connected to */
+int tls_unix_getname(struct socket *sock, struct sockaddr *uaddr, int *uaddr_len, int peer) {
+	tls_sock_data_t* sock_data = get_tls_sock_data((unsigned long)sock);
+	if (peer) {
+		if (sock_data->unix_sock->state != SS_CONNECTED) {
+			return -ENOTCONN;
+		}
+		*uaddr_len = min_t(int, sock_data->rem_addrlen, sizeof(sock_data->rem_addr));
+		memcpy(uaddr, &sock_data->rem_addr, *uaddr_len);
+		return 0;
+	}
+	if (sock_data->ext_addrlen == 0) {
+		memset(uaddr, 0, sizeof(struct sockaddr_in));
+		uaddr->sa_family = AF_INET;
+		*uaddr_len = sizeof(struct sockaddr_in);
+		return 0;
+	}
+	*uaddr_len = min_t(int, sock_data->ext_addrlen, sizeof(sock_data->ext_addr));
+	memcpy(uaddr, &sock_data->ext_addr, *uaddr_len);
+	return 0;
+}
 
 unsigned int tls_unix_poll(struct file *file, struct socket *sock, struct poll_table_struct *wait) {
+	unsigned int mask;
 	struct socket* unix_sock;
 	tls_sock_data_t* sock_data = get_tls_sock_data((unsigned long)sock);
 	unix_sock = sock_data->unix_sock;
-	/* Uh oh. File XXX?*/
-	return ref_unix_stream_ops.poll(file, unix_sock, wait);
+	/* The internal socket isn't connected until the daemon's handshake
+	 * is done, and looks hung up until then */
+	if (READ_ONCE(sock_data->connect_state) == CONNECT_HANDSHAKING) {
+		poll_wait(file, sk_sleep(unix_sock->sk), wait);
+		if (READ_ONCE(sock_data->connect_state) == CONNECT_HANDSHAKING) {
+			return 0;
+		}
+	}
+	if (sock->sk->sk_err != 0) {
+		return POLLERR | POLLHUP;
+	}
+	mask = ref_unix_stream_ops.poll(file, unix_sock, wait);
+	/* A nonblocking setsockopt is repeated once it's writable. An
+	 * unconnected socket also looks hung up, which would end the
+	 * wait early */
+	if (READ_ONCE(sock_data->opt_waiting) == 1) {
+		mask &= ~(POLLOUT | POLLWRNORM);
+		if (unix_sock->state == SS_UNCONNECTED) {
+			mask &= ~POLLHUP;
+		}
+	}
+	return mask;
 }
 
 int tls_unix_ioctl(struct socket *sock, unsigned int cmd, unsigned long arg) {
@@ -327,7 +535,43 @@ ssize_t tls_unix_splice_read(struct socket *sk, loff_t *ppos, struct pipe_inode_
 	return ref_unix_stream_ops.splice_read(unix_sock, ppos, pipe, len, flags);
 }
 
+/* Finishes a nonblocking connect once the daemon has done the handshake.
+ * Unix connects complete at once, so the socket is usable as soon as
+ * pollers are woken */
 void unix_trigger_connect(struct socket* sock, int daemon_id) {
-	/* XXX construct this after redoing tls_unix_connect after TCP fashion */
+	struct sockaddr_un reroute_addr;
+	int reroute_addrlen;
+	int ret;
+	tls_sock_data_t* sock_data = get_tls_sock_data((unsigned long)sock);
+	if (sock_data == NULL) {
+		return;
+	}
+	ret = sock_data->response;
+	if (ret == 0) {
+		set_daemon_name(&reroute_addr, &reroute_addrlen, daemon_id);
+		ret = ref_unix_stream_ops.connect(sock_data->unix_sock, (struct sockaddr*)&reroute_addr,
+				reroute_addrlen, O_NONBLOCK);
+	}
+	if (ret != 0) {
+		sock->sk->sk_err = -ret;
+		sock_data->connect_state = CONNECT_FAILED;
+	}
+	else {
+		sock_data->connect_state = CONNECT_DONE;
+	}
+	wake_up_interruptible_all(sk_sleep(sock_data->unix_sock->sk));
+	return;
+}
+
+/**
+ * Fills in the abstract address a daemon listens on in unix mode
+ * @param	addr - Address to fill in
+ * @param	addrlen - Set to the length of the address
+ * @param	daemon_id - The daemon's ID
+ */
+void set_daemon_name(struct sockaddr_un* addr, int* addrlen, int daemon_id) {
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	*addrlen = sprintf(addr->sun_path + 1, "%d", daemon_id) + 1 + sizeof(sa_family_t);
 	return;
 }
@@ -0,0 +1,312 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/workqueue.h>
+#include <linux/in.h>
+#include <linux/net.h>
+#include <net/sock.h>
+#include <net/tcp.h>
+#include <net/inet_sock.h>
+#include <net/net_namespace.h>
+#include <net/netns/generic.h>
+#include <linux/security.h>
+#include "tls_warm.h"
+#include "tls_common.h"
+#include "tls_daemon.h"
+#include "tls_inet.h"
+
+/* Connections to each daemon opened ahead of time, so that a connect
+ * whose handshake is done only has to attach one rather than open a
+ * new loopback connection and wait for the daemon to accept it. The
+ * daemon accepts these as they're opened and holds them, unattached,
+ * until a connect notification marked SSA_NL_A_POOLED names the
+ * internal address of one of them */
+static int warm_pool_size = 0;
+module_param(warm_pool_size, int, 0644);
+MODULE_PARM_DESC(warm_pool_size, "Idle connections kept open to each daemon, 0 for none (loopback TCP only)");
+
+struct warm_conn {
+	struct list_head list;
+	struct socket* sock;
+};
+
+typedef struct warm_pool {
+	spinlock_t lock;
+	struct list_head conns[MAX_DAEMONS];
+	int counts[MAX_DAEMONS];
+	struct work_struct refill;
+	struct net* net;
+} warm_pool_t;
+
+static unsigned int warm_pool_net_id;
+static int warm_ready;
+/* Refills open connections and may wait on memory, so they get their
+ * own unbound workqueue rather than holding up system_wq */
+static struct workqueue_struct* warm_wq;
+
+static int warm_pool_net_init(struct net* net);
+static void warm_pool_net_exit(struct net* net);
+static void refill_warm_pool_work(struct work_struct* work);
+static struct socket* open_warm_connection(struct net* net, int daemon_id);
+static struct socket* pop_warm_connection(warm_pool_t* pool, int n);
+
+static struct pernet_operations warm_pool_net_ops = {
+	.init = warm_pool_net_init,
+	.exit = warm_pool_net_exit,
+	.id = &warm_pool_net_id,
+	.size = sizeof(warm_pool_t),
+};
+
+int tls_warm_setup(void) {
+	int ret;
+	warm_wq = alloc_workqueue("ssa_warm", WQ_UNBOUND, 0);
+	if (warm_wq == NULL) {
+		return -ENOMEM;
+	}
+	ret = register_pernet_subsys(&warm_pool_net_ops);
+	if (ret != 0) {
+		destroy_workqueue(warm_wq);
+		warm_wq = NULL;
+		return ret;
+	}
+	warm_ready = 1;
+	return 0;
+}
+
+void tls_warm_cleanup(void) {
+	if (warm_ready == 0) {
+		return;
+	}
+	warm_ready = 0;
+	unregister_pernet_subsys(&warm_pool_net_ops);
+	destroy_workqueue(warm_wq);
+	warm_wq = NULL;
+	return;
+}
+
+int warm_pool_net_init(struct net* net) {
+	warm_pool_t* pool = net_generic(net, warm_pool_net_id);
+	int n;
+	spin_lock_init(&pool->lock);
+	for (n = 0; n < MAX_DAEMONS; n++) {
+		INIT_LIST_HEAD(&pool->conns[n]);
+		pool->counts[n] = 0;
+	}
+	INIT_WORK(&pool->refill, refill_warm_pool_work);
+	pool->net = net;
+	return 0;
+}
+
+void warm_pool_net_exit(struct net* net) {
+	warm_pool_t* pool = net_generic(net, warm_pool_net_id);
+	int n;
+	cancel_work_sync(&pool->refill);
+	for (n = 0; n < MAX_DAEMONS; n++) {
+		drain_warm_pool(net, DAEMON_START_PORT + n);
+	}
+	return;
+}
+
+/**
+ * Tops up the pools of all active daemons in the background. Called when
+ * a daemon registers and whenever a connection is taken
+ * @param	net - The daemons' network namespace
+ */
+void refill_warm_pool(struct net* net) {
+	if (warm_ready == 0 || READ_ONCE(warm_pool_size) <= 0) {
+		return;
+	}
+	queue_work(warm_wq, &((warm_pool_t*)net_generic(net, warm_pool_net_id))->refill);
+	return;
+}
+
+/**
+ * Closes a daemon's idle connections, as it goes away
+ * @param	net - The daemon's network namespace
+ * @param	daemon_id - The daemon's ID
+ */
+void drain_warm_pool(struct net* net, int daemon_id) {
+	warm_pool_t* pool;
+	struct socket* sock;
+	int n = daemon_id - DAEMON_START_PORT;
+	if (warm_ready == 0 || n < 0 || n >= MAX_DAEMONS) {
+		return;
+	}
+	pool = net_generic(net, warm_pool_net_id);
+	while ((sock = pop_warm_connection(pool, n)) != NULL) {
+		sock_release(sock);
+	}
+	return;
+}
+
+/**
+ * Takes an established connection to a daemon out of its pool
+ * @param	net - The daemon's network namespace
+ * @param	daemon_id - The daemon to connect to
+ * @return	The connection, or NULL if the pool is empty
+ */
+struct socket* take_warm_connection(struct net* net, int daemon_id) {
+	warm_pool_t* pool;
+	struct socket* sock;
+	int n = daemon_id - DAEMON_START_PORT;
+	if (warm_ready == 0 || n < 0 || n >= MAX_DAEMONS) {
+		return NULL;
+	}
+	pool = net_generic(net, warm_pool_net_id);
+	while ((sock = pop_warm_connection(pool, n)) != NULL) {
+		/* The daemon may have closed it while it sat idle, or, as
+		 * it's connected without waiting, it may not be up yet */
+		if (sock->sk->sk_state == TCP_ESTABLISHED) {
+			break;
+		}
+		sock_release(sock);
+	}
+	refill_warm_pool(net);
+	return sock;
+}
+
+/**
+ * Puts a pooled connection behind the application's socket as its
+ * internal leg, which the socket's data then goes through, with the same
+ * rule about where to call it from as take_over_ktls. The application's
+ * own sock stays in place, unconnected, so the socket is still a TLS one
+ * to anyone who asks. The pooled sock was made by the refill work, so
+ * it's given the owner, security label, cgroup and socket options of the
+ * application's
+ * @param	sock_data - TLS socket data of the application's socket
+ * @param	sock - The application's socket
+ * @return	0 on success, otherwise an error
+ */
+int attach_warm_connection(tls_sock_data_t* sock_data, struct socket* sock) {
+	struct sock* sk = sock->sk;
+	struct sock* warm_sk = sock_data->warm_sock->sk;
+
+	lock_sock(sk);
+	lock_sock_nested(warm_sk, SINGLE_DEPTH_NESTING);
+	warm_sk->sk_uid = sk->sk_uid;
+	security_sk_clone(sk, warm_sk);
+#ifdef CONFIG_SOCK_CGROUP_DATA
+	/* Each sock holds a reference on its cgroup, which it drops when
+	 * freed, so swapping them keeps the counts right */
+	swap(warm_sk->sk_cgrp_data, sk->sk_cgrp_data);
+#endif
+	/* Options the application set before connecting */
+	warm_sk->sk_mark = sk->sk_mark;
+	warm_sk->sk_priority = sk->sk_priority;
+	warm_sk->sk_rcvtimeo = sk->sk_rcvtimeo;
+	warm_sk->sk_sndtimeo = sk->sk_sndtimeo;
+	if (sk->sk_userlocks & SOCK_SNDBUF_LOCK) {
+		warm_sk->sk_sndbuf = sk->sk_sndbuf;
+	}
+	if (sk->sk_userlocks & SOCK_RCVBUF_LOCK) {
+		warm_sk->sk_rcvbuf = sk->sk_rcvbuf;
+	}
+	warm_sk->sk_userlocks |= sk->sk_userlocks & (SOCK_SNDBUF_LOCK | SOCK_RCVBUF_LOCK);
+	tcp_sk(warm_sk)->nonagle = tcp_sk(sk)->nonagle;
+	/* The leg's events wake whoever waits on the application's socket.
+	 * The pooled socket is released before the application's is, and
+	 * lets go of the queue when it is */
+	rcu_assign_pointer(warm_sk->sk_wq, rcu_dereference_protected(sk->sk_wq, 1));
+	sock->state = SS_CONNECTED;
+	release_sock(warm_sk);
+	release_sock(sk);
+	return 0;
+}
+
+void drop_warm_connection(tls_sock_data_t* sock_data) {
+	if (sock_data->warm_sock != NULL) {
+		sock_release(sock_data->warm_sock);
+		sock_data->warm_sock = NULL;
+	}
+	return;
+}
+
+void refill_warm_pool_work(struct work_struct* work) {
+	warm_pool_t* pool = container_of(work, warm_pool_t, refill);
+	struct warm_conn* conn;
+	struct socket* sock;
+	int n;
+
+	for (n = 0; n < MAX_DAEMONS; n++) {
+		while (daemon_is_active(pool->net, DAEMON_START_PORT + n) &&
+				READ_ONCE(pool->counts[n]) < READ_ONCE(warm_pool_size)) {
+			conn = kmalloc(sizeof(struct warm_conn), GFP_KERNEL);
+			if (conn == NULL) {
+				return;
+			}
+			sock = open_warm_connection(pool->net, DAEMON_START_PORT + n);
+			if (sock == NULL) {
+				/* Try again the next time one is taken */
+				kfree(conn);
+				break;
+			}
+			conn->sock = sock;
+			spin_lock(&pool->lock);
+			list_add_tail(&conn->list, &pool->conns[n]);
+			pool->counts[n]++;
+			spin_unlock(&pool->lock);
+		}
+	}
+	return;
+}
+
+/**
+ * Opens a loopback connection to a daemon, from and to the addresses
+ * sockets themselves would use. The connect doesn't wait, so a daemon
+ * slow to accept can't hold up the refill. Over loopback the handshake
+ * is nearly always done by the time it returns anyway. A connection
+ * that isn't up yet when taken is closed like a dead one
+ * @param	net - The daemon's network namespace
+ * @param	daemon_id - The daemon's ID, which is also its port
+ * @return	The connected or connecting socket, or NULL on failure
+ */
+struct socket* open_warm_connection(struct net* net, int daemon_id) {
+	struct socket* sock;
+	struct sockaddr_in src_addr = {
+		.sin_family = AF_INET,
+		.sin_port = 0,
+	};
+	struct sockaddr_in daemon_addr = {
+		.sin_family = AF_INET,
+	};
+	int ret;
+
+	ret = sock_create_kern(net, AF_INET, SOCK_STREAM, IPPROTO_TCP, &sock);
+	if (ret != 0) {
+		return NULL;
+	}
+	src_addr.sin_addr.s_addr = loopback_source_addr();
+	daemon_addr.sin_addr.s_addr = loopback_daemon_addr();
+	daemon_addr.sin_port = htons(daemon_id);
+	ret = kernel_bind(sock, (struct sockaddr*)&src_addr, sizeof(src_addr));
+	if (ret == 0) {
+		ret = kernel_connect(sock, (struct sockaddr*)&daemon_addr, sizeof(daemon_addr), O_NONBLOCK);
+	}
+	if (ret == -EINPROGRESS) {
+		ret = 0;
+	}
+	if (ret != 0) {
+		sock_release(sock);
+		return NULL;
+	}
+	return sock;
+}
+
+struct socket* pop_warm_connection(warm_pool_t* pool, int n) {
+	struct warm_conn* conn;
+	struct socket* sock;
+	spin_lock(&pool->lock);
+	conn = list_first_entry_or_null(&pool->conns[n], struct warm_conn, list);
+	if (conn == NULL) {
+		spin_unlock(&pool->lock);
+		return NULL;
+	}
+	list_del(&conn->list);
+	pool->counts[n]--;
+	spin_unlock(&pool->lock);
+	sock = conn->sock;
+	kfree(conn);
+	return sock;
+}
@@ -0,0 +1,17 @@
+#ifndef TLS_WARM_H
+#define TLS_WARM_H
+
+#include <linux/net.h>
+#include "tls_common.h"
+
+struct net;
+
+int tls_warm_setup(void);
+void tls_warm_cleanup(void);
+void refill_warm_pool(struct net* net);
+void drain_warm_pool(struct net* net, int daemon_id);
+struct socket* take_warm_connection(struct net* net, int daemon_id);
+int attach_warm_connection(tls_sock_data_t* sock_data, struct socket* sock);
+void drop_warm_connection(tls_sock_data_t* sock_data);
+
+#endif /* TLS_WARM_H */